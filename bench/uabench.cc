@@ -0,0 +1,483 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code was developed for an EU.EDGE internal project and
+ * is made available according to the terms of this license.
+ *
+ * The Initial Developer of the Original Code is Istvan T. Hernadvolgyi,
+ * EU.EDGE LLC.
+ *
+ * Portions created by EU.EDGE LLC are Copyright (C) EU.EDGE LLC.
+ * All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+// BENCHMARK: SYNTHETIC CORPUS AND END TO END RUNS
+//
+// uabench generates a reproducible corpus (the same seed and scale give
+// the same bytes) and times ua and kua on it under the main option sets.
+// Results are written as JSON, one object per run:
+//
+//    {"tool": "ua", "options": "-2m256", "files": ..., "bytes": ...,
+//     "secs": ..., "files_per_s": ..., "mb_per_s": ..., "max_rss_kb": ...,
+//     "lines": ...}
+//
+// secs is the best of --repeat runs; lines counts the output lines, so a
+// change of results shows up next to a change of speed. The page cache
+// is not dropped: the numbers are warm cache numbers unless the caller
+// drops it between runs.
+//
+// $ cmake --build build --target ua-bench
+//
+// builds ua, kua and uabench and runs it with the defaults.
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+}
+
+static char __help[] =
+"uabench [OPTION]...\n\n"
+"where OPTION is\n"
+"  --ua <path>:     ua to run (default ./ua)\n"
+"  --kua <path>:    kua to run (default ./kua, none to skip)\n"
+"  --dir <dir>:     where corpora are generated (default bench-corpus)\n"
+"  --out <file>:    write JSON results to <file> (default stdout)\n"
+"  --seed <n>:      corpus seed (default 1)\n"
+"  --scale <n>:     corpus scale, 1 is about 250 MB read per run\n"
+"  --repeat <n>:    runs per option set, the best is reported (default 3)\n"
+"  --small <n>:     add <n> files of 4 KB (e.g. 1048576 for the per-file\n"
+"                   costs of small file trees)\n"
+"  --generate:      only generate the corpus\n"
+"  -h:              this help\n";
+
+// option sets, the first ones are the ones every change is judged by
+static const char* __ua_sets[] = {
+   "", "-2m256", "-2nm256", "-a b3", "-M", "-iw", 0
+};
+
+// kua has no milestones or stages
+static const char* __kua_sets[] = { "", "-n", "-a b3", 0 };
+
+// splitmix64: small, fast and the same everywhere
+struct __rng {
+   uint64_t s;
+   explicit __rng(uint64_t seed) : s(seed) { }
+   uint64_t next() {
+      uint64_t z = (s += 0x9e3779b97f4a7c15ull);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+      return z ^ (z >> 31);
+   }
+   // uniform in [lo, hi]
+   size_t range(size_t lo, size_t hi) {
+      return lo + (size_t)(next() % (hi - lo + 1));
+   }
+   void fill(std::string& b, size_t n) {
+      b.resize(n);
+      for(size_t i = 0; i < n; i += 8) {
+         uint64_t r = next();
+         ::memcpy(&b[i], &r, std::min((size_t)8, n - i));
+      }
+   }
+};
+
+static void __mkdir(const std::string& d) {
+   if (::mkdir(d.c_str(), 0755) && errno != EEXIST)
+      throw "Cannot create directory";
+}
+
+static void __write(const std::string& path, const std::string& data) {
+   std::ofstream os(path.c_str(), std::ios::binary | std::ios::trunc);
+   os.write(data.data(), data.size());
+   if (!os.good()) throw "Cannot write file";
+}
+
+// large file written in blocks, last block optionally altered
+static void __write_large(const std::string& path, uint64_t seed, size_t n,
+   int tail) {
+   std::ofstream os(path.c_str(), std::ios::binary | std::ios::trunc);
+   __rng r(seed);
+   std::string b;
+   for(size_t off = 0; off < n; off += 1 << 20) {
+      r.fill(b, std::min((size_t)1 << 20, n - off));
+      if (off + b.size() == n && tail) b[b.size() - 1] ^= (char)tail;
+      os.write(b.data(), b.size());
+   }
+   if (!os.good()) throw "Cannot write file";
+}
+
+// sparse file: a few data blocks in a hole of n bytes
+static void __write_sparse(const std::string& path, uint64_t seed, size_t n) {
+   int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0) throw "Cannot write file";
+   __rng r(seed);
+   std::string b;
+   bool ok = !::ftruncate(fd, n);
+   for(int i = 0; ok && i < 3; ++i) {
+      r.fill(b, 4096);
+      off_t at = (off_t)(r.next() % (n / 4096)) * 4096;
+      ok = ::pwrite(fd, b.data(), b.size(), at) == (ssize_t)b.size();
+   }
+   ::close(fd);
+   if (!ok) throw "Cannot write file";
+}
+
+// text with words from a small vocabulary
+static std::string __text(__rng& r, size_t words) {
+   static const char* vocab[] = {
+      "lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing",
+      "elit", "sed", "do", "eiusmod", "tempor", "incididunt", "ut", "labore"
+   };
+   std::string t;
+   for(size_t i = 0; i < words; ++i) {
+      t += vocab[r.next() % (sizeof(vocab) / sizeof(*vocab))];
+      t += i % 12 == 11 ? "\n" : " ";
+   }
+   return t;
+}
+
+// same text with other white space and case
+static std::string __variant(__rng& r, const std::string& t) {
+   std::string v;
+   for(char c : t) {
+      if (c == ' ' || c == '\n') {
+         static const char* ws[] = { " ", "  ", "\t", " \n", "\r\n" };
+         v += ws[r.next() % 5];
+      } else v += r.next() % 4 ? c : (char)::toupper(c);
+   }
+   return v;
+}
+
+static std::string __name(const std::string& dir, const char* kind,
+   size_t i, size_t j) {
+   std::ostringstream os;
+   os << dir << "/" << kind << "/" << kind << "-" << i << "-" << j;
+   return os.str();
+}
+
+/** Generate the corpus unless it is already there.
+ * @param dir corpus directory (seed and scale are part of its name)
+ * @param seed seed
+ * @param scale scale
+ * @param small number of 4 KB files
+ * @param files file names (returned)
+ */
+static void __generate(const std::string& dir, uint64_t seed, size_t scale,
+   size_t small, std::vector<std::string>& files) {
+   const std::string stamp = dir + "/.complete";
+   struct stat st;
+   bool have = !::stat(stamp.c_str(), &st);
+
+   __mkdir(dir);
+   const char* kinds[] = {
+      "unique", "cluster", "large", "tail", "sparse", "text", "small", 0
+   };
+   for(int k = 0; kinds[k]; ++k) __mkdir(dir + "/" + kinds[k]);
+
+   __rng r(seed);
+   std::string b;
+   auto add = [&](const std::string& path, const std::string& data) {
+      if (!have) __write(path, data);
+      files.push_back(path);
+   };
+
+   // many small unique files
+   for(size_t i = 0; i < 2000 * scale; ++i) {
+      r.fill(b, r.range(100, 16384));
+      add(__name(dir, "unique", i, 0), b);
+   }
+
+   // clusters of the same size with different content, one pair equal
+   for(size_t i = 0; i < 20 * scale; ++i) {
+      size_t n = 65536 * (i % 8 + 1) + i;
+      std::string first;
+      for(size_t j = 0; j < 10; ++j) {
+         if (j != 1) r.fill(b, n);
+         if (!j) first = b;
+         add(__name(dir, "cluster", i, j), j == 1 ? first : b);
+      }
+   }
+
+   // large duplicates: sets of three copies
+   for(size_t i = 0; i < 4 * scale; ++i) {
+      uint64_t s = r.next();
+      for(size_t j = 0; j < 3; ++j) {
+         std::string path = __name(dir, "large", i, j);
+         if (!have) __write_large(path, s, (4 << 20) + i, 0);
+         files.push_back(path);
+      }
+   }
+
+   // files that differ only in their last byte (two of them equal)
+   for(size_t i = 0; i < 4 * scale; ++i) {
+      uint64_t s = r.next();
+      for(size_t j = 0; j < 4; ++j) {
+         std::string path = __name(dir, "tail", i, j);
+         if (!have) __write_large(path, s, (2 << 20) + 3 * i, j ? (int)j - 1 : 0);
+         files.push_back(path);
+      }
+   }
+
+   // sparse files, pairs of equal ones
+   for(size_t i = 0; i < 5 * scale; ++i) {
+      uint64_t s = r.next();
+      for(size_t j = 0; j < 2; ++j) {
+         std::string path = __name(dir, "sparse", i, j);
+         if (!have) __write_sparse(path, s, (8 << 20) + 4096 * i);
+         files.push_back(path);
+      }
+   }
+
+   // families of text that are the same for -iw
+   for(size_t i = 0; i < 40 * scale; ++i) {
+      std::string t = __text(r, r.range(200, 2000));
+      for(size_t j = 0; j < 5; ++j)
+         add(__name(dir, "text", i, j), j ? __variant(r, t) : t);
+   }
+
+   // files of one size, every 100th a copy of the one before: all are
+   // hashed, so per-file costs dominate
+   for(size_t i = 0; i < small; ++i) {
+      if (i % 100 != 1) r.fill(b, 4096);
+      add(__name(dir, "small", i, 0), b);
+   }
+
+   if (!have) __write(stamp, "");
+}
+
+static double __now() {
+   struct timespec ts;
+   ::clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// split an option set into words
+static std::vector<std::string> __words(const char* s) {
+   std::vector<std::string> w;
+   std::istringstream is(s);
+   for(std::string t; is >> t;) w.push_back(t);
+   return w;
+}
+
+/** Run a program with the file list on stdin.
+ * @param argv program and arguments
+ * @param list file holding the file names
+ * @param out where stdout goes
+ * @param rss peak RSS of the child in KB (returned)
+ * @return wall seconds, negative if the run failed
+ */
+static double __run(const std::vector<std::string>& argv,
+   const std::string& list, const std::string& out, long& rss) {
+   std::vector<char*> av;
+   for(const auto& a : argv) av.push_back(const_cast<char*>(a.c_str()));
+   av.push_back(0);
+
+   double t0 = __now();
+   pid_t pid = ::fork();
+   if (pid < 0) return -1;
+   if (!pid) {
+      int in = ::open(list.c_str(), O_RDONLY);
+      int o = ::open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (in < 0 || o < 0) ::_exit(127);
+      ::dup2(in, 0);
+      ::dup2(o, 1);
+      ::execv(av[0], av.data());
+      ::_exit(127);
+   }
+   int status;
+   struct rusage ru;
+   if (::wait4(pid, &status, 0, &ru) != pid) return -1;
+   double secs = __now() - t0;
+   rss = ru.ru_maxrss;
+   if (!WIFEXITED(status) || WEXITSTATUS(status)) return -1;
+   return secs;
+}
+
+static size_t __lines(const std::string& path) {
+   std::ifstream is(path.c_str());
+   size_t n = 0;
+   for(std::string l; std::getline(is, l);) ++n;
+   return n;
+}
+
+static std::string __jstr(const std::string& s) {
+   std::string r = "\"";
+   for(char c : s) {
+      if (c == '"' || c == '\\') r += '\\';
+      r += c;
+   }
+   return r + "\"";
+}
+
+int main(int argc, char* const* argv) {
+   std::string ua = "./ua";
+   std::string kua = "./kua";
+   std::string dir = "bench-corpus";
+   std::string out;
+   uint64_t seed = 1;
+   size_t scale = 1;
+   size_t small = 0;
+   int repeat = 3;
+   bool generate = false;
+
+   static struct option longopts[] = {
+      { "ua", required_argument, 0, 'u' },
+      { "kua", required_argument, 0, 'k' },
+      { "dir", required_argument, 0, 'd' },
+      { "out", required_argument, 0, 'o' },
+      { "seed", required_argument, 0, 's' },
+      { "scale", required_argument, 0, 'x' },
+      { "repeat", required_argument, 0, 'r' },
+      { "small", required_argument, 0, 'm' },
+      { "generate", no_argument, 0, 'g' },
+      { 0, 0, 0, 0 }
+   };
+
+   int opt;
+   while((opt = ::getopt_long(argc, argv, "h", longopts, 0)) != -1) {
+      switch(opt) {
+         case 'u': ua = ::optarg; break;
+         case 'k': kua = ::optarg; break;
+         case 'd': dir = ::optarg; break;
+         case 'o': out = ::optarg; break;
+         case 's': seed = ::strtoull(::optarg, 0, 10); break;
+         case 'x': scale = ::atoi(::optarg); break;
+         case 'r': repeat = ::atoi(::optarg); break;
+         case 'm': small = ::strtoull(::optarg, 0, 10); break;
+         case 'g': generate = true; break;
+         case 'h':
+            std::cout << __help;
+            return 0;
+         default:
+            std::cerr << __help;
+            return 1;
+      }
+   }
+   if (!scale || repeat < 1) {
+      std::cerr << "Invalid scale or repeat count" << std::endl;
+      return 1;
+   }
+
+   std::ostringstream cd;
+   cd << dir << "/s" << seed << "-x" << scale;
+   if (small) cd << "-m" << small;
+   const std::string corpus = cd.str();
+
+   std::vector<std::string> files;
+   try {
+      __mkdir(dir);
+      __generate(corpus, seed, scale, small, files);
+   } catch(const char* e) {
+      std::cerr << e << " under " << corpus << std::endl;
+      return 1;
+   }
+
+   unsigned long long bytes = 0;
+   {
+      std::ofstream ls((corpus + ".list").c_str());
+      for(const auto& f : files) {
+         struct stat st;
+         if (!::stat(f.c_str(), &st)) bytes += st.st_size;
+         ls << f << "\n";
+      }
+   }
+   std::cerr << "Corpus " << corpus << ": " << files.size() << " files, "
+             << bytes / 1048576.0 << " MB" << std::endl;
+   if (generate) return 0;
+
+   std::ostringstream res;
+   res << "[";
+   bool first = true;
+   int failed = 0;
+
+   auto bench = [&](const std::string& tool, const std::string& path,
+                    const char* set, const std::vector<std::string>& pre) {
+      std::vector<std::string> av(1, path);
+      av.insert(av.end(), pre.begin(), pre.end());
+      for(const auto& w : __words(set)) av.push_back(w);
+      av.push_back("-");
+
+      const std::string o = corpus + ".out";
+      double best = -1;
+      long rss = 0;
+      for(int i = 0; i < repeat; ++i) {
+         long r = 0;
+         double s = __run(av, corpus + ".list", o, r);
+         if (s < 0) { best = -1; break; }
+         if (best < 0 || s < best) best = s;
+         rss = std::max(rss, r);
+      }
+      if (best < 0) {
+         std::cerr << tool << " " << set << ": failed" << std::endl;
+         ++failed;
+         return;
+      }
+
+      res << (first ? "\n" : ",\n") << "  {\"tool\": " << __jstr(tool)
+          << ", \"options\": " << __jstr(set) << ", \"files\": "
+          << files.size() << ", \"bytes\": " << bytes << ", \"secs\": "
+          << best << ", \"files_per_s\": " << files.size() / best
+          << ", \"mb_per_s\": " << bytes / 1048576.0 / best
+          << ", \"max_rss_kb\": " << rss << ", \"lines\": "
+          << __lines(o) << "}";
+      first = false;
+      std::cerr << tool << " " << set << ": " << best << " s" << std::endl;
+   };
+
+   for(int i = 0; __ua_sets[i]; ++i)
+      bench("ua", ua, __ua_sets[i], std::vector<std::string>());
+   if (kua != "none") {
+      // look for the copies of one of the large files
+      std::vector<std::string> pre;
+      pre.push_back("-f");
+      pre.push_back(__name(corpus, "large", 0, 0));
+      for(int i = 0; __kua_sets[i]; ++i) bench("kua", kua, __kua_sets[i], pre);
+   }
+   res << (first ? "]\n" : "\n]\n");
+
+   if (out.size()) {
+      std::ofstream os(out.c_str());
+      os << res.str();
+      if (!os.good()) {
+         std::cerr << "Could not write " << out << std::endl;
+         return 1;
+      }
+   } else std::cout << res.str();
+
+   return failed ? 1 : 0;
+}
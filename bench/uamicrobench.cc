@@ -0,0 +1,388 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code was developed for an EU.EDGE internal project and
+ * is made available according to the terms of this license.
+ *
+ * The Initial Developer of the Original Code is Istvan T. Hernadvolgyi,
+ * EU.EDGE LLC.
+ *
+ * Portions created by EU.EDGE LLC are Copyright (C) EU.EDGE LLC.
+ * All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+// BENCHMARK: HASH AND NORMALIZATION KERNELS
+//
+// uamicrobench measures per-call throughput of the kernels scans spend
+// their CPU time in, for buffers of 64 B to 64 MB:
+//
+//    hash/<alg>                 hasher fed in -b sized blocks, as
+//                               filei::calc does
+//    hash_setup/<alg>           making and finishing a hasher, the
+//                               per-file cost of small files
+//    hash_many/<alg>            hasher::many over 16 buffers of up to
+//                               64 KB (size is the total), as ua hashes
+//                               small files
+//    blake3_hash_many/<tier>    BLAKE3 chunk hashing with the dispatch
+//                               forced to one SIMD tier (tiers the CPU
+//                               lacks are skipped)
+//    lower_case, remove_white   -i and -w normalization of a block
+//    bytesame, same             the compare loops of filei::eq (same
+//                               with -i and -w), over equal inputs
+//    memcpy                     the cost of refilling a buffer, which
+//                               the in-place kernels include
+//
+// Results are JSON, one object per kernel and size:
+//
+//    {"kernel": "hash/md5", "size": 65536, "calls": ..., "secs": ...,
+//     "ns_per_call": ..., "mb_per_s": ...}
+//
+// The dispatch override needs blake3_dispatch.c built with
+// BLAKE3_TESTING, which the ua-microbench targets do.
+
+#include <filei.h>
+#include <blake3_impl.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <getopt.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+}
+
+// the dispatch override of blake3_dispatch.c (BLAKE3_TESTING)
+extern "C" int g_cpu_features;
+
+static char __help[] =
+"uamicrobench [OPTION]...\n\n"
+"where OPTION is\n"
+"  --out <file>:      write JSON results to <file> (default stdout)\n"
+"  --min-time <s>:    seconds spent on each kernel and size (default 0.1)\n"
+"  --max-size <n>:    largest buffer (default 67108864)\n"
+"  --filter <text>:   only kernels whose name contains <text>\n"
+"  -b <bsize>:        block size of the hash path (default 1024)\n"
+"  -h:                this help\n";
+
+// feature bits of blake3_dispatch.c
+enum {
+   __SSE2 = 1 << 0, __SSSE3 = 1 << 1, __SSE41 = 1 << 2, __AVX = 1 << 3,
+   __AVX2 = 1 << 4, __AVX512F = 1 << 5, __AVX512VL = 1 << 6
+};
+
+struct __tier {
+   const char* name;
+   int features;  // value forced into g_cpu_features
+   bool have;     // the CPU can run it
+};
+
+// read only stream over memory, no copies
+struct __membuf : std::streambuf {
+   __membuf(const char* p, size_t n) {
+      char* b = const_cast<char*>(p);
+      setg(b, b, b + n);
+   }
+};
+
+static double __now() {
+   struct timespec ts;
+   ::clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// defeat dead code elimination
+static volatile unsigned long long __sink;
+
+// text with mixed case and runs of white space
+static void __text(std::string& t, size_t n) {
+   static const char* words[] = {
+      "Lorem", "ipsum", "DOLOR", "sit", "amet,", "Consectetur", "adipiscing"
+   };
+   static const char* ws[] = { " ", "  ", "\t", "\n", " \r\n" };
+   uint64_t s = 88172645463325252ull;
+   t.clear();
+   while(t.size() < n) {
+      s ^= s << 13, s ^= s >> 7, s ^= s << 17;
+      t += words[s % 7];
+      t += ws[(s >> 8) % 5];
+   }
+   t.resize(n);
+}
+
+class __bench {
+
+   public:
+
+      __bench(std::ostream& os, double min, const std::string& filter)
+      :_os(os),_min(min),_filter(filter),_first(true) { }
+
+      ~__bench() { _os << (_first ? "[]\n" : "\n]\n"); }
+
+      bool wanted(const std::string& kernel) const {
+         return _filter.empty() || kernel.find(_filter) != std::string::npos;
+      }
+
+      // call f until min seconds passed and report
+      template<class F>
+      void run(const std::string& kernel, size_t size, F f) {
+         if (!wanted(kernel)) return;
+         f(); // warm up
+         unsigned long long calls = 0;
+         double t0 = __now(), t = 0;
+         for(unsigned long long batch = 1;; batch <<= 1) {
+            for(unsigned long long i = 0; i < batch; ++i) f();
+            calls += batch;
+            if ((t = __now() - t0) >= _min) break;
+         }
+         _os << (_first ? "[\n" : ",\n") << "  {\"kernel\": \"" << kernel
+             << "\", \"size\": " << size << ", \"calls\": " << calls
+             << ", \"secs\": " << t << ", \"ns_per_call\": "
+             << t * 1e9 / calls << ", \"mb_per_s\": "
+             << size * (double)calls / 1048576.0 / t << "}";
+         _os.flush();
+         _first = false;
+         std::cerr << kernel << " " << size << ": ";
+         if (size) std::cerr << size * (double)calls / 1048576.0 / t << " MB/s";
+         else std::cerr << t * 1e9 / calls << " ns/call";
+         std::cerr << std::endl;
+      }
+
+   private:
+
+      std::ostream& _os;
+      double _min;
+      std::string _filter;
+      bool _first;
+};
+
+int main(int argc, char* const* argv) {
+   std::string out;
+   std::string filter;
+   double min = 0.1;
+   size_t max = 64ul << 20;
+   size_t bn = 1024;
+
+   static struct option longopts[] = {
+      { "out", required_argument, 0, 'o' },
+      { "min-time", required_argument, 0, 't' },
+      { "max-size", required_argument, 0, 'x' },
+      { "filter", required_argument, 0, 'f' },
+      { 0, 0, 0, 0 }
+   };
+
+   int opt;
+   while((opt = ::getopt_long(argc, argv, "hb:", longopts, 0)) != -1) {
+      switch(opt) {
+         case 'o': out = ::optarg; break;
+         case 't': min = ::atof(::optarg); break;
+         case 'x': max = ::strtoull(::optarg, 0, 10); break;
+         case 'f': filter = ::optarg; break;
+         case 'b': bn = ::strtoull(::optarg, 0, 10); break;
+         case 'h':
+            std::cout << __help;
+            return 0;
+         default:
+            std::cerr << __help;
+            return 1;
+      }
+   }
+   if (!bn || !max || min <= 0) {
+      std::cerr << "Invalid block size, maximum size or time" << std::endl;
+      return 1;
+   }
+
+   std::ofstream of;
+   if (out.size()) {
+      of.open(out.c_str());
+      if (!of.good()) {
+         std::cerr << "Could not write " << out << std::endl;
+         return 1;
+      }
+   }
+   std::ostream& os = out.size() ? of : std::cout;
+
+   std::vector<size_t> sizes;
+   for(size_t n = 64; n <= max; n <<= 2) sizes.push_back(n);
+
+   std::string data, text;
+   __text(text, sizes.empty() ? 0 : sizes.back());
+   data = text;
+   for(size_t i = 0; i < data.size(); ++i) data[i] ^= (char)(i * 131);
+   std::vector<char> work(data.size()), other(data.size());
+   std::vector<char> b1(bn), b2(bn);
+
+   __bench b(os, min, filter);
+
+   // hash algorithms through the hasher, in blocks as in filei::calc
+   struct { const char* name; filei_hash_alg alg; } algs[] = {
+      { "md5", filei_hash_alg::MD5 }, { "sha1", filei_hash_alg::SHA1 },
+      { "sha256", filei_hash_alg::SHA256 }, { "b3", filei_hash_alg::BLAKE3 },
+      { "xxh64", filei_hash_alg::XXHASH64 }
+   };
+   try {
+      for(const auto& a : algs) {
+         for(size_t n : sizes) {
+            b.run(std::string("hash/") + a.name, n, [&]() {
+               hasher h(a.alg);
+               for(size_t off = 0; off < n; off += bn)
+                  h.update(&data[off], std::min(bn, n - off));
+               unsigned char d[FILEI_SHA256_LEN];
+               h.final(d);
+               __sink += d[0];
+            });
+         }
+      }
+   } catch(const char* e) {
+      std::cerr << e << std::endl;
+      return 1;
+   }
+
+   // what every file pays before its first byte is hashed
+   try {
+      for(const auto& a : algs) {
+         b.run(std::string("hash_setup/") + a.name, 0, [&]() {
+            hasher h(a.alg);
+            unsigned char d[FILEI_SHA256_LEN];
+            h.final(d);
+            __sink += d[0];
+         });
+      }
+   } catch(const char* e) {
+      std::cerr << e << std::endl;
+      return 1;
+   }
+
+   // batches of small files, side by side where the algorithm can
+   try {
+      const size_t nb = 16;
+      for(const auto& a : algs) {
+         for(size_t n : sizes) {
+            if (n > (64 << 10) || n + nb > data.size()) break;
+            std::vector<const unsigned char*> in(nb);
+            std::vector<size_t> lens(nb, n);
+            for(size_t i = 0; i < nb; ++i)
+               in[i] = reinterpret_cast<const unsigned char*>(&data[i]);
+            std::vector<unsigned char> d(nb * hasher::len(a.alg));
+            b.run(std::string("hash_many/") + a.name, n * nb, [&]() {
+               hasher::many(a.alg, &in[0], &lens[0], nb, &d[0]);
+               __sink += d[0];
+            });
+         }
+      }
+   } catch(const char* e) {
+      std::cerr << e << std::endl;
+      return 1;
+   }
+
+   // blake3_hash_many per dispatch tier, whole chunks only
+   __tier tiers[] = {
+      { "portable", 0, true },
+      { "sse2", __SSE2, (bool)__builtin_cpu_supports("sse2") },
+      { "sse41", __SSE2 | __SSSE3 | __SSE41,
+        (bool)__builtin_cpu_supports("sse4.1") },
+      { "avx2", __SSE2 | __SSSE3 | __SSE41 | __AVX | __AVX2,
+        (bool)__builtin_cpu_supports("avx2") },
+      { "avx512", __SSE2 | __SSSE3 | __SSE41 | __AVX | __AVX2 | __AVX512F |
+        __AVX512VL, __builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512vl") }
+   };
+   const uint32_t key[8] = {
+      0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+      0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+   };
+   for(const auto& t : tiers) {
+      if (!t.have) {
+         std::cerr << "blake3_hash_many/" << t.name << ": not supported"
+                   << std::endl;
+         continue;
+      }
+      g_cpu_features = t.features;
+      for(size_t n : sizes) {
+         size_t chunks = n / BLAKE3_CHUNK_LEN;
+         if (!chunks) continue;
+         std::vector<const uint8_t*> inputs(chunks);
+         for(size_t i = 0; i < chunks; ++i)
+            inputs[i] = (const uint8_t*)&data[i * BLAKE3_CHUNK_LEN];
+         std::vector<uint8_t> cvs(chunks * BLAKE3_OUT_LEN);
+         b.run(std::string("blake3_hash_many/") + t.name, n, [&]() {
+            blake3_hash_many(inputs.data(), chunks,
+               BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN, key, 0, true, 0,
+               CHUNK_START, CHUNK_END, cvs.data());
+            __sink += cvs[0];
+         });
+      }
+   }
+   // back to detection for everything else
+   g_cpu_features = 1 << 30;
+
+   // normalization, in place on a fresh copy of the text
+   for(size_t n : sizes) {
+      b.run("memcpy", n, [&]() {
+         ::memcpy(work.data(), text.data(), n);
+         __sink += work[n - 1];
+      });
+   }
+   for(size_t n : sizes) {
+      b.run("lower_case", n, [&]() {
+         ::memcpy(work.data(), text.data(), n);
+         filei_kernels::lower_case(work.data(), n);
+         __sink += work[n - 1];
+      });
+   }
+   // remove_white shifts the rest of the buffer for every run of white
+   // space, so it is quadratic in the buffer size: filei::calc only calls
+   // it on -b sized blocks, larger sizes are not measured
+   for(size_t n : sizes) {
+      if (n > (256ul << 10)) break;
+      b.run("remove_white", n, [&]() {
+         ::memcpy(work.data(), text.data(), n);
+         __sink += filei_kernels::remove_white(work.data(), (int)n);
+      });
+   }
+
+   // compare loops over equal inputs, read in -b sized blocks
+   ::memcpy(other.data(), text.data(), text.size());
+   for(size_t n : sizes) {
+      b.run("bytesame", n, [&]() {
+         __membuf m1(text.data(), n), m2(other.data(), n);
+         std::istream is1(&m1), is2(&m2);
+         __sink += filei_kernels::bytesame(is1, is2, b1.data(), b2.data(),
+            bn, bn, 0);
+      });
+   }
+   for(size_t n : sizes) {
+      b.run("same", n, [&]() {
+         __membuf m1(text.data(), n), m2(other.data(), n);
+         std::istream is1(&m1), is2(&m2);
+         __sink += filei_kernels::same(is1, is2, b1.data(), b2.data(),
+            bn, bn, 0, true, true);
+      });
+   }
+
+   return 0;
+}
@@ -37,32 +37,220 @@
 extern "C" {
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <openssl/evp.h>
 #include "blake3.h"
+#define XXH_STATIC_LINKING_ONLY
 #include "xxhash.h"
 }
 
 #include <fstream>
 
+#include <md5many.h>
+
 void* (*filei::_gbuff)(size_t) = &filei::gbuff;
 size_t (*filei::_buffc)() = &filei::buffc;
 void (*filei::_relbuff)(void*) = 0;
 char filei::_buffer[__UABUFFSIZE];
+
+// I/O of this thread
+static thread_local filei_io __tio = { 0, 0, 0, 0, 0 };
+
+filei_io& filei::tio() { return __tio; }
      
-filei::filei(const std::string& path, bool ic, bool iw, size_t m, size_t bs, filei_hash_alg alg)
-:_path(path),_h(0),_alg(alg)  {
-   memset(_hash, 0, FILEI_SHA256_LEN);
+struct hasher::state {
+   EVP_MD_CTX* evp;
+   blake3_hasher b3;
+   XXH64_state_t xxh;
+
+   state():evp(0) { }
+   ~state() { if (evp) EVP_MD_CTX_free(evp); }
+};
+
+// states kept per thread
+static const size_t __pool_max = 16;
+
+int hasher::len(filei_hash_alg alg) {
+   switch (alg) {
+      case filei_hash_alg::MD5: return FILEI_MD5_LEN;
+      case filei_hash_alg::SHA1: return FILEI_SHA1_LEN;
+      case filei_hash_alg::SHA256: return FILEI_SHA256_LEN;
+      case filei_hash_alg::BLAKE3: return FILEI_BLAKE3_LEN;
+      case filei_hash_alg::XXHASH64: return FILEI_XXHASH64_LEN;
+   }
+   return 0;
+}
+
+// the OpenSSL digest of an algorithm, 0 for the others; OpenSSL 3
+// looks up the provider on every EVP_md5(), a fetched digest is kept
+static const EVP_MD* __evp_md(filei_hash_alg alg) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+   switch (alg) {
+      case filei_hash_alg::MD5: {
+         static EVP_MD* md = EVP_MD_fetch(nullptr, "MD5", nullptr);
+         return md;
+      }
+      case filei_hash_alg::SHA1: {
+         static EVP_MD* md = EVP_MD_fetch(nullptr, "SHA1", nullptr);
+         return md;
+      }
+      case filei_hash_alg::SHA256: {
+         static EVP_MD* md = EVP_MD_fetch(nullptr, "SHA256", nullptr);
+         return md;
+      }
+      default:
+         return 0;
+   }
+#else
+   switch (alg) {
+      case filei_hash_alg::MD5: return EVP_md5();
+      case filei_hash_alg::SHA1: return EVP_sha1();
+      case filei_hash_alg::SHA256: return EVP_sha256();
+      default: return 0;
+   }
+#endif
+}
+
+std::vector<std::unique_ptr<hasher::state> >& hasher::pool() {
+   static thread_local std::vector<std::unique_ptr<state> > p;
+   return p;
+}
+
+hasher::state* hasher::acquire() {
+   std::vector<std::unique_ptr<state> >& p = pool();
+   if (p.empty()) return new state;
+   state* s = p.back().release();
+   p.pop_back();
+   return s;
+}
+
+void hasher::release(state* s) {
+   std::vector<std::unique_ptr<state> >& p = pool();
+   if (p.size() < __pool_max) p.push_back(std::unique_ptr<state>(s));
+   else delete s;
+}
+
+hasher::hasher(filei_hash_alg alg)
+:_alg(alg),_s(acquire()) {
+   bool ok = true;
    switch (_alg) {
-      case filei_hash_alg::MD5: _hash_len = FILEI_MD5_LEN; break;
-      case filei_hash_alg::SHA1: _hash_len = FILEI_SHA1_LEN; break;
-      case filei_hash_alg::SHA256: _hash_len = FILEI_SHA256_LEN; break;
-      case filei_hash_alg::BLAKE3: _hash_len = FILEI_BLAKE3_LEN; break;
-      case filei_hash_alg::XXHASH64: _hash_len = FILEI_XXHASH64_LEN; break;
+      case filei_hash_alg::MD5:
+      case filei_hash_alg::SHA1:
+      case filei_hash_alg::SHA256: {
+         // the fetch fails when no provider has the digest (MD5 under FIPS)
+         const EVP_MD* evp_md = __evp_md(_alg);
+         if (evp_md && !_s->evp) _s->evp = EVP_MD_CTX_new();
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+         ok = evp_md && _s->evp &&
+            EVP_DigestInit_ex2(_s->evp, evp_md, nullptr) == 1;
+#else
+         ok = evp_md && _s->evp &&
+            EVP_DigestInit_ex(_s->evp, evp_md, nullptr) == 1;
+#endif
+         break;
+      }
+      case filei_hash_alg::BLAKE3:
+         blake3_hasher_init(&_s->b3);
+         break;
+      case filei_hash_alg::XXHASH64:
+         XXH64_reset(&_s->xxh, 0);
+         break;
+   }
+   if (!ok) {
+      delete _s;
+      throw "Could not init hash";
+   }
+}
+
+hasher::hasher(const hasher& o)
+:_alg(o._alg),_s(acquire()) {
+   _s->b3 = o._s->b3;
+   _s->xxh = o._s->xxh;
+   if (o._s->evp) {
+      if (!_s->evp) _s->evp = EVP_MD_CTX_new();
+      if (!_s->evp || EVP_MD_CTX_copy_ex(_s->evp, o._s->evp) != 1) {
+         delete _s;
+         throw "Could not copy hash state";
+      }
    }
-   calc(ic,iw,bs,m);
+}
+
+hasher::~hasher() {
+   release(_s);
+}
+
+void hasher::update(const void* p, size_t n) {
+   bool ok = true;
+   switch (_alg) {
+      case filei_hash_alg::MD5:
+      case filei_hash_alg::SHA1:
+      case filei_hash_alg::SHA256:
+         ok = EVP_DigestUpdate(_s->evp, p, n) == 1;
+         break;
+      case filei_hash_alg::BLAKE3:
+         blake3_hasher_update(&_s->b3, p, n);
+         break;
+      case filei_hash_alg::XXHASH64:
+         ok = XXH64_update(&_s->xxh, p, n) == XXH_OK;
+         break;
+   }
+   if (!ok) throw "Hash calc error";
+}
+
+void hasher::final(unsigned char* out) {
+   bool ok = true;
+   switch (_alg) {
+      case filei_hash_alg::MD5:
+      case filei_hash_alg::SHA1:
+      case filei_hash_alg::SHA256:
+         ok = EVP_DigestFinal_ex(_s->evp, out, nullptr) == 1;
+         break;
+      case filei_hash_alg::BLAKE3:
+         blake3_hasher_finalize(&_s->b3, out, FILEI_BLAKE3_LEN);
+         break;
+      case filei_hash_alg::XXHASH64: {
+         XXH64_hash_t xxh = XXH64_digest(&_s->xxh);
+         memcpy(out, &xxh, FILEI_XXHASH64_LEN);
+         break;
+      }
+   }
+   if (!ok) throw "Hash calc error (final)";
+}
+     
+void hasher::many(filei_hash_alg alg, const unsigned char* const* in,
+   const size_t* lens, size_t n, unsigned char* out) {
+   if (alg == filei_hash_alg::MD5) {
+      md5_many(in, lens, n, out);
+      return;
+   }
+   const int l = len(alg);
+   for(size_t i = 0; i < n; ++i) {
+      hasher h(alg);
+      h.update(in[i], lens[i]);
+      h.final(out + i * l);
+   }
+}
+     
+filei::filei(const std::string& path, bool ic, bool iw, size_t m, size_t bs,
+   filei_hash_alg alg, bool keep)
+:_path(path),_h(0),_alg(alg),_hash_len(hasher::len(alg)),_off(0)  {
+   memset(_hash, 0, FILEI_SHA256_LEN);
+   calc(ic,iw,bs,m,0,0,keep);
+}
+
+filei::filei(const filei& prefix, bool ic, size_t bs)
+:_path(prefix._path),_h(0),_alg(prefix._alg),_hash_len(prefix._hash_len),
+ _off(0) {
+   memset(_hash, 0, FILEI_SHA256_LEN);
+   calc(ic,false,bs,0,prefix._state.get(),prefix._off);
+}
+
+filei filei::resume(const filei& prefix, bool ic, size_t bs) {
+   if (!prefix._state) throw "No hash state to resume";
+   return filei(prefix, ic, bs);
 }
 
 // in-place turn buffer into lower case
@@ -108,16 +296,16 @@ static int __remove_white(char* buffer, int n) {
    return r;
 }
 
-void filei::calc(bool ic, bool iw, size_t bn, size_t m) {
+void filei::calc(bool ic, bool iw, size_t bn, size_t m,
+   const hasher* from, off_t off, bool keep) {
    const char* error = 0;
    char* buffer = 0;
    size_t tot = 0;
-   bool ok = false;
-   EVP_MD_CTX* evp_ctx = 0;
-   const EVP_MD* evp_md = 0;
-   blake3_hasher blake3_ctx;
+   hasher* h = 0;
    std::ifstream is(_path.c_str());
+   ++__tio.opens;
    if (!is.good()) { error = "Could not open file"; goto FINALLY; }
+   if (off && !is.seekg(off)) { error = "Could not seek in file"; goto FINALLY; }
    try {
       buffer= static_cast<char*>((*_gbuff)(bn));   // get buffer
       if (!buffer) throw 1;
@@ -126,107 +314,93 @@ void filei::calc(bool ic, bool iw, size_t bn, size_t m) {
       goto FINALLY;
    }
    bn = _buffc ? std::min(bn,(*_buffc)()) : bn;  // get buffer size
-   switch (_alg) {
-      case filei_hash_alg::MD5:
-         evp_md = EVP_md5();
-         break;
-      case filei_hash_alg::SHA1:
-         evp_md = EVP_sha1();
-         break;
-      case filei_hash_alg::SHA256:
-         evp_md = EVP_sha256();
-         break;
-      case filei_hash_alg::BLAKE3:
-         blake3_hasher_init(&blake3_ctx);
-         ok = true;
-         break;
-      case filei_hash_alg::XXHASH64:
-         ok = true; // handled as one-shot below
-         break;
-   }
-   if (evp_md) {
-      evp_ctx = EVP_MD_CTX_new();
-      if (!evp_ctx) { error = "Could not allocate hash context"; goto FINALLY; }
-      ok = EVP_DigestInit_ex(evp_ctx, evp_md, nullptr) == 1;
-   }
-   if (!ok) { error = "Could not init hash"; goto FINALLY; }
-   if (_alg == filei_hash_alg::XXHASH64) {
-      // One-shot hash for xxHash64
-      std::vector<char> all_data;
-      while (is) {
-         is.read(buffer, bn);
-         all_data.insert(all_data.end(), buffer, buffer + is.gcount());
-      }
-      uint64_t xxh = XXH64(all_data.data(), all_data.size(), 0);
-      memcpy(_hash, &xxh, FILEI_XXHASH64_LEN);
-      _h = xxh;
-      goto FINALLY;
-   }
-   for(bool done=false;!done;) {
-      is.read(buffer,bn);
-      size_t n = is.gcount();
-      if (!n) break;
-      if (ic) __lower_case(buffer,n);
-      if (iw) {
-         n -=  __remove_white(buffer,n);
-         if (!n) continue;
-      }
-      if (m) {
-         if (tot + n > m) {
+   try {
+      h = from ? new hasher(*from) : new hasher(_alg);
+      for(bool done=false;!done;) {
+         is.read(buffer,bn);
+         size_t n = is.gcount();
+         __tio.bytes += n;
+         ++__tio.reads;
+         if (!n) break;
+         if (ic) __lower_case(buffer,n);
+         if (iw) {
+            n -=  __remove_white(buffer,n);
+            if (!n) continue;
+         }
+         if (m && tot + n > m) {
             n = m - tot;
             done = true;
-         } else tot += n;
+         }
+         tot += n;
+         h->update(buffer, n);
+         if (is.eof()) break;
       }
-      switch (_alg) {
-         case filei_hash_alg::MD5:
-         case filei_hash_alg::SHA1:
-         case filei_hash_alg::SHA256:
-            ok = EVP_DigestUpdate(evp_ctx, buffer, n) == 1;
-            break;
-         case filei_hash_alg::BLAKE3:
-            blake3_hasher_update(&blake3_ctx, buffer, n);
-            ok = true;
-            break;
-         case filei_hash_alg::XXHASH64:
-            // handled above
-            ok = true;
-            break;
+      // without iw, the bytes hashed are the bytes of the file
+      if (keep && !iw) {
+         _state = std::shared_ptr<hasher>(new hasher(*h));
+         _off = off + tot;
       }
-      if (!ok) { error = "Hash calc error"; goto FINALLY; }
-      if (is.eof()) break;
-   }
-   switch (_alg) {
-      case filei_hash_alg::MD5:
-      case filei_hash_alg::SHA1:
-      case filei_hash_alg::SHA256:
-         ok = EVP_DigestFinal_ex(evp_ctx, _hash, nullptr) == 1;
-         break;
-      case filei_hash_alg::BLAKE3:
-         blake3_hasher_finalize(&blake3_ctx, _hash, FILEI_BLAKE3_LEN);
-         ok = true;
-         break;
-      case filei_hash_alg::XXHASH64:
-         // handled above
-         break;
+      h->final(_hash);
+   } catch(const char* e) {
+      error = e;
+      goto FINALLY;
+   } catch(...) {
+      error = "Could not allocate memory";
+      goto FINALLY;
    }
-   if (!ok) { error= "Hash calc error (final)"; goto FINALLY; }
    for(int i = 0, s = 0; i < _hash_len; ++i, ++s) {
       if (s >= (int)sizeof(size_t)) s = 0;
       _h ^= ((size_t)_hash[i]) << (s << 3);
    }
 FINALLY:
    is.close();
-   if (evp_ctx) EVP_MD_CTX_free(evp_ctx);
+   delete h;
    if (_relbuff) (*_relbuff)(buffer);
    if (error) throw error;
 }
 
-off_t filei::fsize(const std::string& path) {
+unsigned long long filei::sample(const std::string& path,
+   const std::vector<off_t>& offs, size_t bs, bool ic) {
+
+   const char* error = 0;
+   char* buffer = 0;
+   XXH64_state_t xxh_ctx;
+   XXH64_reset(&xxh_ctx, 0);
+
+   int fd = ::open(path.c_str(), O_RDONLY);
+   ++__tio.opens;
+   if (fd < 0) { error = "Could not open file"; goto FINALLY; }
+   try {
+      buffer = static_cast<char*>((*_gbuff)(bs));   // get buffer
+      if (!buffer) throw 1;
+   } catch(...) {
+      error = "Could not allocate memory";
+      goto FINALLY;
+   }
+   bs = _buffc ? std::min(bs,(*_buffc)()) : bs;  // get buffer size
+   for(size_t i = 0; i < offs.size(); ++i) {
+      ssize_t n = ::pread(fd, buffer, bs, offs[i]);
+      if (n < 0) { error = "Could not read file"; goto FINALLY; }
+      __tio.bytes += n;
+      ++__tio.reads;
+      if (ic) __lower_case(buffer,n);
+      XXH64_update(&xxh_ctx, buffer, n);
+   }
+FINALLY:
+   if (fd >= 0) ::close(fd);
+   if (_relbuff) (*_relbuff)(buffer);
+   if (error) throw error;
+   return XXH64_digest(&xxh_ctx);
+}
+
+off_t filei::fsize(const std::string& path, struct stat* st) {
    struct stat fsi;
 
-   if (::stat(path.c_str(),&fsi)) throw "Could not stat file.";
-   if (!S_ISREG(fsi.st_mode) && !S_ISLNK(fsi.st_mode)) throw "Not a file.";
-   return fsi.st_size;
+   if (!st) st = &fsi;
+   ++__tio.stats;
+   if (::stat(path.c_str(),st)) throw "Could not stat file.";
+   if (!S_ISREG(st->st_mode) && !S_ISLNK(st->st_mode)) throw "Not a file.";
+   return st->st_size;
 }
 
 static bool __bytesame(
@@ -242,6 +416,8 @@ static bool __bytesame(
 
       size_t n1 = is1.gcount();
       size_t n2 = is2.gcount();
+      __tio.bytes += n1 + n2;
+      __tio.reads += 2;
 
       if (m) {
          if (tot1 + n1 > m) n1 = m - tot1;
@@ -267,6 +443,8 @@ static bool __bytesame(
 static size_t __reload(std::istream& is, char* buff, size_t c, char*& p) {
    is.read(buff,c);
    p = buff;
+   __tio.bytes += is.gcount();
+   ++__tio.reads;
    return is.gcount();
 }
 
@@ -290,6 +468,8 @@ static bool __same(
 
    size_t n1 = is1.gcount();
    size_t n2 = is2.gcount();
+   __tio.bytes += n1 + n2;
+   __tio.reads += 2;
 
    char* p1 = buff1;
    char* p2 = buff2;
@@ -317,6 +497,25 @@ static bool __same(
    return true;
 }
 
+void filei_kernels::lower_case(char* buffer, size_t n) {
+   __lower_case(buffer, n);
+}
+
+int filei_kernels::remove_white(char* buffer, int n) {
+   return __remove_white(buffer, n);
+}
+
+bool filei_kernels::bytesame(std::istream& is1, std::istream& is2,
+   char* buff1, char* buff2, size_t c1, size_t c2, size_t m) {
+   return __bytesame(is1, is2, buff1, buff2, c1, c2, m);
+}
+
+bool filei_kernels::same(std::istream& is1, std::istream& is2,
+   char* buff1, char* buff2, size_t c1, size_t c2, size_t m,
+   bool ic, bool iw) {
+   return __same(is1, is2, buff1, buff2, c1, c2, m, ic, iw);
+}
+
 bool filei::eq(
    const std::string& p1, const std::string& p2,
    bool ic, bool iw, size_t m, size_t bn, filei_hash_alg alg) {
@@ -327,6 +526,7 @@ bool filei::eq(
 
    std::ifstream is1(p1.c_str());
    std::ifstream is2(p2.c_str());
+   __tio.opens += 2;
 
    if (!is1.good() || !is2.good()) { 
       error = "Could not open file";
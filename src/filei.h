@@ -63,10 +63,13 @@
 #include <map>
 
 #include <vector>
+#include <memory>
 
 #include <iostream>
 #include <iomanip>
 
+struct stat;
+
 // Add OpenSSL hash sizes
 #define FILEI_MD5_LEN 16
 #define FILEI_SHA1_LEN 20
@@ -83,6 +86,139 @@ enum class filei_hash_alg {
     XXHASH64
 };
 
+/** I/O counters of one thread (see filei::tio). */
+struct filei_io {
+   unsigned long long bytes;  // bytes read
+   unsigned long long reads;  // read calls
+   unsigned long long opens;  // files opened
+   unsigned long long stats;  // stat calls
+   unsigned long long ioctls; // ioctl calls
+};
+
+/** Incremental hash calculation.
+ *
+ * Wraps the supported algorithms behind one interface. Copying a hasher
+ * copies its state, so a calculation can be forked: finish the copy to
+ * get the digest of what was fed so far and keep feeding the original.
+ *
+ * Hashers are made for every file, so making one is kept cheap: the
+ * OpenSSL digests are fetched once per process, and the states (EVP
+ * context, BLAKE3 and XXH64 state) of destroyed hashers are kept per
+ * thread and reinitialized by the next hasher instead of allocated.
+ */
+class hasher {
+
+   private:
+      struct state;
+
+      filei_hash_alg _alg;
+      state* _s;
+
+      hasher& operator=(const hasher&);
+
+      // states of finished hashers, kept per thread for reuse
+      static std::vector<std::unique_ptr<state> >& pool();
+      static state* acquire();
+      static void release(state* s);
+
+   public:
+
+      /** Constructor.
+       * @param alg hash algorithm
+       * @throws an error message if the hash could not be initialized
+       */
+      hasher(filei_hash_alg alg);
+
+      /** Copy constructor, copies the state.
+       * @throws an error message if the state could not be copied
+       */
+      hasher(const hasher& o);
+
+      ~hasher();
+
+      /** Feed data.
+       * @param p data
+       * @param n length of data
+       * @throws an error message on failure
+       */
+      void update(const void* p, size_t n);
+
+      /** Finish the calculation.
+       * The hasher cannot be fed after this.
+       * @param out digest (len() bytes)
+       * @throws an error message on failure
+       */
+      void final(unsigned char* out);
+
+      /** Get hash algorithm. */
+      filei_hash_alg alg() const { return _alg; }
+
+      /** Get digest length. */
+      int len() const { return len(_alg); }
+
+      /** Get digest length of an algorithm.
+       * @param alg hash algorithm
+       * @return digest length in bytes
+       */
+      static int len(filei_hash_alg alg);
+
+      /** Hash many buffers at once.
+       * MD5 runs the buffers through SIMD lanes side by side (see
+       * md5many.h), which pays off for many small ones; the other
+       * algorithms hash them one after the other.
+       * @param alg hash algorithm
+       * @param in the buffers
+       * @param lens their lengths
+       * @param n number of buffers
+       * @param out n digests of len(alg) bytes
+       * @throws an error message on failure
+       */
+      static void many(filei_hash_alg alg, const unsigned char* const* in,
+         const size_t* lens, size_t n, unsigned char* out);
+};
+
+/** Buffer kernels of filei::calc and filei::eq.
+ * Exposed so that they can be benchmarked on their own.
+ */
+struct filei_kernels {
+
+   /** Turn a buffer into lower case in place (-i).
+    * @param buffer the buffer
+    * @param n its length
+    */
+   static void lower_case(char* buffer, size_t n);
+
+   /** Remove white space in place (-w).
+    * @param buffer the buffer
+    * @param n its length
+    * @return number of chars removed
+    */
+   static int remove_white(char* buffer, int n);
+
+   /** Compare two streams byte by byte.
+    * @param is1 first stream
+    * @param is2 second stream
+    * @param buff1 buffer of the first stream
+    * @param buff2 buffer of the second stream
+    * @param c1 capacity of buff1
+    * @param c2 capacity of buff2
+    * @param m compare at most this many bytes (0 means all)
+    * @return true if the same
+    */
+   static bool bytesame(std::istream& is1, std::istream& is2,
+      char* buff1, char* buff2, size_t c1, size_t c2, size_t m);
+
+   /** Compare two streams ignoring case and/or white space.
+    * Parameters as for bytesame.
+    * @param ic ignore case
+    * @param iw ignore white space
+    * @return true if the same
+    */
+   static bool same(std::istream& is1, std::istream& is2,
+      char* buff1, char* buff2, size_t c1, size_t c2, size_t m,
+      bool ic, bool iw);
+};
+
 /** File info.
  *
  * Contains the path name and the corresponding md5 hash. 
@@ -116,8 +252,16 @@ class filei {
       filei_hash_alg _alg;
       int _hash_len;
 
-      // calculate hash
-      void calc(bool ic, bool iw, size_t bs, size_t m);
+      // hash state after the bytes hashed (kept on request)
+      std::shared_ptr<hasher> _state;
+      off_t _off; // bytes of the file behind _state
+
+      // calculate hash, starting from state from at offset off
+      void calc(bool ic, bool iw, size_t bs, size_t m,
+         const hasher* from = 0, off_t off = 0, bool keep = false);
+
+      // continue the calculation of prefix
+      filei(const filei& prefix, bool ic, size_t bs);
 
       // return buffer 
       static void* gbuff(size_t) { return _buffer; }
@@ -137,11 +281,30 @@ class filei {
        * @param m consider at most these many bytes for the hash (0: ALL)
        * @param bs buffer size of internal work buffer (default 1024)
        * @param alg hash algorithm
+       * @param keep keep the hash state, so that the calculation of a
+       *    prefix (m) can be continued with resume (ignored with iw)
        * @throws an error message if construction failed
        */
       filei(const std::string& path, bool ic, bool iw, 
          size_t m = 0ul, size_t bs=1024ul,
-         filei_hash_alg alg = filei_hash_alg::MD5);
+         filei_hash_alg alg = filei_hash_alg::MD5, bool keep = false);
+
+      /** Continue a prefix calculation to the end of the file.
+       *
+       * Reads the file from where the prefix stopped and finishes the
+       * kept hash state, so the result equals a full calculation at the
+       * cost of reading the rest of the file once.
+       *
+       * @param prefix file info constructed with keep
+       * @param ic ignore case (must match the prefix)
+       * @param bs buffer size of internal work buffer
+       * @return file info of the whole file
+       * @throws an error message if the prefix has no state or on errors
+       */
+      static filei resume(const filei& prefix, bool ic, size_t bs = 1024ul);
+
+      /** Tell whether resume can continue this calculation. */
+      bool resumable() const { return (bool)_state; }
 
       /** Get an md5 hash char.
        * @param i index
@@ -178,10 +341,42 @@ class filei {
 
       /** Get file size from the file system.
         * @param path absolute or relative path
+        * @param st if not 0, the full status is returned here
         * @return file size in bytes
         * @throws an exception if status cannot be determined.
         */
-      static off_t fsize(const std::string& path);
+      static off_t fsize(const std::string& path, struct stat* st = 0);
+
+      /** Hash samples of a file.
+        * Reads bs bytes at each offset with pread and hashes them with
+        * xxHash64. Files of the same size whose samples differ cannot be
+        * identical, which finds files that share a long prefix but
+        * differ at the end or in the middle at a few KB of I/O each.
+        * Letter case can be ignored, white space can not (it moves the
+        * content around).
+        * @param path file name
+        * @param offs offsets of the samples (must fit in the file)
+        * @param bs sample size
+        * @param ic ignore case
+        * @return hash of the samples
+        * @throws an error message if the file could not be read
+        */
+      static unsigned long long sample(const std::string& path,
+         const std::vector<off_t>& offs, size_t bs, bool ic);
+
+      /** I/O counters of the calling thread.
+        * Every open, read and stat performed by filei is counted in
+        * thread local counters, which lets callers attribute I/O to the
+        * job they ran. Code doing I/O of its own on behalf of filei users
+        * may add to them.
+        * @return counters of this thread
+        */
+      static filei_io& tio();
+
+      /** Bytes read by the calling thread.
+        * @return total bytes read by this thread so far
+        */
+      static unsigned long long tbytes() { return tio().bytes; }
 
       /** Determine whether the two files are identical.
         * @param p1 path of one file
@@ -331,16 +526,6 @@ class fset {
 
       typedef typename M::const_iterator it_t; // subset iterator
 
-      /** Add a file info.
-        * @param fi file info
-        */
-      void add(const filei& fi) {
-         typename S::const_iterator i = _files.find(fi);
-         if (i != _files.end()) _cmn[*i].push_back(fi.path());
-         else _files.insert(fi);
-      }
-
-
    public:
  
       /** Constructor.
@@ -364,6 +549,16 @@ class fset {
          add(filei(path,_ic,_iw,_max,_bs,_alg));
       }
 
+      /** Add a file info calculated elsewhere.
+        * It must have been calculated with the settings of this set.
+        * @param fi file info
+        */
+      void add(const filei& fi) {
+         typename S::const_iterator i = _files.find(fi);
+         if (i != _files.end()) _cmn[*i].push_back(fi.path());
+         else _files.insert(fi);
+      }
+
       /** Print the sets of identical files.
         *
         * Each set of identical files are printed on a single line.
@@ -424,11 +619,13 @@ class fset {
        * @param iw ignore white space
        * @param m consider at most these many bytes for hash (0: ALL)
        * @param bs internal buffer size (default 1024)
+       * @param alg hash algorithm
        */
       static void common(M& res, const M& cmn, 
-         bool ic, bool iw, size_t m=0, size_t bs=1204) {
+         bool ic, bool iw, size_t m=0, size_t bs=1024,
+         filei_hash_alg alg = filei_hash_alg::MD5) {
          for(it_t it=cmn.begin(); it != cmn.end(); ++it) {
-            fset files(ic,iw,m,bs);
+            fset files(ic,iw,m,bs,alg);
             files.add(it->first.path());
             for(int i=0; i<(int)it->second.size();++i) files.add(it->second[i]);
 
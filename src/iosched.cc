@@ -0,0 +1,366 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code was developed for an EU.EDGE internal project and
+ * is made available according to the terms of this license.
+ *
+ * The Initial Developer of the Original Code is Istvan T. Hernadvolgyi,
+ * EU.EDGE LLC.
+ *
+ * Portions created by EU.EDGE LLC are Copyright (C) EU.EDGE LLC.
+ * All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+// I/O SCHEDULING OF FILE READS - IMPLEMENTATION
+//
+
+#include <iosched.h>
+#include <uatrace.h>
+
+#include <algorithm>
+#include <fstream>
+
+extern "C" {
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#if defined(__linux__)
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+}
+
+// pseudo device for files that could not be located
+static const dev_t __nodev = ~(dev_t)0;
+
+// window of completed jobs before auto tuning reconsiders a depth
+static const size_t __tune_jobs = 16;
+static const double __tune_secs = 0.25;
+
+iosched::iosched(int threads, bool physical, bool verbose)
+:_threads(threads > 0 ? threads : 1),_physical(physical),_verbose(verbose),
+ _rotd(physical ? 1 : 2),_ssdd(_threads),_auto(false),
+ _seq(0),_stop(false) {
+   for(int i = 0; i < _threads; ++i)
+      _workers.push_back(std::thread(&iosched::work, this));
+}
+
+iosched::~iosched() {
+   {
+      std::lock_guard<std::mutex> lock(_mtx);
+      _stop = true;
+   }
+   _cv.notify_all();
+   for(auto& w : _workers) w.join();
+
+   if (!_verbose) return;
+   for(const auto& d : _devs) {
+      const devq& q = d.second;
+      if (q.dev == __nodev) continue;
+      std::cerr << "Device " << major(q.dev) << ":" << minor(q.dev)
+                << (q.rot ? " (rotational)" : "") << ": " << q.done
+                << " jobs, " << q.bytes / 1048576.0 << " MB in "
+                << q.busy << " s busy";
+      if (q.busy > 0) std::cerr << ", " << q.bytes / 1048576.0 / q.busy
+                                << " MB/s";
+      std::cerr << ", depth " << q.limit << std::endl;
+   }
+}
+
+// parse a positive depth
+static bool __depth(const std::string& s, size_t& d) {
+   char* e = 0;
+   long n = ::strtol(s.c_str(), &e, 10);
+   if (s.empty() || *e || n <= 0) return false;
+   d = (size_t)n;
+   return true;
+}
+
+bool iosched::depths(const std::string& spec) {
+   size_t b = 0;
+   for(;;) {
+      size_t e = spec.find(',', b);
+      std::string tok = spec.substr(b, e == std::string::npos ? e : e - b);
+      size_t eq = tok.rfind('=');
+      size_t d = 0;
+      if (tok == "auto") _auto = true;
+      else if (eq == std::string::npos) {
+         if (!__depth(tok, d)) return false;
+         _rotd = _ssdd = d;
+      } else {
+         std::string key = tok.substr(0, eq);
+         if (!__depth(tok.substr(eq + 1), d)) return false;
+         unsigned int ma, mi;
+         char c;
+         if (key == "rot") _rotd = d;
+         else if (key == "ssd") _ssdd = d;
+         else if (::sscanf(key.c_str(), "%u:%u%c", &ma, &mi, &c) == 2)
+            _devd[makedev(ma, mi)] = d;
+         else {
+            struct stat fsi;
+            if (::stat(key.c_str(), &fsi)) return false;
+            _devd[fsi.st_dev] = d;
+         }
+      }
+      if (e == std::string::npos) break;
+      b = e + 1;
+   }
+   return true;
+}
+
+// read the first character of a sysfs attribute
+static int __sysattr(const std::string& path) {
+   std::ifstream is(path.c_str());
+   char c = 0;
+   if (!is.good() || !is.get(c)) return -1;
+   return c;
+}
+
+bool iosched::rotational(dev_t dev) {
+   static std::mutex mtx;
+   static std::map<dev_t,bool> cache;
+
+   std::lock_guard<std::mutex> lock(mtx);
+   std::map<dev_t,bool>::const_iterator i = cache.find(dev);
+   if (i != cache.end()) return i->second;
+
+   // whole disks have queue/, partitions find it in the parent directory
+   std::string base = "/sys/dev/block/" + std::to_string(major(dev)) + ":"
+      + std::to_string(minor(dev));
+   int c = __sysattr(base + "/queue/rotational");
+   if (c < 0) c = __sysattr(base + "/../queue/rotational");
+
+   return cache[dev] = c == '1';
+}
+
+bool iosched::locate(const std::string& path, place& p, bool physical) {
+   struct stat fsi;
+
+   ++filei::tio().stats;
+   if (::stat(path.c_str(),&fsi)) return false;
+   p.dev = fsi.st_dev;
+   p.phys = false;
+   p.pos = fsi.st_ino;
+
+#if defined(FS_IOC_FIEMAP)
+   if (!physical) return true;
+
+   int fd = ::open(path.c_str(), O_RDONLY);
+   ++filei::tio().opens;
+   if (fd < 0) return true;
+
+   // one extent is enough: we want to know where reading starts
+   union {
+      struct fiemap fm;
+      char raw[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+   } u;
+   memset(&u, 0, sizeof(u));
+   u.fm.fm_start = 0;
+   u.fm.fm_length = FIEMAP_MAX_OFFSET;
+   u.fm.fm_extent_count = 1;
+   ++filei::tio().ioctls;
+   if (!::ioctl(fd, FS_IOC_FIEMAP, &u.fm) && u.fm.fm_mapped_extents == 1 &&
+      !(u.fm.fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN)) {
+      p.phys = true;
+      p.pos = u.fm.fm_extents[0].fe_physical;
+   }
+   ::close(fd);
+#endif
+
+   return true;
+}
+
+void iosched::note(const std::string& path, dev_t dev, ino_t ino) {
+   if (_physical) return;
+   place p = { dev, false, (uint64_t)ino };
+   std::lock_guard<std::mutex> lock(_pmtx);
+   _places[path] = p;
+}
+
+void iosched::forget(const fvec_t& paths) {
+   std::lock_guard<std::mutex> lock(_pmtx);
+   for(const auto& p : paths) _places.erase(p);
+}
+
+std::vector<uastats::device> iosched::devices() {
+   std::vector<uastats::device> res;
+   std::lock_guard<std::mutex> lock(_mtx);
+   for(const auto& d : _devs) {
+      const devq& q = d.second;
+      if (q.dev == __nodev) continue;
+      uastats::device u = { q.dev, q.rot, q.done, q.bytes, q.busy, q.limit };
+      res.push_back(u);
+   }
+   return res;
+}
+
+iosched::devq& iosched::queue(dev_t dev) {
+   std::map<dev_t,devq>::iterator i = _devs.find(dev);
+   if (i != _devs.end()) return i->second;
+
+   devq& q = _devs[dev];
+   q.dev = dev;
+   q.rot = dev != __nodev && rotational(dev);
+   std::map<dev_t,size_t>::const_iterator d = _devd.find(dev);
+   q.limit = d != _devd.end() ? d->second : q.rot ? _rotd : _ssdd;
+   q.limit = std::min(q.limit, (size_t)_threads);
+   q.inflight = 0;
+   q.cursor.phys = true;
+   q.cursor.pos = 0;
+   q.wbusy = 0;
+   q.wbytes = 0;
+   q.wdone = 0;
+   q.rate = 0;
+   q.dir = 1;
+   q.bytes = 0;
+   q.done = 0;
+   q.busy = 0;
+   return q;
+}
+
+iosched::devq* iosched::pick() {
+   devq* best = 0;
+   for(auto& d : _devs) {
+      devq& q = d.second;
+      if (q.items.empty() || q.inflight >= q.limit) continue;
+      // least used share of the budget: inflight/limit
+      if (!best || q.inflight * best->limit < best->inflight * q.limit)
+         best = &q;
+   }
+   return best;
+}
+
+void iosched::done(devq& q, unsigned long long bytes) {
+   clock_t::time_point now = clock_t::now();
+
+   if (!--q.inflight)
+      q.busy += std::chrono::duration<double>(now - q.bstart).count();
+   ++q.done;
+   q.bytes += bytes;
+
+   if (!_auto) return;
+
+   // hill climbing on the throughput of windows of busy time
+   q.wbytes += bytes;
+   ++q.wdone;
+   double busy = q.busy + (q.inflight ?
+      std::chrono::duration<double>(now - q.bstart).count() : 0.0);
+   double wsecs = busy - q.wbusy;
+   if (q.wdone < __tune_jobs || wsecs < __tune_secs) return;
+
+   double rate = q.wbytes / wsecs;
+   if (q.rate > 0 && rate < q.rate * 0.95) q.dir = -q.dir;
+   if (q.limit == 1 && q.dir < 0) q.dir = 1;
+   if (q.limit >= (size_t)_threads && q.dir > 0) q.dir = -1;
+   if (_threads > 1) q.limit += q.dir;
+
+   if (_verbose)
+      std::cerr << "Device " << major(q.dev) << ":" << minor(q.dev) << " at "
+                << rate / 1048576.0 << " MB/s, depth " << q.limit << std::endl;
+
+   q.rate = rate;
+   q.wbusy = busy;
+   q.wbytes = 0;
+   q.wdone = 0;
+}
+
+void iosched::work() {
+   uatrace::name("worker");
+   std::unique_lock<std::mutex> lock(_mtx);
+   for(;;) {
+      devq* q = pick();
+      if (!q) {
+         if (_stop) return;
+         uatrace::span idle("idle", "sched");
+         _cv.wait(lock);
+         continue;
+      }
+
+      // elevator: next item at or after the cursor, then wrap around
+      std::multiset<item>::iterator it = _physical ?
+         q->items.lower_bound(q->cursor) : q->items.begin();
+      if (it == q->items.end()) it = q->items.begin();
+      item job = *it;
+      q->items.erase(it);
+      q->cursor = job;
+      if (!q->inflight++) q->bstart = clock_t::now();
+      lock.unlock();
+
+      unsigned long long b0 = filei::tbytes();
+      uatrace::device(q->dev);
+      try { (*job.job)(*job.path); } catch(...) { }
+      uatrace::device(__nodev);
+
+      lock.lock();
+      done(*q, filei::tbytes() - b0);
+      if (!--job.b->left) _fin.notify_all();
+      // a slot on q just opened up
+      _cv.notify_one();
+   }
+}
+
+void iosched::run(const fvec_t& paths, const job_t& job) {
+   if (paths.empty()) return;
+
+   // look up placements (cached across stages)
+   std::vector<place> places(paths.size());
+   for(size_t i = 0; i < paths.size(); ++i) {
+      place& p = places[i];
+      bool found = false;
+      {
+         std::lock_guard<std::mutex> lock(_pmtx);
+         auto f = _places.find(paths[i]);
+         if (f != _places.end()) { p = f->second; found = true; }
+      }
+      uastats::cache(found);
+      if (found) continue;
+      if (!locate(paths[i], p, _physical)) {
+         // still hand it to the job, which reports the error
+         p.dev = __nodev;
+         p.phys = false;
+         p.pos = 0;
+         continue;
+      }
+      std::lock_guard<std::mutex> lock(_pmtx);
+      _places[paths[i]] = p;
+   }
+
+   batch b;
+   b.left = paths.size();
+
+   std::unique_lock<std::mutex> lock(_mtx);
+   for(size_t i = 0; i < paths.size(); ++i) {
+      item it;
+      it.phys = _physical && places[i].phys;
+      it.pos = _physical ? places[i].pos : _seq++;
+      it.path = &paths[i];
+      it.job = &job;
+      it.b = &b;
+      queue(places[i].dev).items.insert(it);
+   }
+   _cv.notify_all();
+
+   _fin.wait(lock, [&b]() { return !b.left; });
+}
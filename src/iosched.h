@@ -0,0 +1,257 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code was developed for an EU.EDGE internal project and
+ * is made available according to the terms of this license.
+ *
+ * The Initial Developer of the Original Code is Istvan T. Hernadvolgyi,
+ * EU.EDGE LLC.
+ *
+ * Portions created by EU.EDGE LLC are Copyright (C) EU.EDGE LLC.
+ * All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+// I/O SCHEDULING OF FILE READS - HEADER
+//
+
+#if !defined(_IOSCHED_H_)
+#define _IOSCHED_H_
+
+#include <filei.h>
+#include <uastats.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
+extern "C" {
+#include <stdint.h>
+#include <sys/types.h>
+}
+
+/** Scheduler for per-file read jobs.
+ *
+ * A job is a function called with a path name; it typically constructs
+ * a filei. iosched::run calls the job for every path on a pool of
+ * <threads> workers, which live as long as the scheduler. run may be
+ * called from several threads at once (e.g. one per size group); all
+ * submitted jobs share the pool.
+ *
+ * Paths are grouped by the device they live on (st_dev) and each device
+ * has its own queue and queue depth budget: the number of jobs that may
+ * read from it at the same time. A free worker always takes a job from
+ * the device that uses the smallest share of its budget, so a slow disk
+ * at its limit never holds back a fast one. The worker count (-t) bounds
+ * CPU use, the budgets (-d) bound the load put on each device.
+ *
+ * By default rotational devices (as reported by
+ * /sys/dev/block/MAJ:MIN/queue/rotational) get a depth of 2 and all
+ * other devices may use every worker. With auto tuning each device's
+ * depth is moved up or down by one while its measured throughput
+ * improves (hill climbing over windows of completed jobs).
+ *
+ * In physical order mode each device queue is sorted by the physical
+ * position of the first extent of the file (FIEMAP) or, when the file
+ * system cannot tell, by inode number, and it is served like an elevator
+ * (C-SCAN). Rotational devices then default to a depth of 1, so the
+ * heads sweep across the platter instead of thrashing.
+ *
+ * Placement information is cached per path, so running several stages
+ * (milestones, full hash) over the same files costs one lookup per file.
+ * The caller can also supply placements it already knows (note).
+ */
+class iosched {
+
+   public:
+
+      /** Job run on each file. */
+      typedef std::function<void(const std::string&)> job_t;
+
+      /** Placement of a file. */
+      struct place {
+         dev_t dev;     // device
+         bool phys;     // pos is a physical byte offset (else inode)
+         uint64_t pos;  // sort key within the device
+      };
+
+      /** Constructor.
+       * @param threads number of workers
+       * @param physical read in physical order
+       * @param verbose report the schedule and device totals on stderr
+       */
+      iosched(int threads, bool physical, bool verbose = false);
+
+      /** Destructor. Stops the workers. */
+      ~iosched();
+
+      /** Configure device queue depths.
+       *
+       * The spec is a comma separated list of
+       * <pre>
+       *    N          depth of every device
+       *    rot=N      depth of rotational devices
+       *    ssd=N      depth of non-rotational devices
+       *    MAJ:MIN=N  depth of the device with the given numbers
+       *    PATH=N     depth of the device PATH lives on
+       *    auto       tune depths from measured throughput
+       * </pre>
+       * Must be called before the first run.
+       * @param spec the specification
+       * @return false if the spec could not be parsed
+       */
+      bool depths(const std::string& spec);
+
+      /** Record the placement of a file obtained elsewhere.
+       * Ignored in physical order mode (FIEMAP is still needed).
+       * @param path file name
+       * @param dev device
+       * @param ino inode number
+       */
+      void note(const std::string& path, dev_t dev, ino_t ino);
+
+      /** Drop the cached placements of files no longer needed.
+       * @param paths file names
+       */
+      void forget(const fvec_t& paths);
+
+      /** Call job for every path.
+       * Returns when all jobs have finished. Jobs are expected to handle
+       * their own errors; exceptions thrown by a job are swallowed.
+       * The job is called with the element of paths itself, so
+       * &path - &paths[0] is its index.
+       * @param paths file names
+       * @param job the job to run on each file
+       */
+      void run(const fvec_t& paths, const job_t& job);
+
+      /** Number of worker threads. */
+      int threads() const { return _threads; }
+
+      /** Per-device totals so far.
+       * @return one entry per device that had jobs
+       */
+      std::vector<uastats::device> devices();
+
+      /** Determine whether a device is rotational.
+       * The answer is cached; devices unknown to sysfs (network,
+       * virtual file systems) are not rotational.
+       * @param dev device id (st_dev)
+       * @return true if rotational
+       */
+      static bool rotational(dev_t dev);
+
+      /** Look up the placement of a file.
+       * @param path file name
+       * @param p placement (returned)
+       * @param physical also ask the FS for the first extent
+       * @return false if the file could not be stat'ed
+       */
+      static bool locate(const std::string& path, place& p,
+         bool physical = true);
+
+   private:
+
+      typedef std::chrono::steady_clock clock_t;
+
+      // jobs submitted by one call to run
+      struct batch {
+         size_t left;
+      };
+
+      // a job on a device queue
+      struct item {
+         bool phys;
+         uint64_t pos;
+         const std::string* path;
+         const job_t* job;
+         batch* b;
+
+         bool operator<(const item& o) const {
+            // files with a physical address first, then by inode
+            if (phys != o.phys) return phys;
+            return pos < o.pos;
+         }
+      };
+
+      // queue of one device
+      struct devq {
+         dev_t dev;
+         bool rot;
+         size_t limit;      // depth budget
+         size_t inflight;   // jobs currently running
+         std::multiset<item> items;
+         item cursor;       // elevator position
+         // auto tuning window
+         double wbusy;      // busy seconds when the window started
+         unsigned long long wbytes;
+         size_t wdone;
+         double rate;       // throughput of the previous window
+         int dir;           // direction of the last depth change
+         // totals
+         unsigned long long bytes;
+         size_t done;
+         double busy;       // seconds with at least one job in flight
+         clock_t::time_point bstart;
+      };
+
+      int _threads;
+      bool _physical;
+      bool _verbose;
+
+      // depth configuration
+      size_t _rotd;
+      size_t _ssdd;
+      bool _auto;
+      std::map<dev_t,size_t> _devd;
+
+      std::mutex _pmtx; // guards _places
+#if defined(__UA_USEHASH)
+      std::unordered_map<std::string,place> _places;
+#else
+      std::map<std::string,place> _places;
+#endif
+
+      std::mutex _mtx;              // guards everything below
+      std::condition_variable _cv;  // work available / stop
+      std::condition_variable _fin; // a batch finished
+      std::map<dev_t,devq> _devs;
+      uint64_t _seq;
+      bool _stop;
+      std::vector<std::thread> _workers;
+
+      // worker loop
+      void work();
+
+      // pick the next job (_mtx held), 0 if none can start
+      devq* pick();
+
+      // account a finished job (_mtx held)
+      void done(devq& q, unsigned long long bytes);
+
+      // get the queue of a device (_mtx held)
+      devq& queue(dev_t dev);
+};
+
+#endif
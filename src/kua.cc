@@ -35,7 +35,9 @@
 //
 // BUILD:
 //
-// g++ -O3 -o kua filei.cc kua.cc -I . 
+// kua is a front end of the scanner in libua (uascan.h):
+//
+// g++ -O3 -o kua kua.cc -I . -L . -lua -lcrypto -lpthread
 // 
 // $ kua -vh
 //
@@ -45,11 +47,15 @@
 #define __KUA_VERSION "1.0"
 #endif
 
-#include <filei.h>
+#include <uascan.h>
+#include <uaserve.h>
 #include <cstring>
 
 extern "C" {
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <getopt.h>
 }
 
@@ -65,15 +71,29 @@ static char __help[] =
 "  -a <alg>:   hash algorithm: md5, sha1, sha256, b3, xxh64\n"
 "  -q:         quote file names with single quotes\n"
 "  -h:         this help (-vh more verbose help)\n"
+"  --server <path>: ask a ua server (ua serve --socket <path>) instead\n"
+"              of reading FILEs\n"
 "  -           read file names from stdin\n";
 
+// long options
+static struct option __longopts[] = {
+   { "server", required_argument, 0, 256 },
+   { 0, 0, 0, 0 }
+};
+
 static char __vhelp[] =
 "kua looks for files which are identical to the one given as the argument "
 "of -f. For example, \n\n"
 "  $ kua -f f.txt `ls`\n\n"
 "looks for files identical to f.txt in the current directory, while\n\n"
 "  $ find ~ -type f | kua -f f.txt -\n\n"
-"will compare f.txt to each file under home.\n"
+"will compare f.txt to each file under home.\n\n"
+"When the same haystack is searched over and over, a resident server\n"
+"holds it in memory:\n\n"
+"  $ find ~ -type f | ua serve --socket /tmp/ua.sock - &\n"
+"  $ kua -f f.txt --server /tmp/ua.sock\n\n"
+"The server reads f.txt and answers from the digests it keeps; its\n"
+"options (-a, -i) apply, those given to kua are ignored.\n"
 "Blame\n\n"
 "  istvan.hernadvolgyi@gmail.com\n\n";
 
@@ -100,47 +120,48 @@ int main(int argc, char* const * argv) {
 
    
    std::string cfile;
+   std::string server; // socket of a ua server
 
-   bool ic = false; // ignore case
-   bool iw = false; // ignore white space
+   uascan::options o; // compare options
+   o.threads = 1;
+   o.milestones = false;
    bool v = false; // verbose
-   int BN = 1024; // buffer size
-   bool count = true; // take size into account
    bool quote = false; // quote file names with single quotes
 
    bool comm = true; // from command line
 
-   filei_hash_alg alg = filei_hash_alg::MD5;
-
    if (argc <= 1) {
       __phelp(false);
       return 1;
    }
 
    int opt;
-   while((opt = ::getopt(argc,argv,"f:hb:viws:m:na:q")) != -1) {
+   while((opt = ::getopt_long(argc,argv,"f:hb:viws:m:na:q",__longopts,0)) != -1) {
       switch(opt) {
          case 'f':
             cfile = std::string(::optarg);
             break;
+         case 256:
+            server = std::string(::optarg);
+            break;
          case 'b':
-            BN = ::atoi(::optarg);
-            if (!BN) {
+            o.bsize = ::atoi(::optarg);
+            if (!o.bsize) {
                std::cerr << "Invalid buffer size " << ::optarg << std::endl;
                return 1;
             }
             break;
          case 'i':
-            ic = true;
+            o.ic = true;
             break;
          case 'v':
             v = true;
             break;
          case 'w':
-            iw = true;
+            o.iw = true;
             break;
          case 'n':
-            count = false;
+            o.count = false;
             break;
          case 'q':
             quote = true;
@@ -149,11 +170,11 @@ int main(int argc, char* const * argv) {
             __phelp(v);
             return 0;
          case 'a':
-            if (strcmp(::optarg, "md5") == 0) alg = filei_hash_alg::MD5;
-            else if (strcmp(::optarg, "sha1") == 0) alg = filei_hash_alg::SHA1;
-            else if (strcmp(::optarg, "sha256") == 0) alg = filei_hash_alg::SHA256;
-            else if (strcmp(::optarg, "b3") == 0) alg = filei_hash_alg::BLAKE3;
-            else if (strcmp(::optarg, "xxh64") == 0) alg = filei_hash_alg::XXHASH64;
+            if (strcmp(::optarg, "md5") == 0) o.alg = filei_hash_alg::MD5;
+            else if (strcmp(::optarg, "sha1") == 0) o.alg = filei_hash_alg::SHA1;
+            else if (strcmp(::optarg, "sha256") == 0) o.alg = filei_hash_alg::SHA256;
+            else if (strcmp(::optarg, "b3") == 0) o.alg = filei_hash_alg::BLAKE3;
+            else if (strcmp(::optarg, "xxh64") == 0) o.alg = filei_hash_alg::XXHASH64;
             else {
                std::cerr << "Unknown algorithm: " << ::optarg << std::endl;
                return 1;
@@ -170,7 +191,47 @@ int main(int argc, char* const * argv) {
       return 1;
    }
 
-   if (count && iw) count = false;
+   if (server.size()) {
+      if (argc > ::optind) {
+         std::cerr << "The server has the files to compare to!" << std::endl;
+         return 1;
+      }
+      // the server resolves the path, possibly from another directory
+      char real[PATH_MAX];
+      if (!::realpath(cfile.c_str(), real)) {
+         std::cerr << cfile << ": " << ::strerror(errno) << std::endl;
+         return 1;
+      }
+      try {
+         uaserve::client c(server);
+         c.ask(real);
+         std::vector<fvec_t> res;
+         c.answers(res);
+         for(const auto& file : res[0]) {
+            if (quote) std::cout << "'" << file << "'" << std::endl;
+            else std::cout << file << std::endl;
+         }
+      } catch(const char* e) {
+         std::cerr << server << ": " << e << std::endl;
+         return 1;
+      }
+      return 0;
+   }
+
+   o.verbose = v;
+
+   uascan scanner;
+   if (scanner.configure(o) != ua_error::OK) {
+      std::cerr << scanner.message() << std::endl;
+      return 1;
+   }
+   scanner.on_log([](const std::string& msg) {
+      std::cerr << msg << std::endl;
+   });
+   scanner.on_error([&cfile, v](const std::string& file, const char* e) {
+      if (file == cfile) std::cerr << e << std::endl;
+      else if (v) std::cerr << "Skipping " << file << ", " << e << std::endl;
+   });
 
    if (argc > ::optind) { 
       if (argc >= ::optind +1 && *argv[::optind] == '-') {
@@ -185,16 +246,6 @@ int main(int argc, char* const * argv) {
 
    char fileb[FILENAME_MAX];
 
-   off_t n = 0;
-
-   if (count) {
-      try {
-         n = filei::fsize(cfile);
-      } catch(const char *e) {
-         std::cerr << e << std::endl;
-      }
-   }
-
    for(int i = ::optind;;) {
       char* file;
       if (comm) {
@@ -205,24 +256,20 @@ int main(int argc, char* const * argv) {
          if (std::cin.eof()) break;
          file = fileb;
       }
-
-
-      if (v) std::cerr << "Considering " << file << std::endl;
-      try {
-         if (count) {
-            const off_t sz = filei::fsize(file);
-            if (n != sz) continue;
-         }
-         if (filei::eq(cfile,file,ic,iw,0,BN,alg)) {
-            if (quote) std::cout << "'" << file << "'" << std::endl;
-            else std::cout << file << std::endl;
-         }
-      } catch(const char* e) {
-         if (v) std::cerr << "Skipping " << file << ", " << e << std::endl;
-         continue;
+      if (scanner.add(file) != ua_error::OK) {
+         std::cerr << scanner.message() << std::endl;
+         return 1;
       }
    }
 
+   ua_error res = scanner.match(cfile, [quote](const std::string& file) {
+      if (quote) std::cout << "'" << file << "'" << std::endl;
+      else std::cout << file << std::endl;
+   });
+   if (res != ua_error::OK) {
+      std::cerr << scanner.message() << std::endl;
+      return 1;
+   }
 
    return 0;
 
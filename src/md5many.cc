@@ -0,0 +1,236 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code was developed for an EU.EDGE internal project and
+ * is made available according to the terms of this license.
+ *
+ * The Initial Developer of the Original Code is Istvan T. Hernadvolgyi,
+ * EU.EDGE LLC.
+ *
+ * Portions created by EU.EDGE LLC are Copyright (C) EU.EDGE LLC.
+ * All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+// MULTI-BUFFER MD5 - IMPLEMENTATION
+//
+
+#include <md5many.h>
+
+#include <cstring>
+
+extern "C" {
+#include <stdint.h>
+}
+
+// RFC 1321: additive constants and rotations of the 64 steps
+static const uint32_t __k[64] = {
+   0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
+   0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+   0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340,
+   0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+   0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+   0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+   0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+   0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+   0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
+   0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+   0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const int __s[4][4] = {
+   { 7, 12, 17, 22 }, { 5, 9, 14, 20 }, { 4, 11, 16, 23 }, { 6, 10, 15, 21 }
+};
+
+static const uint32_t __iv[4] = {
+   0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476
+};
+
+static inline uint32_t __le32(const unsigned char* p) {
+   uint32_t w;
+   ::memcpy(&w, p, sizeof(w));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+   w = __builtin_bswap32(w);
+#endif
+   return w;
+}
+
+// the buffer a lane works on
+struct __lane {
+   const unsigned char* p;
+   size_t idx;                // which buffer
+   size_t full;               // 64 byte blocks taken from p
+   size_t blocks;             // with the padding blocks
+   size_t next;               // next block
+   unsigned char tail[128];   // last bytes of p and the padding
+};
+
+static void __assign(__lane& l, const unsigned char* p, size_t len, size_t idx) {
+   l.p = p;
+   l.idx = idx;
+   l.full = len / 64;
+   l.next = 0;
+   size_t rem = len % 64;
+   size_t tb = rem + 9 <= 64 ? 1 : 2;
+   l.blocks = l.full + tb;
+   ::memset(l.tail, 0, sizeof(l.tail));
+   if (rem) ::memcpy(l.tail, p + l.full * 64, rem);
+   l.tail[rem] = 0x80;
+   uint64_t bits = (uint64_t)len << 3;
+   for(int i = 0; i < 8; ++i) l.tail[tb * 64 - 8 + i] = (unsigned char)(bits >> (8 * i));
+}
+
+// the 64 steps over one block in every lane; inlined into the callers
+// below, so it is compiled for their instruction sets
+template<typename V, int L>
+static inline __attribute__((always_inline))
+void __compress(uint32_t (*st)[L], const unsigned char* const* blk) {
+   V m[16];
+   for(int i = 0; i < 16; ++i)
+      for(int j = 0; j < L; ++j) m[i][j] = __le32(blk[j] + 4 * i);
+
+   V a, b, c, d;
+   for(int j = 0; j < L; ++j) {
+      a[j] = st[0][j];
+      b[j] = st[1][j];
+      c[j] = st[2][j];
+      d[j] = st[3][j];
+   }
+   const V a0 = a, b0 = b, c0 = c, d0 = d;
+
+   for(int i = 0; i < 64; ++i) {
+      V f;
+      int g;
+      switch(i >> 4) {
+         case 0: f = d ^ (b & (c ^ d)); g = i; break;
+         case 1: f = c ^ (d & (b ^ c)); g = (5 * i + 1) & 15; break;
+         case 2: f = b ^ c ^ d; g = (3 * i + 5) & 15; break;
+         default: f = c ^ (b | ~d); g = (7 * i) & 15; break;
+      }
+      int s = __s[i >> 4][i & 3];
+      V x = a + f + __k[i] + m[g];
+      V t = d;
+      d = c;
+      c = b;
+      b = b + ((x << s) | (x >> (32 - s)));
+      a = t;
+   }
+
+   a += a0;
+   b += b0;
+   c += c0;
+   d += d0;
+   for(int j = 0; j < L; ++j) {
+      st[0][j] = a[j];
+      st[1][j] = b[j];
+      st[2][j] = c[j];
+      st[3][j] = d[j];
+   }
+}
+
+// feed the buffers through L lanes
+template<typename V, int L>
+static inline __attribute__((always_inline))
+void __many(const unsigned char* const* in, const size_t* len, size_t n,
+   unsigned char* out) {
+   static const unsigned char zero[64] = { 0 };
+   __lane lanes[L];
+   uint32_t st[4][L];
+   bool busy[L];
+   size_t k = 0, active = 0;
+
+   for(int j = 0; j < L; ++j) {
+      busy[j] = k < n;
+      if (!busy[j]) continue;
+      __assign(lanes[j], in[k], len[k], k);
+      ++k;
+      ++active;
+      for(int r = 0; r < 4; ++r) st[r][j] = __iv[r];
+   }
+
+   const unsigned char* blk[L];
+   while(active) {
+      for(int j = 0; j < L; ++j) {
+         const __lane& l = lanes[j];
+         if (!busy[j]) blk[j] = zero;
+         else if (l.next < l.full) blk[j] = l.p + 64 * l.next;
+         else blk[j] = l.tail + 64 * (l.next - l.full);
+      }
+      __compress<V, L>(st, blk);
+
+      for(int j = 0; j < L; ++j) {
+         __lane& l = lanes[j];
+         if (!busy[j] || ++l.next < l.blocks) continue;
+         unsigned char* o = out + 16 * l.idx;
+         for(int r = 0; r < 4; ++r)
+            for(int i = 0; i < 4; ++i) o[4 * r + i] = (unsigned char)(st[r][j] >> (8 * i));
+         if (k < n) {
+            __assign(l, in[k], len[k], k);
+            ++k;
+            for(int r = 0; r < 4; ++r) st[r][j] = __iv[r];
+         } else {
+            busy[j] = false;
+            --active;
+         }
+      }
+   }
+}
+
+typedef uint32_t __v4 __attribute__((vector_size(16)));
+
+static void __many4(const unsigned char* const* in, const size_t* len,
+   size_t n, unsigned char* out) {
+   __many<__v4, 4>(in, len, n, out);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define __MD5_AVX2 1
+typedef uint32_t __v8 __attribute__((vector_size(32)));
+
+__attribute__((target("avx2")))
+static void __many8(const unsigned char* const* in, const size_t* len,
+   size_t n, unsigned char* out) {
+   __many<__v8, 8>(in, len, n, out);
+}
+#endif
+
+static bool __avx2() {
+#if defined(__MD5_AVX2)
+   static const bool have = __builtin_cpu_supports("avx2");
+   return have;
+#else
+   return false;
+#endif
+}
+
+int md5_lanes() {
+   return __avx2() ? 8 : 4;
+}
+
+void md5_many(const unsigned char* const* in, const size_t* len, size_t n,
+   unsigned char* out) {
+#if defined(__MD5_AVX2)
+   if (__avx2()) {
+      __many8(in, len, n, out);
+      return;
+   }
+#endif
+   __many4(in, len, n, out);
+}
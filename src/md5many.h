@@ -0,0 +1,61 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code was developed for an EU.EDGE internal project and
+ * is made available according to the terms of this license.
+ *
+ * The Initial Developer of the Original Code is Istvan T. Hernadvolgyi,
+ * EU.EDGE LLC.
+ *
+ * Portions created by EU.EDGE LLC are Copyright (C) EU.EDGE LLC.
+ * All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+// MULTI-BUFFER MD5 - HEADER
+//
+
+#if !defined(_MD5MANY_H_)
+#define _MD5MANY_H_
+
+#include <cstddef>
+
+/** MD5 of many buffers at once.
+ *
+ * MD5 is a chain of dependent 32 bit operations, so one buffer cannot
+ * use more than one SIMD lane. Here every lane hashes a buffer of its
+ * own: 8 lanes with AVX2, 4 with SSE2 (or whatever the compiler makes
+ * of 16 byte vectors elsewhere). A lane that finishes its buffer takes
+ * the next one, so buffers of different lengths keep the lanes busy.
+ * Pays off for many small buffers; a single large one is better left
+ * to OpenSSL.
+ *
+ * @param in the buffers
+ * @param len their lengths
+ * @param n number of buffers
+ * @param out n digests of 16 bytes
+ */
+void md5_many(const unsigned char* const* in, const size_t* len, size_t n,
+   unsigned char* out);
+
+/** Number of lanes md5_many uses on this CPU. */
+int md5_lanes();
+
+#endif
@@ -36,12 +36,11 @@
 // BUILD:
 // THIS TOOL REQUIRES THE OPENSSL C LIBRARIES (libcrypto).
 //
-// g++ -O3 -o ua filei.cc ua.cc -I . -lcrypto
-// 
-// or
+// ua is a front end of the scanner in libua (uascan.h):
 //
-// g++ -O3 -o ua filei.cc ua.cc -I . -D__NOHASH -lcrypto
-// if you prefer to use tree based containers.
+// g++ -O3 -o ua ua.cc -I . -L . -lua -lcrypto -lpthread
+// 
+// or build libua with -D__NOHASH if you prefer tree based containers.
 //
 // once compiled,
 //
@@ -53,17 +52,30 @@
 #define __UA_VERSION "1.0"
 #endif
 
-#include <filei.h>
+#include <uaaction.h>
+#include <uachunks.h>
+#include <uaformat.h>
+#include <uamanifest.h>
+#include <uascan.h>
+#include <uaserve.h>
+#include <uastats.h>
+#include <uatrace.h>
+#include <uawatch.h>
+#include <uawriter.h>
+#include <climits>
+#include <condition_variable>
 #include <cstring>
+#include <fstream>
+#include <memory>
 #include <thread>
-#include <future>
-#include <vector>
-#include <mutex>
-#include <map>
 
 extern "C" {
 #include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
 }
 
 static char __help[] = 
@@ -82,9 +94,68 @@ static char __help[] =
 "  -q:         quote file names with single quotes\n"
 "  -t <num>:   number of threads (default: auto-detect)\n"
 "  -M:         disable adaptive milestone comparison\n"
+"  -P:         read files in physical order, one reader per spinning disk\n"
+"  -d <spec>:  device queue depths, e.g. rot=1,ssd=16,8:16=2,auto\n"
+"  -S <plan>:  sample plan, e.g. 4096:tail,0.25,0.5,0.75 (none: off)\n"
 "  -h:         this help (-vh more verbose help)\n"
+"  --stats <file>: write run statistics (JSON) to <file>\n"
+"  --trace <file>: write a timeline (Chrome trace JSON) to <file>\n"
+"  --latency <ms>: write results at most <ms> after found (default 100)\n"
+"  --progress <fd>: write progress heartbeats (JSON lines) to <fd>\n"
+"  --heartbeat <s>: seconds between heartbeats (default 1)\n"
+"  --format <fmt>: output format: text, jsonl, csv, bin (default text)\n"
+"  --dedupe:   share the extents of identical files (FIDEDUPERANGE)\n"
+"  --link:     replace identical files by hard links to the first one\n"
+"  --dry-run:  only report what --dedupe or --link would reclaim\n"
+"  --spill <dir>: group by size on disk in <dir> (bounded memory)\n"
+"  --spill-run <n>: paths per sorted run with --spill (default 1048576)\n"
+"  --shard <i>/<n>: only take the sizes of shard i (0..n-1) of n\n"
+"  --emit-manifest <file>: also write the sets found to a manifest\n"
+"  --merge:    merge the manifests given instead of FILEs\n"
+"  --left <list>: file with the path names of one side (- for stdin)\n"
+"  --right <list>: same for the other side; report only the sets that\n"
+"              have files of both sides\n"
+"  --watch <dir>: scan <dir>, then report set changes as it changes\n"
+"  --index <file>: keep the --watch index in <file> across restarts;\n"
+"              without --watch, take the digests of unchanged files from it\n"
+"  --chunks:   report sub-file redundancy (content defined chunking)\n"
+"  --chunk-size <n>: average chunk size with --chunks (default 8192)\n"
+"  --socket <path>: serve queries (kua --server) about the FILEs on the\n"
+"              Unix socket <path>, e.g. ua serve --socket /run/ua -\n"
 "  -           read file names from stdin\n";
 
+// long options
+enum { __OPT_STATS = 256, __OPT_TRACE, __OPT_LATENCY, __OPT_PROGRESS,
+   __OPT_HEARTBEAT, __OPT_FORMAT, __OPT_DEDUPE,
+   __OPT_LINK, __OPT_DRYRUN, __OPT_SPILL, __OPT_SPILLRUN,
+   __OPT_SHARD, __OPT_MANIFEST, __OPT_MERGE, __OPT_LEFT, __OPT_RIGHT,
+   __OPT_WATCH, __OPT_INDEX, __OPT_SOCKET, __OPT_CHUNKS, __OPT_CHUNKSIZE };
+
+static struct option __longopts[] = {
+   { "stats", required_argument, 0, __OPT_STATS },
+   { "trace", required_argument, 0, __OPT_TRACE },
+   { "latency", required_argument, 0, __OPT_LATENCY },
+   { "progress", required_argument, 0, __OPT_PROGRESS },
+   { "heartbeat", required_argument, 0, __OPT_HEARTBEAT },
+   { "format", required_argument, 0, __OPT_FORMAT },
+   { "dedupe", no_argument, 0, __OPT_DEDUPE },
+   { "link", no_argument, 0, __OPT_LINK },
+   { "dry-run", no_argument, 0, __OPT_DRYRUN },
+   { "spill", required_argument, 0, __OPT_SPILL },
+   { "spill-run", required_argument, 0, __OPT_SPILLRUN },
+   { "shard", required_argument, 0, __OPT_SHARD },
+   { "emit-manifest", required_argument, 0, __OPT_MANIFEST },
+   { "merge", no_argument, 0, __OPT_MERGE },
+   { "left", required_argument, 0, __OPT_LEFT },
+   { "right", required_argument, 0, __OPT_RIGHT },
+   { "watch", required_argument, 0, __OPT_WATCH },
+   { "index", required_argument, 0, __OPT_INDEX },
+   { "socket", required_argument, 0, __OPT_SOCKET },
+   { "chunks", no_argument, 0, __OPT_CHUNKS },
+   { "chunk-size", required_argument, 0, __OPT_CHUNKSIZE },
+   { 0, 0, 0, 0 }
+};
+
 static char __vhelp[] =
 "The algorithm performs the following steps:\n\n"
 "   1. Ask the FS for file size and throw away files with unique counts\n"
@@ -93,16 +164,61 @@ static char __vhelp[] =
 "      with unique prefix hash\n"
 "   3. The still matching files will go through a full MD5 hash\n\n"
 "Adaptive milestone comparison (enabled by default, disable with -M):\n"
-"   For files with the same size, this feature performs progressive chunk\n"
-"   comparisons starting with small chunks and adaptively increasing to\n"
-"   larger chunks (up to 256MB for multi-gigabyte files). This eliminates\n"
-"   non-identical files early using fast xxHash64, reducing the number of\n"
-"   files that need full hashing. Chunk sizes are automatically adjusted\n"
-"   based on file size for optimal performance.\n\n"
+"   For files with the same size, this feature compares prefixes of\n"
+"   growing size (1KB to 256MB in steps of 4x) using fast xxHash64 and\n"
+"   eliminates non-identical files early, reducing the number of files\n"
+"   that need full hashing. The next prefix size is chosen at run time\n"
+"   from the measured elimination rate of each size, the time it takes\n"
+"   to open a file and the device throughput: a stage runs only if the\n"
+"   bytes it is expected to save exceed the bytes it reads. Stages that\n"
+"   eliminate nothing are merged into larger ones, and when two files\n"
+"   are left they are compared in lockstep instead of being hashed.\n\n"
+"Small files:\n"
+"   Files of up to 64 KB are read once and compared in memory: they are\n"
+"   grouped on a 128 bit xxHash of their bytes, confirmed byte by byte,\n"
+"   and skip the sampling and milestone stages. Only one file of a set\n"
+"   is hashed, when the output needs the digest (-p). Not with -w or -n.\n\n"
+"Metadata shortcuts:\n"
+"   Empty files are identical and are not opened. Names of the same file\n"
+"   (hard links, a path given twice) are read once and reported in the\n"
+"   set of that file, or as a set of their own. Not with -w or -n.\n\n"
+"Stat phase:\n"
+"   Files are stat'ed in batches. When the first stats of a batch are\n"
+"   quick, the batch is spread over the -t threads. When they are slow\n"
+"   (network and FUSE file systems), up to 256 statx requests are kept\n"
+"   in flight through io_uring, or fstatat calls on a pool of threads\n"
+"   where io_uring is not available.\n\n"
+"Sampling pre-filter (-S):\n"
+"   Before the prefix milestones, large files of the same size are\n"
+"   compared on a few small blocks read with pread: by default 4096\n"
+"   bytes at the tail and at 1/4, 1/2 and 3/4 of the file. Files that\n"
+"   differ only near the end or in the middle drop out at a few KB of\n"
+"   I/O. The plan is [<bsize>:]<pos>,... where <pos> is tail, a fraction\n"
+"   (0.5), a percentage (50%), an offset or a negative offset from the\n"
+"   end. Sampling applies to files at least 64 times the sampled bytes\n"
+"   and is skipped with -w, -n, or -m without -2.\n\n"
+"Physical order reads (-P):\n"
+"   Reads are grouped by device and, within a device, sorted by the\n"
+"   physical location of the file (FIEMAP first extent, inode number\n"
+"   when the FS does not tell). Rotational disks are read by a single\n"
+"   thread in that order, which turns a seek-bound scan of an HDD into\n"
+"   a mostly sequential one. Other devices still use -t threads.\n\n"
+"Device queue depths (-d):\n"
+"   Files are queued per device (st_dev). -t sets the number of worker\n"
+"   threads; each device may keep at most its depth of them busy, and\n"
+"   free workers go to the device using the least of its budget. By\n"
+"   default spinning disks get 2 (1 with -P), other devices every\n"
+"   worker. The spec is a comma separated list of N (all devices),\n"
+"   rot=N, ssd=N, MAJ:MIN=N or PATH=N (the device PATH is on); adding\n"
+"   auto tunes each depth from the measured throughput. Size groups are\n"
+"   processed concurrently, so a scan over mixed media is not held back\n"
+"   by its slowest device. With -v the per-device totals are reported.\n\n"
 "-w implies -n, since the byte count is irrelevant information.\n"
 "The two-stage hashing algorithm first calculates identical sets\n"
 "considering only the first <max> bytes (thus the -2 option requires -m)\n"
-"and then from these sets calculates the final result.\n"
+"and then from these sets calculates the final result. The second stage\n"
+"continues each hash from where the first one stopped, so every file is\n"
+"read once (with -w it starts over, as white space is not counted).\n"
 "This can be much faster when there are many files with the same size\n"
 "or when comparing files with whitespaces ignored. When -w and -m are\n"
 "both set, <max> refers to the first <max> non-white characters.\n\n"
@@ -142,11 +258,128 @@ static char __vhelp[] =
 "    the calculation in two stages (-2), first cluster based on the\n"
 "    whitespace-free first 256 characters (-m256). Also, separate the\n"
 "    identical files in the output by commas (-s,).\n\n"
+"Statistics (--stats <file>):\n"
+"   Writes a JSON report of the run: wall, busy and CPU seconds, bytes\n"
+"   read, syscalls (opens, reads, stats, ioctls) and files tested and\n"
+"   eliminated for each phase (ingest, stat, sample, every milestone\n"
+"   chunk size, hash, stage2, compare, output), placement cache hits\n"
+"   and per-device throughput. Use it to tune -m, -b, -t and -d.\n\n"
+"Trace (--trace <file>):\n"
+"   Writes a timeline in Chrome Trace Event format (open it in\n"
+"   chrome://tracing or ui.perfetto.dev): a span for every file read,\n"
+"   milestone round, size group and output flush, tagged with the file\n"
+"   size and device, and idle spans of the read workers.\n\n"
+"Streaming (--latency, --progress, --heartbeat):\n"
+"   Each set of identical files is written as soon as it is final, i.e.\n"
+"   when its size group is done, not at the end of the scan. Output is\n"
+"   buffered, but nothing waits in the buffer for longer than --latency\n"
+"   milliseconds (0 writes every set at once), so a consumer can delete\n"
+"   or link while the scan goes on. --progress <fd> writes a JSON line\n"
+"   every --heartbeat seconds to the given file descriptor, e.g.\n\n"
+"     $ find ... | ua --progress 3 - 3>progress.log\n\n"
+"   with elapsed seconds, paths, paths stat'ed, size groups found and\n"
+"   done, sets and files reported so far and bytes read; the last line\n"
+"   has \"done\": true.\n\n"
+"Deduplication (--dedupe):\n"
+"   Each set found is handed to the workers right away, while the files\n"
+"   are still cached, and every file of the set shares the extents of\n"
+"   the first one via ioctl(FIDEDUPERANGE) (btrfs, XFS): up to 64 files\n"
+"   per call, in ranges of 16MB. The kernel compares the bytes first, so\n"
+"   files changed since the scan are left alone. Hard links of the first\n"
+"   file and files on other file systems are skipped. A summary goes to\n"
+"   stderr, -v reports the files not deduplicated. Not with -i, -w, -m.\n\n"
+"Hard links (--link):\n"
+"   For file systems without reflinks, every file of a set is replaced by\n"
+"   a hard link to the first one: linked under a temporary name in its\n"
+"   directory and renamed over it, so the path is never missing. The\n"
+"   bytes are compared first, files changed since the scan are left\n"
+"   alone. Files are processed a directory at a time, one worker per\n"
+"   directory.\n"
+"   Bytes count as reclaimed when the replaced file had no other links.\n"
+"   With --dry-run nothing is changed and the summary tells what --link\n"
+"   or --dedupe would reclaim.\n\n"
+"Spilling (--spill <dir>):\n"
+"   For scans of more paths than fit in memory. Path names are written\n"
+"   to a file in <dir> as they are read; the scan stats --spill-run of\n"
+"   them at a time and writes their (size, device, inode, path) records\n"
+"   sorted by size to a run file, then merges the runs and hashes each\n"
+"   size group as the merge reaches it. Memory use then grows with the\n"
+"   largest size group rather than with the tree. The files in <dir>\n"
+"   are removed as soon as they are created. Sets list their paths by\n"
+"   device and inode. With -n (or -w, or -m without -2) every file is\n"
+"   in one size group, so there is nothing to gain.\n\n"
+"Sharded scans (--shard, --emit-manifest, --merge):\n"
+"   A scan can be split across processes or hosts by file size: with\n"
+"   --shard i/n a process stats every file but only hashes the sizes of\n"
+"   shard i (sizes are spread by a hash), so n processes share the I/O.\n"
+"   --emit-manifest <file> writes the sets found, one record of size,\n"
+"   digest and path per file, sorted. ua --merge m1 m2 ... then merges\n"
+"   the manifests in one sequential pass without reading any file, e.g.\n\n"
+"     host1$ find /a | ua --shard 0/2 --emit-manifest m0 - >/dev/null\n"
+"     host2$ find /a | ua --shard 1/2 --emit-manifest m1 - >/dev/null\n"
+"     $ ua --merge m0 m1\n\n"
+"   Manifests must come from scans with the same -a, -i, -w, -n and -m,\n"
+"   and together cover every shard. Records with the same size and\n"
+"   digest in different manifests form one set, so manifests of\n"
+"   overlapping scans can be merged too.\n\n"
+"Cross-set comparison (--left, --right):\n"
+"   To find which files of one tree already exist in another, e.g.\n\n"
+"     $ ua --left <(find /incoming -type f) --right <(find /archive -type f)\n\n"
+"   only sets with files of both sides are reported. Size groups of one\n"
+"   side are dropped before any file is read, and so are the subgroups\n"
+"   that become one sided after sampling, milestones or hashing, so the\n"
+"   duplicates within one side cost nothing unless the other side has\n"
+"   the same content. A path on both lists (/incoming inside the\n"
+"   /archive walk) belongs to both sides.\n\n"
+"Watching a tree (--watch <dir>):\n"
+"   ua --watch /data scans /data once, then follows its changes (inotify)\n"
+"   and runs until interrupted. Only files that changed are stat'ed\n"
+"   again, and hashed only when another file has their size, so the\n"
+"   cost follows the churn rather than the size of the tree. The output\n"
+"   is JSON lines with an \"event\" member: \"set\" for a set that\n"
+"   appeared or whose files changed (the whole set is listed), \"unset\"\n"
+"   for a set that fell below two files (the files left are listed).\n"
+"   With --index <file> the index of sizes, mtimes, ctimes, inodes and\n"
+"   digests is saved on exit, and a restart only hashes what changed\n"
+"   meanwhile. A plain scan given the same --index takes the digests of\n"
+"   the files that did not change (size, mtime, ctime, device and inode)\n"
+"   from it.\n"
+"   --dedupe and --link act on every set reported.\n\n"
+"Chunk analysis (--chunks):\n"
+"   Whole file equality misses files that differ in a few places (VM\n"
+"   images, database dumps). --chunks cuts every FILE into chunks at\n"
+"   content defined boundaries (FastCDC gear hash, --chunk-size bytes on\n"
+"   average), fingerprints them (XXH3-128, BLAKE3 with -a b3) and\n"
+"   reports instead of sets:\n\n"
+"     total <files> <bytes> <chunks> <unique chunks> <unique bytes> <ratio>\n"
+"     file <bytes> <shared bytes> <shared %> <path>\n"
+"     pair <shared bytes> <path> <path>\n\n"
+"   where shared bytes are in chunks that occur more than once, the\n"
+"   ratio is bytes over unique bytes (what a chunk store would hold)\n"
+"   and the pairs are the 10 pairs of files sharing the most bytes.\n"
+"   Chunks found in more than 64 files do not count for the pairs.\n\n"
+"Query server (ua serve --socket <path>):\n"
+"   Keeps the FILEs in memory by size and answers batches of queries\n"
+"   from kua --server <path> (or any client of uaserve.h) about files\n"
+"   with a given (size, digest), or identical to a given file, until\n"
+"   interrupted. A size is hashed the first time it is asked for, so\n"
+"   startup only stats the files and later queries are answered from\n"
+"   memory. Files changed after they were hashed are not noticed.\n\n"
 "Output\n\n"
 "  Each line of the output represents one set of identical files. The columns\n"
 "  are the path names separated by <sep> (-s). When -p set, the first column\n"
 "  will be the hash value. Remember that if -i or -w are set the hash value\n"
 "  will likely be different from what md5sum would give.\n\n"
+"  --format selects a machine-readable output instead, where every set has\n"
+"  a number (id), the byte count (size, null/empty with -n or -w), the\n"
+"  algorithm (alg), the hex digest and the paths:\n\n"
+"    jsonl  one JSON object per set and line, paths as a JSON array\n"
+"    csv    RFC 4180, header id,size,alg,digest,path and a row per path\n"
+"    bin    \"UASETS\\0\\1\" followed by records aligned to 8 bytes: uint32\n"
+"           record length, uint32 path count, uint64 id, uint64 size\n"
+"           (all ones if unknown), uint8 algorithm, uint8 digest length,\n"
+"           6 zero bytes, the digest, then uint32 length and bytes of each\n"
+"           path, zero padded (host byte order)\n\n"
 "Blame\n\n"
 "  istvan.hernadvolgyi@gmail.com\n\n";
 
@@ -179,191 +412,251 @@ static void __phelp(bool v) {
    std::cout.flush();
 }
 
-// Function to process a batch of files in parallel
-void process_file_batch(const std::vector<std::string>& files, fsetc_t& files_by_size, 
-                       bool count, bool verbose, std::mutex& mtx) {
-   for (const auto& file : files) {
-      try {
-         size_t s = count ? filei::fsize(file) : 0;
-         
-         std::lock_guard<std::mutex> lock(mtx);
-         files_by_size[s].push_back(file);
-         if (verbose) std::cerr << (count ? "Counting " : "Spooling ") 
-                               << file << std::endl;
-      } catch(const char* e) {
-         if (verbose) std::cerr << "Skipping " << file << ", " << e << std::endl;
-         continue;
+// add the path names listed in a file (- for stdin) to one side
+static bool __list(const std::string& name, uascan& scanner, bool right) {
+   std::ifstream f;
+   if (name != "-") {
+      f.open(name.c_str());
+      if (!f.good()) {
+         std::cerr << "Could not open " << name << std::endl;
+         return false;
       }
    }
-}
-
-// Adaptive milestone chunk comparison
-std::vector<std::string> adaptive_milestone_compare(const std::vector<std::string>& candidates,
-                                                   bool ic, bool iw, int thread_count, bool verbose) {
-   if (candidates.size() < 2) return candidates;
-   
-   std::vector<std::string> remaining = candidates;
-   
-   // Determine file size to choose appropriate chunk sizes
-   size_t file_size = 0;
-   try {
-      file_size = filei::fsize(candidates[0]);
-   } catch(const char*) {
-      file_size = 0;
-   }
-   
-   // Adaptive chunk sizes based on file size
-   std::vector<size_t> chunk_sizes;
-   if (file_size > 1024ULL * 1024ULL * 1024ULL) { // > 1GB
-      chunk_sizes = {1048576, 4194304, 16777216, 67108864, 268435456}; // 1MB, 4MB, 16MB, 64MB, 256MB
-   } else if (file_size > 100ULL * 1024ULL * 1024ULL) { // > 100MB
-      chunk_sizes = {262144, 1048576, 4194304, 16777216, 67108864}; // 256KB, 1MB, 4MB, 16MB, 64MB
-   } else if (file_size > 10ULL * 1024ULL * 1024ULL) { // > 10MB
-      chunk_sizes = {65536, 262144, 1048576, 4194304, 16777216}; // 64KB, 256KB, 1MB, 4MB, 16MB
-   } else {
-      chunk_sizes = {1024, 4096, 16384, 65536, 262144, 1048576, 4194304, 16777216, 67108864}; // 1KB, 4KB, 16KB, 64KB, 256KB, 1MB, 4MB, 16MB, 64MB
-   }
-   
-   if (verbose) {
-      std::cerr << "File size: " << file_size << " bytes, using " << chunk_sizes.size() 
-                << " milestone chunks (max: " << chunk_sizes.back() / (1024*1024) << "MB)" << std::endl;
-   }
-   
-   for (size_t chunk_size : chunk_sizes) {
-      if (remaining.size() < 2) break;
-      
-      // Skip chunks larger than file size
-      if (file_size > 0 && chunk_size > file_size) break;
-      
-      if (verbose) {
-         std::cerr << "Comparing " << remaining.size() << " candidates with " 
-                   << chunk_size << " byte chunks" << std::endl;
-      }
-      
-      // Group files by their chunk hash
-      std::mutex chunk_mtx;
-      std::map<std::string, std::vector<std::string>> chunk_groups;
-      std::vector<std::future<void>> chunk_futures;
-      
-      for (const auto& file : remaining) {
-         chunk_futures.push_back(std::async(std::launch::async, [&chunk_groups, &chunk_mtx, &file, chunk_size, ic, iw]() {
-            try {
-               // Create a temporary filei object just for the chunk
-               filei fi(file, ic, iw, chunk_size, 1024, filei_hash_alg::XXHASH64); // Use fast xxHash for chunks
-               std::string chunk_hash(reinterpret_cast<const char*>(fi.hash()), fi.hash_len());
-               
-               std::lock_guard<std::mutex> lock(chunk_mtx);
-               chunk_groups[chunk_hash].push_back(file);
-            } catch(const char*) {
-               // Skip files that can't be read
-            }
-         }));
-      }
-      
-      for (auto& f : chunk_futures) f.wait();
-      
-      // Update remaining candidates to only those with matching chunk hashes
-      remaining.clear();
-      for (const auto& pair : chunk_groups) {
-         if (pair.second.size() >= 2) {
-            remaining.insert(remaining.end(), pair.second.begin(), pair.second.end());
-         }
-      }
-      
-      if (verbose && remaining.size() < candidates.size()) {
-         std::cerr << "Eliminated " << (candidates.size() - remaining.size()) 
-                   << " candidates with " << chunk_size << " byte comparison" << std::endl;
+   std::istream& is = name == "-" ? std::cin : f;
+   for(std::string file; std::getline(is, file);) {
+      if (file.empty()) continue;
+      if (scanner.add(file, right) != ua_error::OK) {
+         std::cerr << scanner.message() << std::endl;
+         return false;
       }
    }
-   
-   return remaining;
+   return true;
 }
 
-int main(int argc, char* const * argv) {
+// print the result of a chunk analysis
+static void __chunks(const uachunks& ch, const std::string& sep, bool quote) {
+   const uachunks::totals& t = ch.total();
+   const char* q = quote ? "'" : "";
+   std::cout << "total" << sep << t.files << sep << t.bytes << sep << t.chunks
+             << sep << t.unique_chunks << sep << t.unique_bytes << sep
+             << (t.unique_bytes ? (double)t.bytes / t.unique_bytes : 1.0)
+             << "\n";
+   for(const auto& f : ch.files())
+      std::cout << "file" << sep << f.size << sep << f.shared << sep
+                << (f.size ? 100.0 * f.shared / f.size : 0.0) << sep
+                << q << f.path << q << "\n";
+   for(const auto& p : ch.pairs(10))
+      std::cout << "pair" << sep << p.bytes << sep << q << ch.files()[p.a].path
+                << q << sep << q << ch.files()[p.b].path << q << "\n";
+   std::cout.flush();
+}
 
-   
-   fsetc_t files;
+// set by SIGINT and SIGTERM to end --watch and serve
+static volatile sig_atomic_t __stop = 0;
 
-   bool ic = false; // ignore case
-   bool iw = false; // ignore white space
+static void __interrupt(int) {
+   __stop = 1;
+}
+
+// write a progress heartbeat as a JSON line
+static void __heartbeat(int fd, const uascan::progress& p, double secs, bool done) {
+   char b[512];
+   int n = ::snprintf(b, sizeof(b), "{\"elapsed\": %.3f, \"paths\": %zu, "
+      "\"stated\": %zu, \"groups\": %zu, \"groups_done\": %zu, "
+      "\"sets\": %zu, \"files\": %zu, \"bytes\": %llu, \"done\": %s}\n",
+      secs, p.paths, p.stated, p.groups, p.done, p.sets, p.files, p.bytes,
+      done ? "true" : "false");
+   if (n > 0 && ::write(fd, b, std::min((size_t)n, sizeof(b) - 1)) < 0) { }
+}
+
+int main(int argc, char* const * argv) {
+
+   uascan::options o; // the defaults of ua
    bool v = false; // verbose
-   bool stage = false; // two stage
-   int BN = 1024; // buffer size
    bool ph = false; // print hash
-   bool count = true; // take size into account
    bool quote = false; // quote file names with single quotes
-   bool milestone = true; // use adaptive milestone comparison
-
-   int max = 0; // max chars to consider, ALL
-   int thread_count = std::thread::hardware_concurrency(); // number of threads
+   std::string stats; // statistics file
+   std::string trace; // trace file
+   unsigned latency = 100; // result flush bound (ms)
+   int progress = -1; // heartbeat fd
+   double heartbeat = 1.0; // seconds between heartbeats
+   uaformat::kind fmt = uaformat::TEXT; // output format
+   bool dedupe = false; // deduplicate the sets found
+   bool link = false; // replace duplicates by hard links
+   bool dry = false; // only report what the action would do
+   std::string manifest; // manifest to write
+   bool merge = false; // merge manifests
+   std::string left, right; // path lists of the sides
+   std::string watch; // tree to watch
+   std::string index; // index file of the watch
+   std::string socket; // socket to serve queries on
+   bool chunks = false; // chunk analysis
+   size_t chunk_size = 8192; // average chunk size
 
    bool comm = true; // from command line
 
    std::string sep(" "); // default sep
 
-   filei_hash_alg alg = filei_hash_alg::MD5;
-
    if (argc <= 1) {
       __phelp(false);
       return 1;
    }
 
    int opt;
-   while((opt = ::getopt(argc,argv,"hb:viws:m:2pna:qt:M")) != -1) {
+   while((opt = ::getopt_long(argc,argv,"hb:viws:m:2pna:qt:MPd:S:",__longopts,0)) != -1) {
       switch(opt) {
          case 'b':
-            BN = ::atoi(::optarg);
-            if (!BN) {
+            o.bsize = ::atoi(::optarg);
+            if (!o.bsize) {
                std::cerr << "Invalid buffer size " << ::optarg << std::endl;
                return 1;
             }
             break;
          case 'm':
-            max = ::atoi(::optarg);
+            o.max = ::atoi(::optarg);
             break;
          case 't':
-            thread_count = ::atoi(::optarg);
-            if (thread_count <= 0) {
+            o.threads = ::atoi(::optarg);
+            if (o.threads <= 0) {
                std::cerr << "Invalid thread count " << ::optarg << std::endl;
                return 1;
             }
             break;
          case 'i':
-            ic = true;
+            o.ic = true;
             break;
          case 'v':
             v = true;
             break;
          case 'w':
-            iw = true;
+            o.iw = true;
             break;
          case 's':
             sep = std::string(::optarg);
             break;
          case '2':
-            stage = true;
+            o.stage = true;
             break;
          case 'p':
             ph = true;
             break;
          case 'n':
-            count = false;
+            o.count = false;
             break;
          case 'q':
             quote = true;
             break;
          case 'M':
-            milestone = false;
+            o.milestones = false;
+            break;
+         case 'P':
+            o.physical = true;
+            break;
+         case 'd':
+            o.depths = std::string(::optarg);
+            break;
+         case __OPT_STATS:
+            stats = std::string(::optarg);
+            break;
+         case __OPT_TRACE:
+            trace = std::string(::optarg);
+            break;
+         case __OPT_LATENCY: {
+            char* end;
+            long l = ::strtol(::optarg, &end, 10);
+            if (!*::optarg || *end || l < 0 || l > UINT_MAX) {
+               std::cerr << "Invalid latency " << ::optarg << std::endl;
+               return 1;
+            }
+            latency = l;
+            break;
+         }
+         case __OPT_PROGRESS:
+            progress = ::atoi(::optarg);
+            if (progress < 0 || ::fcntl(progress, F_GETFD) < 0) {
+               std::cerr << "Invalid progress descriptor " << ::optarg << std::endl;
+               return 1;
+            }
+            break;
+         case __OPT_HEARTBEAT:
+            heartbeat = ::atof(::optarg);
+            if (heartbeat <= 0) {
+               std::cerr << "Invalid heartbeat interval " << ::optarg << std::endl;
+               return 1;
+            }
+            break;
+         case __OPT_FORMAT:
+            if (!uaformat::parse(::optarg, fmt)) {
+               std::cerr << "Unknown format: " << ::optarg << std::endl;
+               return 1;
+            }
+            break;
+         case __OPT_DEDUPE:
+            dedupe = true;
+            break;
+         case __OPT_LINK:
+            link = true;
+            break;
+         case __OPT_DRYRUN:
+            dry = true;
+            break;
+         case __OPT_SPILL:
+            o.spill = std::string(::optarg);
+            break;
+         case __OPT_SPILLRUN:
+            o.spill_run = ::atol(::optarg) > 0 ? ::atol(::optarg) : 0;
+            break;
+         case __OPT_SHARD: {
+            char c;
+            if (::sscanf(::optarg, "%u/%u%c", &o.shard, &o.shards, &c) != 2) {
+               std::cerr << "Invalid shard " << ::optarg << std::endl;
+               return 1;
+            }
+            break;
+         }
+         case __OPT_MANIFEST:
+            manifest = std::string(::optarg);
+            break;
+         case __OPT_MERGE:
+            merge = true;
+            break;
+         case __OPT_LEFT:
+            left = std::string(::optarg);
+            break;
+         case __OPT_RIGHT:
+            right = std::string(::optarg);
+            break;
+         case __OPT_WATCH:
+            watch = std::string(::optarg);
+            break;
+         case __OPT_INDEX:
+            index = std::string(::optarg);
+            break;
+         case __OPT_SOCKET:
+            socket = std::string(::optarg);
+            break;
+         case __OPT_CHUNKS:
+            chunks = true;
+            break;
+         case __OPT_CHUNKSIZE:
+            chunk_size = ::atol(::optarg);
+            if (::atol(::optarg) <= 0) {
+               std::cerr << "Invalid chunk size " << ::optarg << std::endl;
+               return 1;
+            }
+            break;
+         case 'S':
+            o.sample = std::string(::optarg);
             break;
          case 'h':
             __phelp(v);
             return 0;
          case 'a':
-            if (strcmp(::optarg, "md5") == 0) alg = filei_hash_alg::MD5;
-            else if (strcmp(::optarg, "sha1") == 0) alg = filei_hash_alg::SHA1;
-            else if (strcmp(::optarg, "sha256") == 0) alg = filei_hash_alg::SHA256;
-            else if (strcmp(::optarg, "b3") == 0) alg = filei_hash_alg::BLAKE3;
-            else if (strcmp(::optarg, "xxh64") == 0) alg = filei_hash_alg::XXHASH64;
+            if (strcmp(::optarg, "md5") == 0) o.alg = filei_hash_alg::MD5;
+            else if (strcmp(::optarg, "sha1") == 0) o.alg = filei_hash_alg::SHA1;
+            else if (strcmp(::optarg, "sha256") == 0) o.alg = filei_hash_alg::SHA256;
+            else if (strcmp(::optarg, "b3") == 0) o.alg = filei_hash_alg::BLAKE3;
+            else if (strcmp(::optarg, "xxh64") == 0) o.alg = filei_hash_alg::XXHASH64;
             else {
                std::cerr << "Unknown algorithm: " << ::optarg << std::endl;
                return 1;
@@ -375,17 +668,156 @@ int main(int argc, char* const * argv) {
       }
    }
 
-   if (stage && !max) {
-      std::cerr << "The two stage algorithm requires -m set!" << std::endl;
+   if (dedupe && link) {
+      std::cerr << "Use either --dedupe or --link!" << std::endl;
+      return 1;
+   }
+   if ((dedupe || link) && (o.ic || o.iw || o.max)) {
+      std::cerr << (dedupe ? "--dedupe" : "--link")
+                << " needs byte identical sets (no -i, -w or -m)!" << std::endl;
+      return 1;
+   }
+
+   if (merge && (dedupe || link)) {
+      std::cerr << "--merge reads no files, so no --dedupe or --link!" << std::endl;
+      return 1;
+   }
+
+   if (left.empty() != right.empty()) {
+      std::cerr << "Use --left and --right together!" << std::endl;
+      return 1;
+   }
+   o.cross = left.size();
+   if (o.cross && (merge || argc > ::optind)) {
+      std::cerr << "With --left and --right the path names come from their lists!" << std::endl;
       return 1;
    }
 
-   if (count && iw) count = false;
+   if (chunks && (merge || o.cross || watch.size() || socket.size() ||
+       manifest.size() || o.shards > 1 || o.spill.size() || dedupe || link ||
+       fmt != uaformat::TEXT)) {
+      std::cerr << "--chunks only reports chunks!" << std::endl;
+      return 1;
+   }
+   if (chunks && (o.ic || o.iw || o.max)) {
+      std::cerr << "--chunks reads the bytes as they are (no -i, -w or -m)!" << std::endl;
+      return 1;
+   }
 
-   if (count && max && !stage) count = false;
+   // ua serve --socket <path>
+   if (socket.size() && ::optind < argc && !::strcmp(argv[::optind], "serve"))
+      ++::optind;
+   if (socket.size() && (merge || o.cross || watch.size() || manifest.size() ||
+       o.shards > 1 || o.spill.size() || dedupe || link)) {
+      std::cerr << "--socket only serves queries!" << std::endl;
+      return 1;
+   }
+   if (socket.size() && (!o.count || o.iw || o.max)) {
+      std::cerr << "--socket needs file sizes (no -n, -w or -m)!" << std::endl;
+      return 1;
+   }
 
-   if (v) {
-      std::cerr << "Using " << thread_count << " threads" << std::endl;
+   // without --watch the index only lends its digests to the scan
+   if (index.size() && watch.empty()) {
+      if (merge || socket.size()) {
+         std::cerr << "--index does not go with --merge or --socket!" << std::endl;
+         return 1;
+      }
+      o.index = index;
+   }
+   if (watch.size()) {
+      if (merge || o.cross || manifest.size() || o.shards > 1 || o.spill.size() ||
+          argc > ::optind) {
+         std::cerr << "--watch takes its files from the tree only!" << std::endl;
+         return 1;
+      }
+      if (!o.count || o.iw || o.max) {
+         std::cerr << "--watch needs file sizes (no -n, -w or -m)!" << std::endl;
+         return 1;
+      }
+      if (fmt != uaformat::TEXT && fmt != uaformat::JSONL) {
+         std::cerr << "--watch reports JSON lines only!" << std::endl;
+         return 1;
+      }
+      fmt = uaformat::JSONL;
+   }
+
+   // manifests need every digest
+   o.digests = ph || fmt != uaformat::TEXT || manifest.size();
+   o.verbose = v;
+
+   uascan scanner;
+   if (scanner.configure(o) != ua_error::OK) {
+      std::cerr << scanner.message() << std::endl;
+      return 1;
+   }
+   scanner.on_log([](const std::string& msg) {
+      std::cerr << msg << std::endl;
+   });
+   scanner.on_error([v](const std::string& file, const char* e) {
+      if (v) std::cerr << "Skipping " << file << ", " << e << std::endl;
+   });
+
+   // the manifests to merge and the options of their scans
+   std::vector<std::string> manifests;
+   uamanifest::header mhead = uamanifest::of(scanner.config());
+   if (merge) {
+      manifests.assign(argv + ::optind, argv + argc);
+      if (manifests.empty()) {
+         std::cerr << "No manifests to merge!" << std::endl;
+         return 1;
+      }
+      try {
+         mhead = uamanifest::reader(manifests[0]).head();
+         mhead.shard = 0;
+         mhead.shards = 1;
+      } catch(const char* e) {
+         std::cerr << manifests[0] << ": " << e << std::endl;
+         return 1;
+      }
+      ::optind = argc;
+   }
+
+   if (watch.size()) {
+      struct sigaction sa;
+      ::memset(&sa, 0, sizeof(sa));
+      sa.sa_handler = __interrupt;
+      ::sigaction(SIGINT, &sa, 0);
+      ::sigaction(SIGTERM, &sa, 0);
+
+      uawriter out(1, latency);
+      uaformat form(fmt, mhead.alg, mhead.count, sep, ph, quote);
+      std::string line;
+      std::unique_ptr<uaaction> action;
+      if (dedupe) action.reset(new uadedupe(scanner, dry));
+      else if (link) action.reset(new ualink(scanner, dry));
+      if (action) action->on_error([v](const std::string& file, const char* e) {
+         if (v) std::cerr << "Left alone " << file << ", " << e << std::endl;
+      });
+
+      uawatch w(scanner, watch, index);
+      w.on_log([v](const std::string& msg) {
+         if (v) std::cerr << msg << std::endl;
+      });
+      w.on_event([&](const char* event, const uascan::group& g) {
+         line.clear();
+         form.record(g, line, event);
+         out.commit(line);
+         if (action && !::strcmp(event, "set")) action->add(g);
+      });
+      ua_error res = w.start();
+      if (res == ua_error::OK) res = w.run(__stop);
+      if (res == ua_error::OK) res = w.save();
+      if (action) action->finish();
+      if (!out.flush()) {
+         std::cerr << "Could not write results" << std::endl;
+         return 1;
+      }
+      if (res != ua_error::OK) {
+         std::cerr << watch << ": " << w.message() << std::endl;
+         return 1;
+      }
+      return 0;
    }
 
    if (argc > ::optind) { 
@@ -399,145 +831,176 @@ int main(int argc, char* const * argv) {
       }
    }
 
-   char fileb[1024];
-
-   // Collect all file names first
-   std::vector<std::string> all_files;
-   
-   for(int i = ::optind;;) {
-      char* file;
-      if (comm) {
-         if (i == argc) break;
-         file = argv[i++];
-      } else {
-         std::cin.getline(fileb,1024);
-         if (std::cin.eof()) break;
-         file = fileb;
-      }
-      all_files.push_back(file);
-   }
-
-   // Process files in parallel batches
-   if (thread_count > 1 && all_files.size() > thread_count) {
-      std::mutex mtx;
-      std::vector<std::future<void>> futures;
-      
-      size_t batch_size = all_files.size() / thread_count;
-      size_t remainder = all_files.size() % thread_count;
-      
-      size_t start = 0;
-      for (int i = 0; i < thread_count; ++i) {
-         size_t end = start + batch_size + (i < remainder ? 1 : 0);
-         std::vector<std::string> batch(all_files.begin() + start, all_files.begin() + end);
-         
-         futures.push_back(std::async(std::launch::async, 
-                                    process_file_batch, 
-                                    std::move(batch), 
-                                    std::ref(files), 
-                                    count, v, std::ref(mtx)));
-         
-         start = end;
+   if (chunks) {
+      uachunks ch(scanner, chunk_size);
+      ch.on_error([v](const std::string& file, const char* e) {
+         if (v) std::cerr << "Skipping " << file << ", " << e << std::endl;
+      });
+      char fileb[1024];
+      for(int i = ::optind;;) {
+         if (comm) {
+            if (i == argc) break;
+            ch.add(argv[i++]);
+         } else {
+            std::cin.getline(fileb,1024);
+            if (std::cin.eof()) break;
+            ch.add(fileb);
+         }
       }
-      
-      // Wait for all threads to complete
-      for (auto& future : futures) {
-         future.wait();
+      if (ch.run() != ua_error::OK) {
+         std::cerr << scanner.message() << std::endl;
+         return 1;
       }
-   } else {
-      // Fall back to sequential processing for small file lists
-      for (const auto& file : all_files) {
-         try {
-            size_t s = count ? filei::fsize(file) : 0;
-            files[s].push_back(file);
-            if (v) std::cerr << (count ? "Counting " : "Spooling ") 
-                             << file << std::endl;
-         } catch(const char* e) {
-            if (v) std::cerr << "Skipping " << file << ", " << e << std::endl;
-            continue;
+      __chunks(ch, sep, quote);
+      return 0;
+   }
+
+   if (socket.size()) {
+      struct sigaction sa;
+      ::memset(&sa, 0, sizeof(sa));
+      sa.sa_handler = __interrupt;
+      ::sigaction(SIGINT, &sa, 0);
+      ::sigaction(SIGTERM, &sa, 0);
+
+      uaserve server(scanner);
+      server.on_log([v](const std::string& msg) {
+         if (v) std::cerr << msg << std::endl;
+      });
+      char fileb[1024];
+      for(int i = ::optind;;) {
+         if (comm) {
+            if (i == argc) break;
+            server.add(argv[i++]);
+         } else {
+            std::cin.getline(fileb,1024);
+            if (std::cin.eof()) break;
+            server.add(fileb);
          }
       }
+      ua_error res = server.load();
+      if (res == ua_error::OK) res = server.serve(socket, __stop);
+      if (res != ua_error::OK) {
+         std::cerr << socket << ": " << server.message() << std::endl;
+         return 1;
+      }
+      return 0;
    }
 
-   // iterate over size groups
-   for(fsetc_t::const_iterator fct= files.begin(); fct != files.end(); ++fct) {
-      // less than two in set
-      if (fct->second.size() < 2) continue;
-      // exactly two in set, and don't care about printing hash
-      else if (fct->second.size() == 2 && !ph) {
-         if (filei::eq(fct->second[0],fct->second[1],ic,iw,0,BN,alg)) {
-            if (quote) {
-               std::cout << "'" << fct->second[0] << "'" << sep << "'" << fct->second[1] << "'" << std::endl;
-            } else {
-               std::cout << fct->second[0] << sep << fct->second[1] << std::endl;
-            }
-         } 
-         continue;
-      }
+   char fileb[1024];
+
+   if (stats.size()) uastats::enable();
+   if (trace.size()) {
+      uatrace::enable();
+      uatrace::name("main");
+   }
 
-      // Adaptive milestone comparison first
-      std::vector<std::string> remaining_candidates;
-      if (milestone) {
-         remaining_candidates = adaptive_milestone_compare(fct->second, ic, iw, thread_count, v);
-         
-         if (remaining_candidates.size() < 2) continue;
-         
-         if (v) {
-            std::cerr << "After milestone comparison: " << remaining_candidates.size() 
-                      << " candidates remain from " << fct->second.size() << " files" << std::endl;
+   double t0 = uastats::now();
+   {
+      uastats::scope ingest(uastats::INGEST);
+      for(int i = ::optind;;) {
+         char* file;
+         if (comm) {
+            if (i == argc) break;
+            file = argv[i++];
+         } else {
+            std::cin.getline(fileb,1024);
+            if (std::cin.eof()) break;
+            file = fileb;
+         }
+         if (scanner.add(file) != ua_error::OK) {
+            std::cerr << scanner.message() << std::endl;
+            return 1;
          }
-      } else {
-         remaining_candidates = fct->second;
       }
+      if (o.cross && (!__list(left, scanner, false) ||
+          !__list(right, scanner, true)))
+         return 1;
+   }
+   uastats::wall(uastats::INGEST, uastats::now() - t0);
+
+   // heartbeats from their own thread until the scan is over
+   std::mutex hb_mtx;
+   std::condition_variable hb_cv;
+   bool over = false;
+   std::thread hb;
+   double start = uastats::now();
+   if (progress >= 0) hb = std::thread([&]() {
+      std::unique_lock<std::mutex> lock(hb_mtx);
+      while(!hb_cv.wait_for(lock, std::chrono::duration<double>(heartbeat),
+         [&over]() { return over; }))
+         __heartbeat(progress, scanner.status(), uastats::now() - start, false);
+   });
 
-      // Parallel hashing for remaining candidates
-      std::mutex hash_mtx;
-      std::map<std::string, std::vector<std::string>> hash_to_files;
-      std::vector<std::future<void>> hash_futures;
-      for (const auto& file : remaining_candidates) {
-         hash_futures.push_back(std::async(std::launch::async, [&hash_to_files, &hash_mtx, &file, ic, iw, max, BN, alg, v, count]() {
-            try {
-               filei fi(file, ic, iw, max, BN, alg);
-               std::string hash_str(reinterpret_cast<const char*>(fi.hash()), fi.hash_len());
-               {
-                  std::lock_guard<std::mutex> lock(hash_mtx);
-                  hash_to_files[hash_str].push_back(file);
-               }
-               if (v && !count) {
-                  std::lock_guard<std::mutex> lock(hash_mtx);
-                  std::cerr << "Processed " << file << std::endl;
-               }
-            } catch(const char* e) {
-               std::lock_guard<std::mutex> lock(hash_mtx);
-               if (v && !count) std::cerr << "Skipping " << file << ", " << e << std::endl;
-            }
-         }));
-      }
-      for (auto& f : hash_futures) f.wait();
-
-      // Now, for each group of files with the same hash, add them to cands
-      fset_t cands(ic,iw,max,BN,alg);
-      for (const auto& pair : hash_to_files) {
-         if (pair.second.size() < 2) continue; // skip unique hashes
-         for (const auto& file : pair.second) {
-            try {
-               cands.add(file);
-            } catch(const char*) { /* already reported */ }
-         }
+   std::cout.flush();
+   uawriter out(1, latency);
+   uaformat form(fmt, mhead.alg, mhead.count, sep, ph, quote);
+   std::string line;
+   form.header(line);
+   if (line.size()) out.commit(line);
+   std::unique_ptr<uaaction> action;
+   if (dedupe) action.reset(new uadedupe(scanner, dry));
+   else if (link) action.reset(new ualink(scanner, dry));
+   if (action) action->on_error([v](const std::string& file, const char* e) {
+      if (v) std::cerr << "Left alone " << file << ", " << e << std::endl;
+   });
+   std::unique_ptr<uamanifest::writer> mw;
+   try {
+      if (manifest.size()) mw.reset(new uamanifest::writer(manifest, mhead));
+   } catch(const char* e) {
+      std::cerr << manifest << ": " << e << std::endl;
+      return 1;
+   }
+   auto emit = [&](const uascan::group& g) {
+      line.clear();
+      form.record(g, line);
+      out.commit(line);
+      if (action) action->add(g);
+      if (mw) mw->add(g);
+   };
+   ua_error res = merge ? scanner.merge(manifests, emit) : scanner.run(emit);
+   if (action) {
+      uaaction::totals t = action->finish();
+      std::cerr << (dry ? "Would have " : "")
+                << (dedupe ? (dry ? "deduplicated " : "Deduplicated ")
+                           : (dry ? "linked " : "Linked "))
+                << t.files << " files in " << t.sets << " sets, " << t.bytes
+                << " bytes reclaimed, " << t.skipped << " skipped, "
+                << t.failed << " failed" << std::endl;
+   }
+
+   if (hb.joinable()) {
+      {
+         std::lock_guard<std::mutex> lock(hb_mtx);
+         over = true;
       }
+      hb_cv.notify_all();
+      hb.join();
+      __heartbeat(progress, scanner.status(), uastats::now() - start, true);
+   }
 
-      const res_t* resp = 0;
-      res_t fres;
-      if (stage) { // if -2
-         try {
-            fset_t::common(fres,cands.common(),ic,iw,0,BN);
-            resp = &fres;
-         } catch(const char* e) {
-            if (v && !count) std::cerr << e <<  std::endl;
-            continue;
-         }
-      } else resp = & cands.common();
+   if (!out.flush()) {
+      std::cerr << "Could not write results" << std::endl;
+      return 1;
+   }
+   try {
+      if (mw && res == ua_error::OK) mw->close();
+   } catch(const char* e) {
+      std::cerr << manifest << ": " << e << std::endl;
+      return 1;
+   }
+   if (res != ua_error::OK) {
+      std::cerr << scanner.message() << std::endl;
+      return 1;
+   }
 
-      fset_t::produce(*resp,std::cout,sep,ph,quote);
+   if (stats.size() && !uastats::write(stats, scanner.devices(), argv)) {
+      std::cerr << "Could not write statistics to " << stats << std::endl;
+      return 1;
+   }
+
+   if (trace.size() && !uatrace::write(trace)) {
+      std::cerr << "Could not write trace to " << trace << std::endl;
+      return 1;
    }
 
    return 0;
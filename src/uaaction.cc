@@ -0,0 +1,443 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code was developed for an EU.EDGE internal project and
+ * is made available according to the terms of this license.
+ *
+ * The Initial Developer of the Original Code is Istvan T. Hernadvolgyi,
+ * EU.EDGE LLC.
+ *
+ * Portions created by EU.EDGE LLC are Copyright (C) EU.EDGE LLC.
+ * All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+// ACTIONS ON SETS OF IDENTICAL FILES - IMPLEMENTATION
+//
+
+#include <uaaction.h>
+#include <uatrace.h>
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+
+extern "C" {
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <linux/fs.h>
+#endif
+}
+
+uaaction::uaaction(uascan& scanner, bool dry)
+:_dry(dry),_scanner(scanner),_stop(false) {
+   ::memset(&_totals, 0, sizeof(_totals));
+}
+
+uaaction::~uaaction() {
+   finish();
+}
+
+void uaaction::add(const uascan::group& g) {
+   if (g.files.size() < 2) return;
+   std::lock_guard<std::mutex> lock(_mtx);
+   if (_stop) return;
+   _queue.push_back(g);
+   if (!_thread.joinable()) _thread = std::thread(&uaaction::loop, this);
+   _cv.notify_one();
+}
+
+uaaction::totals uaaction::finish() {
+   {
+      std::lock_guard<std::mutex> lock(_mtx);
+      _stop = true;
+   }
+   _cv.notify_all();
+   if (_thread.joinable()) _thread.join();
+   std::lock_guard<std::mutex> lock(_mtx);
+   return _totals;
+}
+
+void uaaction::account(size_t sets, size_t files, size_t skipped,
+   size_t failed, unsigned long long bytes) {
+   std::lock_guard<std::mutex> lock(_mtx);
+   _totals.sets += sets;
+   _totals.files += files;
+   _totals.skipped += skipped;
+   _totals.failed += failed;
+   _totals.bytes += bytes;
+}
+
+void uaaction::error(const std::string& path, const char* msg) {
+   std::lock_guard<std::mutex> lock(_mtx);
+   if (_err) _err(path, msg);
+}
+
+void uaaction::loop() {
+   uatrace::name("action");
+   std::vector<uascan::group> batch;
+   for(;;) {
+      {
+         std::unique_lock<std::mutex> lock(_mtx);
+         _cv.wait(lock, [this]() { return _stop || !_queue.empty(); });
+         if (_queue.empty()) return;
+         batch.clear();
+         batch.swap(_queue);
+      }
+      run(batch);
+   }
+}
+
+void uaaction::each(const fvec_t& keys,
+   const std::function<void(const std::string&)>& job) {
+   _scanner.each(keys, job);
+}
+
+void uaaction::run(const std::vector<uascan::group>& sets) {
+   // one job per set, keyed by the path that is kept
+   fvec_t heads;
+   std::map<std::string,const uascan::group*> by_head;
+   for(const auto& g : sets) {
+      heads.push_back(g.files[0]);
+      by_head[g.files[0]] = &g;
+   }
+   each(heads, [this, &by_head](const std::string& head) {
+      const uascan::group& g = *by_head.at(head);
+      uatrace::span sp("action", "action", g.size, "files", g.files.size());
+      act(g);
+   });
+}
+
+#if defined(FIDEDUPERANGE)
+
+// destinations per ioctl and bytes per range
+static const size_t __dedupe_files = 64;
+static const uint64_t __dedupe_range = 16 << 20;
+
+// open a destination: writable if we may, the kernel accepts read-only
+// descriptors of files we own
+static int __open_dest(const std::string& path) {
+   int fd = ::open(path.c_str(), O_RDWR);
+   if (fd < 0 && (errno == EACCES || errno == EPERM || errno == EROFS))
+      fd = ::open(path.c_str(), O_RDONLY);
+   return fd;
+}
+
+void uadedupe::act(const uascan::group& g) {
+   size_t files = 0, skipped = 0, failed = 0;
+   unsigned long long bytes = 0;
+
+   int src = ::open(g.files[0].c_str(), O_RDONLY);
+   struct stat ssi;
+   if (src < 0 || ::fstat(src, &ssi)) {
+      error(g.files[0], ::strerror(errno));
+      if (src >= 0) ::close(src);
+      account(1, 0, 0, g.files.size() - 1, 0);
+      return;
+   }
+   uint64_t size = ssi.st_size;
+
+   // destinations still in play
+   struct dest {
+      const std::string* path;
+      int fd;
+      bool ok;
+   };
+   std::vector<dest> dests;
+   for(size_t i = 1; i < g.files.size(); ++i) {
+      const std::string& path = g.files[i];
+      int fd = __open_dest(path);
+      struct stat dsi;
+      if (fd < 0 || ::fstat(fd, &dsi)) {
+         error(path, ::strerror(errno));
+         ++failed;
+      } else if (dsi.st_dev != ssi.st_dev) {
+         error(path, "on another file system");
+         ++skipped;
+      } else if (dsi.st_ino == ssi.st_ino) {
+         ++skipped; // a hard link of the source, nothing to share
+      } else if ((uint64_t)dsi.st_size != size) {
+         error(path, "changed since the scan");
+         ++skipped;
+      } else {
+         dest d = { &path, fd, true };
+         dests.push_back(d);
+         continue;
+      }
+      if (fd >= 0) ::close(fd);
+   }
+
+   std::vector<char> raw(sizeof(struct file_dedupe_range) +
+      __dedupe_files * sizeof(struct file_dedupe_range_info));
+   struct file_dedupe_range* r =
+      reinterpret_cast<struct file_dedupe_range*>(raw.data());
+
+   // a dry run stops short of the ioctls
+   if (_dry) bytes = size * dests.size();
+   for(size_t b = 0; !_dry && b < dests.size(); b += __dedupe_files) {
+      size_t e = std::min(dests.size(), b + __dedupe_files);
+      for(uint64_t off = 0; off < size; off += __dedupe_range) {
+         uint64_t len = std::min(__dedupe_range, size - off);
+         ::memset(raw.data(), 0, raw.size());
+         r->src_offset = off;
+         r->src_length = len;
+         std::vector<size_t> idx;
+         for(size_t i = b; i < e; ++i) {
+            if (!dests[i].ok) continue;
+            struct file_dedupe_range_info& info = r->info[idx.size()];
+            info.dest_fd = dests[i].fd;
+            info.dest_offset = off;
+            idx.push_back(i);
+         }
+         if (idx.empty()) break;
+         r->dest_count = idx.size();
+
+         if (::ioctl(src, FIDEDUPERANGE, r)) {
+            const char* msg = ::strerror(errno);
+            for(size_t i : idx) {
+               error(*dests[i].path, msg);
+               dests[i].ok = false;
+               ++failed;
+            }
+            break;
+         }
+         for(size_t k = 0; k < idx.size(); ++k) {
+            const struct file_dedupe_range_info& info = r->info[k];
+            dest& d = dests[idx[k]];
+            if (info.status == FILE_DEDUPE_RANGE_DIFFERS) {
+               error(*d.path, "changed since the scan");
+               d.ok = false;
+               ++skipped;
+            } else if (info.status < 0) {
+               error(*d.path, ::strerror(-info.status));
+               d.ok = false;
+               ++failed;
+            } else bytes += info.bytes_deduped;
+         }
+      }
+   }
+
+   for(const auto& d : dests) {
+      if (d.ok && size) ++files;
+      else if (d.ok) ++skipped; // empty, nothing to share
+      ::close(d.fd);
+   }
+   ::close(src);
+   account(1, files, skipped, failed, bytes);
+}
+
+#else
+
+void uadedupe::act(const uascan::group& g) {
+   for(size_t i = 1; i < g.files.size(); ++i)
+      error(g.files[i], "Deduplication is not supported on this platform");
+   account(1, 0, 0, g.files.size() - 1, 0);
+}
+
+#endif
+
+// directory of a path name
+static std::string __dir(const std::string& path) {
+   size_t s = path.rfind('/');
+   if (s == std::string::npos) return ".";
+   return s ? path.substr(0, s) : "/";
+}
+
+// bytes compared at a time before linking
+static const size_t __cmp_block = 64 << 10;
+
+// read exactly n bytes at off, false on error or end of file
+static bool __pread(int fd, char* b, size_t n, off_t off) {
+   while(n) {
+      ssize_t r = ::pread(fd, b, n, off);
+      if (r < 0 && errno == EINTR) continue;
+      if (r <= 0) return false;
+      b += r;
+      n -= r;
+      off += r;
+   }
+   return true;
+}
+
+// 0 if the n bytes of a and b are the same, the reason otherwise
+static const char* __compare(int a, int b, off_t n) {
+   std::vector<char> ba(__cmp_block), bb(__cmp_block);
+   for(off_t off = 0; off < n; off += __cmp_block) {
+      size_t k = (size_t)std::min<off_t>(__cmp_block, n - off);
+      if (!__pread(a, ba.data(), k, off) || !__pread(b, bb.data(), k, off))
+         return errno ? ::strerror(errno) : "changed since the scan";
+      if (::memcmp(ba.data(), bb.data(), k)) return "changed since the scan";
+   }
+   return 0;
+}
+
+// same file, not written to since st was taken
+static bool __unchanged(const struct stat& a, const struct stat& b) {
+   return a.st_dev == b.st_dev && a.st_ino == b.st_ino &&
+      a.st_size == b.st_size &&
+      a.st_mtim.tv_sec == b.st_mtim.tv_sec &&
+      a.st_mtim.tv_nsec == b.st_mtim.tv_nsec &&
+      a.st_ctim.tv_sec == b.st_ctim.tv_sec &&
+      a.st_ctim.tv_nsec == b.st_ctim.tv_nsec;
+}
+
+// a file to replace by a link to the first file of its set
+struct __link {
+   const std::string* src;
+   const std::string* dest;
+   struct stat si; // of src
+};
+
+void ualink::run(const std::vector<uascan::group>& sets) {
+   std::map<std::string,std::vector<__link> > by_dir;
+   size_t failed = 0;
+   for(const auto& g : sets) {
+      __link l;
+      l.src = &g.files[0];
+      if (::stat(l.src->c_str(), &l.si)) {
+         error(*l.src, ::strerror(errno));
+         failed += g.files.size() - 1;
+         continue;
+      }
+      for(size_t i = 1; i < g.files.size(); ++i) {
+         l.dest = &g.files[i];
+         by_dir[__dir(*l.dest)].push_back(l);
+      }
+   }
+   account(sets.size(), 0, 0, failed, 0);
+
+   fvec_t dirs;
+   for(const auto& d : by_dir) dirs.push_back(d.first);
+   each(dirs, [this, &by_dir](const std::string& dir) {
+      const std::vector<__link>& links = by_dir.at(dir);
+      uatrace::span sp("link", "action", -1, "files", links.size());
+      size_t files = 0, skipped = 0, failed = 0;
+      unsigned long long bytes = 0;
+
+      int dfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+      if (dfd < 0) {
+         for(const auto& l : links) error(*l.dest, ::strerror(errno));
+         account(0, 0, 0, links.size(), 0);
+         return;
+      }
+
+      unsigned tmpn = 0;
+      for(const auto& l : links) {
+         const std::string& dest = *l.dest;
+         std::string base = dest.substr(dest.rfind('/') + 1);
+         struct stat dsi;
+         if (::fstatat(dfd, base.c_str(), &dsi, AT_SYMLINK_NOFOLLOW)) {
+            error(dest, ::strerror(errno));
+            ++failed;
+            continue;
+         }
+         if (!S_ISREG(dsi.st_mode)) {
+            error(dest, "not a regular file");
+            ++skipped;
+            continue;
+         }
+         if (dsi.st_dev != l.si.st_dev) {
+            error(dest, "on another file system");
+            ++skipped;
+            continue;
+         }
+         if (dsi.st_ino == l.si.st_ino) {
+            ++skipped; // already a link of the source
+            continue;
+         }
+         if (dsi.st_size != l.si.st_size) {
+            error(dest, "changed since the scan");
+            ++skipped;
+            continue;
+         }
+
+         if (!_dry) {
+            // unlike FIDEDUPERANGE, a link does not look at the bytes:
+            // compare them, and rename only if dest was not written since
+            int sfd = ::open(l.src->c_str(), O_RDONLY | O_CLOEXEC);
+            if (sfd < 0) {
+               error(dest, ::strerror(errno));
+               ++failed;
+               continue;
+            }
+            int ffd = ::openat(dfd, base.c_str(),
+               O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            if (ffd < 0) {
+               error(dest, ::strerror(errno));
+               ::close(sfd);
+               ++failed;
+               continue;
+            }
+            errno = 0;
+            struct stat before;
+            const char* e = ::fstat(ffd, &before) ? ::strerror(errno) :
+               !__unchanged(before, dsi) ? "changed since the scan" :
+               __compare(sfd, ffd, dsi.st_size);
+            ::close(ffd);
+            ::close(sfd);
+            if (e) {
+               error(dest, e);
+               ++skipped;
+               continue;
+            }
+
+            // link under a fresh temporary name, then rename over dest
+            std::string tmp;
+            int rc;
+            do {
+               tmp = ".ua-link." + std::to_string(::getpid()) + "." +
+                  std::to_string(tmpn++);
+               rc = ::linkat(AT_FDCWD, l.src->c_str(), dfd, tmp.c_str(), 0);
+            } while(rc && errno == EEXIST);
+            if (rc) {
+               error(dest, ::strerror(errno));
+               ++failed;
+               continue;
+            }
+            struct stat now;
+            if (::fstatat(dfd, base.c_str(), &now, AT_SYMLINK_NOFOLLOW) ||
+                !__unchanged(now, before)) {
+               error(dest, "changed since the scan");
+               ::unlinkat(dfd, tmp.c_str(), 0);
+               ++skipped;
+               continue;
+            }
+            if (::renameat(dfd, tmp.c_str(), dfd, base.c_str())) {
+               error(dest, ::strerror(errno));
+               ::unlinkat(dfd, tmp.c_str(), 0);
+               ++failed;
+               continue;
+            }
+         }
+         ++files;
+         if (dsi.st_nlink == 1) bytes += dsi.st_size;
+      }
+      ::close(dfd);
+      account(0, files, skipped, failed, bytes);
+   });
+}
+
+void ualink::act(const uascan::group&) {
+   // sets are handled a directory at a time by run
+}
@@ -0,0 +1,202 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code was developed for an EU.EDGE internal project and
+ * is made available according to the terms of this license.
+ *
+ * The Initial Developer of the Original Code is Istvan T. Hernadvolgyi,
+ * EU.EDGE LLC.
+ *
+ * Portions created by EU.EDGE LLC are Copyright (C) EU.EDGE LLC.
+ * All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+// ACTIONS ON SETS OF IDENTICAL FILES - HEADER
+//
+
+#if !defined(_UAACTION_H_)
+#define _UAACTION_H_
+
+#include <uascan.h>
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/** Action taken on the sets of identical files found by a scan.
+ *
+ * Sets are handed over (add) from the group callback of uascan::run as
+ * they are found, and acted on right away, while their pages are still
+ * in the cache: a background thread collects the sets that arrived and
+ * runs act on each of them on the worker pool of the scanner
+ * (uascan::each), so actions on files of different sets proceed in
+ * parallel within the device queue depths of the scan.
+ *
+ * The first path of a set is kept; act does something to the others.
+ * In a dry run nothing is changed, the totals tell what would have been
+ * done. finish must be called once all sets have been added.
+ */
+class uaaction {
+
+   public:
+
+      /** What the action did. */
+      struct totals {
+         size_t sets;               // sets acted on
+         size_t files;              // files deduplicated or replaced
+         size_t skipped;            // files left alone
+         size_t failed;             // files the action failed on
+         unsigned long long bytes;  // bytes reclaimed
+      };
+
+      /** Constructor.
+       * @param scanner the scanner whose worker pool runs the action
+       * @param dry only report what would be done
+       */
+      uaaction(uascan& scanner, bool dry = false);
+
+      /** Destructor. Derived classes call finish in theirs, so that act
+       * is not called on a half destroyed object.
+       */
+      virtual ~uaaction();
+
+      /** Set the callback for files the action failed on or skipped. */
+      void on_error(const uascan::error_fn& f) { _err = f; }
+
+      /** Queue a set (copied), returns immediately.
+       * @param g the set
+       */
+      void add(const uascan::group& g);
+
+      /** Wait for the action on all sets added to finish.
+       * Sets added afterwards are ignored.
+       * @return the totals
+       */
+      totals finish();
+
+   protected:
+
+      bool _dry;
+
+      /** Act on the sets that arrived since the last call.
+       * Called on the background thread; by default runs act for every
+       * set on the worker pool.
+       * @param sets the sets
+       */
+      virtual void run(const std::vector<uascan::group>& sets);
+
+      /** Call a job for every key on the worker pool (uascan::each). */
+      void each(const fvec_t& keys,
+         const std::function<void(const std::string&)>& job);
+
+      /** Act on a set. Called on a worker, concurrently for different sets.
+       * @param g the set, at least two files
+       */
+      virtual void act(const uascan::group& g) = 0;
+
+      /** Account what was done (thread-safe). */
+      void account(size_t sets, size_t files, size_t skipped, size_t failed,
+         unsigned long long bytes);
+
+      /** Report a file failed on or skipped (thread-safe). */
+      void error(const std::string& path, const char* msg);
+
+   private:
+
+      uascan& _scanner;
+      uascan::error_fn _err;
+
+      std::mutex _mtx;          // guards everything below
+      std::condition_variable _cv;
+      std::vector<uascan::group> _queue;
+      bool _stop;
+      totals _totals;
+      std::thread _thread;
+
+      uaaction(const uaaction&);
+      uaaction& operator=(const uaaction&);
+
+      // background thread
+      void loop();
+};
+
+/** Deduplication of identical files with FIDEDUPERANGE.
+ *
+ * The extents of each file of a set are shared with the first file of
+ * the set (reflink), which file systems such as btrfs and XFS support.
+ * The kernel compares the bytes before sharing them, so a file changed
+ * since the scan is left alone. Up to 64 files are deduplicated by one
+ * ioctl, in ranges of 16MB. Files that are hard links of the first file
+ * or live on another file system are skipped.
+ */
+class uadedupe : public uaaction {
+
+   public:
+
+      /** Constructor.
+       * @param scanner the scanner whose worker pool runs the action
+       * @param dry only count the bytes that could be shared
+       */
+      uadedupe(uascan& scanner, bool dry = false) : uaaction(scanner, dry) { }
+
+      ~uadedupe() { finish(); }
+
+   protected:
+
+      void act(const uascan::group& g);
+};
+
+/** Replacement of identical files by hard links.
+ *
+ * Every file of a set is replaced by a hard link to the first file of
+ * the set. The link is made under a temporary name in the directory of
+ * the file and renamed over it (renameat), so the path always names
+ * either the old file or the new link. A file is replaced only if its
+ * bytes are still those of the first file and it was not written to
+ * between the comparison and the rename. The files are batched by
+ * directory: each directory is worked on by one worker at a time, with
+ * one descriptor, instead of workers contending for its lock. Files
+ * that are already links of the first file, are not regular files or
+ * live on another file system are skipped. Bytes count as reclaimed
+ * when the replaced file had no other links.
+ */
+class ualink : public uaaction {
+
+   public:
+
+      /** Constructor.
+       * @param scanner the scanner whose worker pool runs the action
+       * @param dry only count what would be replaced
+       */
+      ualink(uascan& scanner, bool dry = false) : uaaction(scanner, dry) { }
+
+      ~ualink() { finish(); }
+
+   protected:
+
+      void run(const std::vector<uascan::group>& sets);
+      void act(const uascan::group& g);
+};
+
+#endif
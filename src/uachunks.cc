@@ -0,0 +1,281 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code was developed for an EU.EDGE internal project and
+ * is made available according to the terms of this license.
+ *
+ * The Initial Developer of the Original Code is Istvan T. Hernadvolgyi,
+ * EU.EDGE LLC.
+ *
+ * Portions created by EU.EDGE LLC are Copyright (C) EU.EDGE LLC.
+ * All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+// CONTENT DEFINED CHUNKING ANALYSIS - IMPLEMENTATION
+//
+
+#include <uachunks.h>
+#include <uatrace.h>
+
+#include <algorithm>
+#include <cstring>
+
+extern "C" {
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "blake3.h"
+#define XXH_STATIC_LINKING_ONLY
+#include "xxhash.h"
+}
+
+// bytes read at a time
+static const size_t __read = 1 << 20;
+
+// chunks in more files than this do not count for the pairs
+static const uint32_t __max_owners = 64;
+
+// gear table: 256 random 64 bit values (splitmix64)
+struct __gear_t {
+   uint64_t v[256];
+   __gear_t() {
+      uint64_t x = 0x7561636875e6b5ULL;
+      for(int i = 0; i < 256; ++i) {
+         uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+         z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+         z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+         v[i] = z ^ (z >> 31);
+      }
+   }
+};
+static const __gear_t __gear;
+
+// mask of the top n bits
+static uint64_t __top(int n) {
+   return ~0ULL << (64 - n);
+}
+
+uachunks::uachunks(uascan& scanner, size_t avg):_scanner(scanner) {
+   int bits = 8;
+   while(bits < 24 && ((size_t)1 << bits) < avg) ++bits;
+   _avg = (size_t)1 << bits;
+   _min = _avg / 4;
+   _max = _avg * 8;
+   _mask_s = __top(bits + 2);
+   _mask_l = __top(bits - 2);
+   ::memset(&_tot, 0, sizeof(_tot));
+}
+
+size_t uachunks::cut(const uint8_t* p, size_t n) const {
+   if (n <= _min) return n;
+   size_t normal = std::min(n, _avg), end = std::min(n, _max);
+   const uint64_t* g = __gear.v;
+   uint64_t h = 0;
+   size_t i = _min;
+   for(; i < normal; ++i) {
+      h = (h << 1) + g[p[i]];
+      if (!(h & _mask_s)) return i + 1;
+   }
+   for(; i < end; ++i) {
+      h = (h << 1) + g[p[i]];
+      if (!(h & _mask_l)) return i + 1;
+   }
+   return end;
+}
+
+// chunk one file and enter its chunks in the index
+void uachunks::read(size_t f) {
+   const std::string& path = _paths[f];
+   uatrace::span sp("chunk", "chunks");
+   uastats::scope sc(uastats::HASH);
+
+   int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+   ++filei::tio().opens;
+   if (fd < 0) {
+      if (_err) _err(path, ::strerror(errno));
+      return;
+   }
+#if defined(POSIX_FADV_SEQUENTIAL)
+   ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+   static thread_local std::vector<uint8_t> buf;
+   buf.resize(_max + __read);
+   bool b3 = _scanner.config().alg == filei_hash_alg::BLAKE3;
+   std::vector<print> prints;
+   std::vector<uint32_t> sizes;
+   uint64_t size = 0;
+   size_t have = 0;
+   bool eof = false;
+   for(;;) {
+      while(!eof && have < _max) {
+         ssize_t n = ::read(fd, &buf[have], buf.size() - have);
+         if (n < 0 && errno == EINTR) continue;
+         if (n < 0) {
+            if (_err) _err(path, ::strerror(errno));
+            ::close(fd);
+            return;
+         }
+         ++filei::tio().reads;
+         filei::tio().bytes += n;
+         eof = !n;
+         have += n;
+      }
+      if (!have) break;
+
+      size_t off = 0;
+      while(off < have && (eof || have - off >= _max)) {
+         size_t len = cut(&buf[off], have - off);
+         print pr;
+         if (b3) {
+            blake3_hasher h;
+            blake3_hasher_init(&h);
+            blake3_hasher_update(&h, &buf[off], len);
+            blake3_hasher_finalize(&h, reinterpret_cast<uint8_t*>(&pr), sizeof(pr));
+         } else {
+            XXH128_hash_t x = XXH3_128bits(&buf[off], len);
+            pr.lo = x.low64;
+            pr.hi = x.high64;
+         }
+         prints.push_back(pr);
+         sizes.push_back(len);
+         off += len;
+      }
+      size += off;
+      ::memmove(&buf[0], &buf[off], have - off);
+      have -= off;
+   }
+   ::close(fd);
+
+   std::lock_guard<std::mutex> lock(_mtx);
+   std::vector<uint32_t>& ids = _fchunks[f];
+   ids.reserve(prints.size());
+   for(size_t i = 0; i < prints.size(); ++i) {
+      auto r = _ids.insert(std::make_pair(prints[i], (uint32_t)_csize.size()));
+      uint32_t id = r.first->second;
+      if (r.second) {
+         _csize.push_back(sizes[i]);
+         _refs.push_back(0);
+         _nfiles.push_back(0);
+         _last.push_back(0);
+      }
+      ++_refs[id];
+      if (_last[id] != (uint32_t)f + 1) {
+         _last[id] = f + 1;
+         ++_nfiles[id];
+      }
+      ids.push_back(id);
+   }
+   _files[f].size = size;
+   _files[f].chunks = prints.size();
+   _ok[f] = true;
+}
+
+// per file figures, totals and the pairs
+void uachunks::tally() {
+   uatrace::span sp("tally", "chunks");
+   for(size_t f = 0; f < _files.size(); ++f) {
+      if (!_ok[f]) continue;
+      for(uint32_t id : _fchunks[f])
+         if (_refs[id] > 1) _files[f].shared += _csize[id];
+      ++_tot.files;
+      _tot.bytes += _files[f].size;
+      _tot.chunks += _files[f].chunks;
+   }
+   _tot.unique_chunks = _csize.size();
+   for(uint32_t s : _csize) _tot.unique_bytes += s;
+
+   // files of each chunk shared by a few, in CSR form
+   std::vector<uint32_t> start(_csize.size() + 1, 0);
+   for(size_t id = 0; id < _csize.size(); ++id) {
+      uint32_t n = _nfiles[id];
+      start[id + 1] = start[id] + (n > 1 && n <= __max_owners ? n : 0);
+      _last[id] = 0;
+   }
+   std::vector<uint32_t> owners(start.back());
+   std::vector<uint32_t> fill(start.begin(), start.end() - 1);
+   for(size_t f = 0; f < _files.size(); ++f) {
+      for(uint32_t id : _fchunks[f]) {
+         if (start[id] == start[id + 1] || _last[id] == (uint32_t)f + 1) continue;
+         _last[id] = f + 1;
+         owners[fill[id]++] = f;
+      }
+      std::vector<uint32_t>().swap(_fchunks[f]);
+   }
+
+   std::unordered_map<uint64_t,uint64_t> shared;
+   for(size_t id = 0; id < _csize.size(); ++id)
+      for(uint32_t i = start[id]; i < start[id + 1]; ++i)
+         for(uint32_t j = i + 1; j < start[id + 1]; ++j)
+            shared[(uint64_t)owners[i] << 32 | owners[j]] += _csize[id];
+   for(const auto& s : shared) {
+      pair p = { (size_t)(s.first >> 32), (size_t)(s.first & 0xffffffff), s.second };
+      _pairs.push_back(p);
+   }
+   std::sort(_pairs.begin(), _pairs.end(), [](const pair& x, const pair& y) {
+      return x.bytes != y.bytes ? x.bytes > y.bytes :
+         x.a != y.a ? x.a < y.a : x.b < y.b;
+   });
+}
+
+ua_error uachunks::run() {
+   // a path given twice is read once
+   std::unordered_map<std::string,size_t> where;
+   fvec_t paths;
+   for(const auto& p : _paths)
+      if (where.insert(std::make_pair(p, paths.size())).second)
+         paths.push_back(p);
+   _paths.swap(paths);
+
+   _files.resize(_paths.size());
+   for(size_t f = 0; f < _paths.size(); ++f) {
+      _files[f].path = _paths[f];
+      _files[f].size = _files[f].chunks = _files[f].shared = 0;
+   }
+   _fchunks.resize(_paths.size());
+   _ok.assign(_paths.size(), false);
+
+   const std::unordered_map<std::string,size_t>& at = where;
+   ua_error res = _scanner.each(_paths, [this, &at](const std::string& path) {
+      read(at.find(path)->second);
+   });
+   if (res != ua_error::OK) return res;
+
+   tally();
+   // drop what could not be read, keeping the pairs' indices right
+   std::vector<size_t> to(_files.size());
+   size_t n = 0;
+   for(size_t f = 0; f < _files.size(); ++f) {
+      to[f] = n;
+      if (_ok[f]) _files[n++] = _files[f];
+   }
+   _files.resize(n);
+   for(auto& p : _pairs) {
+      p.a = to[p.a];
+      p.b = to[p.b];
+   }
+   return ua_error::OK;
+}
+
+std::vector<uachunks::pair> uachunks::pairs(size_t n) const {
+   return std::vector<pair>(_pairs.begin(),
+      _pairs.begin() + std::min(n, _pairs.size()));
+}
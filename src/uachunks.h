@@ -0,0 +1,175 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code was developed for an EU.EDGE internal project and
+ * is made available according to the terms of this license.
+ *
+ * The Initial Developer of the Original Code is Istvan T. Hernadvolgyi,
+ * EU.EDGE LLC.
+ *
+ * Portions created by EU.EDGE LLC are Copyright (C) EU.EDGE LLC.
+ * All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+// CONTENT DEFINED CHUNKING ANALYSIS - HEADER
+//
+
+#if !defined(_UACHUNKS_H_)
+#define _UACHUNKS_H_
+
+#include <uascan.h>
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+extern "C" {
+#include <stdint.h>
+}
+
+/** Analysis of the redundancy below the file level.
+ *
+ * Files are cut into chunks at content defined boundaries (FastCDC: a
+ * gear hash rolled over the bytes, normalized chunking with a stricter
+ * mask before the average size and a looser one after it, and no cut
+ * before a quarter or after eight times the average), so an insertion
+ * only moves the boundaries next to it. Each chunk is fingerprinted
+ * with XXH3-128 (the first 16 bytes of BLAKE3 when the scanner uses
+ * b3) and entered in an index of distinct chunks.
+ *
+ * The files are read sequentially with large reads on the worker pool
+ * of the scanner, so several files stream at once within the device
+ * queue depths. The result tells for every file how many of its bytes
+ * are in chunks that occur more than once, the totals (all bytes
+ * against the bytes of the distinct chunks), and the pairs of files
+ * that share the most bytes. Chunks found in very many files (runs of
+ * zeros and the like) count for the totals but not for the pairs.
+ */
+class uachunks {
+
+   public:
+
+      /** What was found in a file. */
+      struct file {
+         std::string path;
+         uint64_t size;
+         uint64_t chunks;
+         uint64_t shared;  // bytes in chunks that occur more than once
+      };
+
+      /** Two files and the bytes of the distinct chunks they share. */
+      struct pair {
+         size_t a;         // index in files()
+         size_t b;
+         uint64_t bytes;
+      };
+
+      /** Totals. */
+      struct totals {
+         uint64_t files;
+         uint64_t bytes;
+         uint64_t chunks;
+         uint64_t unique_chunks;
+         uint64_t unique_bytes;
+      };
+
+      /** Constructor.
+       * @param scanner options (algorithm) and worker pool
+       * @param avg average chunk size, rounded to a power of two
+       *        between 256 bytes and 16 MB
+       */
+      uachunks(uascan& scanner, size_t avg = 8192);
+
+      /** Set the error callback (files that could not be read). */
+      void on_error(const uascan::error_fn& f) { _err = f; }
+
+      /** Add a file. */
+      void add(const std::string& path) { _paths.push_back(path); }
+
+      /** Chunk the files added.
+       * @return OK, or NO_MEMORY
+       */
+      ua_error run();
+
+      /** The files read, in the order they were added. */
+      const std::vector<file>& files() const { return _files; }
+
+      /** Totals of the files read. */
+      const totals& total() const { return _tot; }
+
+      /** The pairs of files that share the most bytes.
+       * @param n at most these many
+       * @return the pairs, most bytes first
+       */
+      std::vector<pair> pairs(size_t n) const;
+
+      /** Find the end of the chunk that starts at p.
+       * @param p data
+       * @param n bytes available (to the end of the file, or at least
+       *        the maximum chunk size)
+       * @return the chunk length
+       */
+      size_t cut(const uint8_t* p, size_t n) const;
+
+   private:
+
+      // fingerprint of a chunk
+      struct print {
+         uint64_t lo;
+         uint64_t hi;
+         bool operator==(const print& o) const { return lo == o.lo && hi == o.hi; }
+      };
+
+      struct print_hash {
+         size_t operator()(const print& p) const { return p.lo; }
+      };
+
+      uascan& _scanner;
+      uascan::error_fn _err;
+      size_t _avg;
+      size_t _min;
+      size_t _max;
+      uint64_t _mask_s;  // before the average size
+      uint64_t _mask_l;  // after it
+      fvec_t _paths;
+
+      std::mutex _mtx; // guards the index while files are read
+      std::unordered_map<print,uint32_t,print_hash> _ids;
+      std::vector<uint32_t> _csize;   // per chunk id
+      std::vector<uint32_t> _refs;    // occurrences
+      std::vector<uint32_t> _nfiles;  // files it occurs in
+      std::vector<uint32_t> _last;    // last file it was seen in, + 1
+      std::vector<std::vector<uint32_t> > _fchunks; // chunk ids per file
+      std::vector<bool> _ok;
+
+      std::vector<file> _files;
+      totals _tot;
+      std::vector<pair> _pairs;
+
+      uachunks(const uachunks&);
+      uachunks& operator=(const uachunks&);
+
+      void read(size_t i);
+      void tally();
+};
+
+#endif
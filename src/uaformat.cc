@@ -0,0 +1,289 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code was developed for an EU.EDGE internal project and
+ * is made available according to the terms of this license.
+ *
+ * The Initial Developer of the Original Code is Istvan T. Hernadvolgyi,
+ * EU.EDGE LLC.
+ *
+ * Portions created by EU.EDGE LLC are Copyright (C) EU.EDGE LLC.
+ * All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+// RESULT FORMATS - IMPLEMENTATION
+//
+
+#include <uaformat.h>
+
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+const char uaformat::BIN_MAGIC[8] = { 'U', 'A', 'S', 'E', 'T', 'S', 0, 1 };
+
+static const char __hex[] = "0123456789abcdef";
+
+// what a byte becomes in a JSON string: 0 as is, 'u' as \u00XX,
+// anything else as a backslash and that character
+struct __jtable {
+   char esc[256];
+   __jtable() {
+      for(int c = 0; c < 256; ++c) esc[c] = c < 0x20 ? 'u' : 0;
+      esc[(unsigned char)'"'] = '"';
+      esc[(unsigned char)'\\'] = '\\';
+      esc[(unsigned char)'\b'] = 'b';
+      esc[(unsigned char)'\f'] = 'f';
+      esc[(unsigned char)'\n'] = 'n';
+      esc[(unsigned char)'\r'] = 'r';
+      esc[(unsigned char)'\t'] = 't';
+   }
+};
+
+static const __jtable __json;
+
+// characters that make a CSV field quoted
+static bool __csvc(unsigned char c) {
+   return c == '"' || c == ',' || c == '\n' || c == '\r';
+}
+
+// number of leading bytes that a JSON string takes as they are
+static size_t __jplain(const char* p, size_t n) {
+   size_t i = 0;
+#if defined(__SSE2__)
+   const __m128i quote = _mm_set1_epi8('"');
+   const __m128i bslash = _mm_set1_epi8('\\');
+   const __m128i ctl = _mm_set1_epi8(0x1f);
+   for(; i + 16 <= n; i += 16) {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+      __m128i m = _mm_or_si128(
+         _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)),
+         _mm_cmpeq_epi8(_mm_max_epu8(v, ctl), ctl)); // v <= 0x1f
+      int bits = _mm_movemask_epi8(m);
+      if (bits) return i + __builtin_ctz(bits);
+   }
+#endif
+   for(; i < n; ++i) if (__json.esc[(unsigned char)p[i]]) break;
+   return i;
+}
+
+// number of leading bytes before one that makes a CSV field quoted
+static size_t __cplain(const char* p, size_t n) {
+   size_t i = 0;
+#if defined(__SSE2__)
+   const __m128i quote = _mm_set1_epi8('"');
+   const __m128i comma = _mm_set1_epi8(',');
+   const __m128i nl = _mm_set1_epi8('\n');
+   const __m128i cr = _mm_set1_epi8('\r');
+   for(; i + 16 <= n; i += 16) {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+      __m128i m = _mm_or_si128(
+         _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, comma)),
+         _mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, cr)));
+      int bits = _mm_movemask_epi8(m);
+      if (bits) return i + __builtin_ctz(bits);
+   }
+#endif
+   for(; i < n; ++i) if (__csvc(p[i])) break;
+   return i;
+}
+
+// append a JSON string
+static void __jstr(std::string& out, const std::string& s) {
+   const char* p = s.data();
+   size_t n = s.size();
+   out += '"';
+   for(;;) {
+      size_t k = __jplain(p, n);
+      out.append(p, k);
+      if (k == n) break;
+      unsigned char c = p[k];
+      char e = __json.esc[c];
+      out += '\\';
+      out += e;
+      if (e == 'u') {
+         out += "00";
+         out += __hex[c >> 4];
+         out += __hex[c & 0x0f];
+      }
+      p += k + 1;
+      n -= k + 1;
+   }
+   out += '"';
+}
+
+// append a CSV field
+static void __cfield(std::string& out, const std::string& s) {
+   const char* p = s.data();
+   size_t n = s.size();
+   if (__cplain(p, n) == n) {
+      out.append(p, n);
+      return;
+   }
+   out += '"';
+   for(const char* q; (q = static_cast<const char*>(::memchr(p, '"', n)));) {
+      out.append(p, q + 1 - p);
+      out += '"';
+      n -= q + 1 - p;
+      p = q + 1;
+   }
+   out.append(p, n);
+   out += '"';
+}
+
+// append an unsigned number
+static void __num(std::string& out, uint64_t v) {
+   char b[24];
+   char* e = b + sizeof(b);
+   char* p = e;
+   do { *--p = '0' + v % 10; v /= 10; } while(v);
+   out.append(p, e - p);
+}
+
+static void __hexs(std::string& out, const std::string& d) {
+   for(size_t i = 0; i < d.size(); ++i) {
+      unsigned char c = d[i];
+      out += __hex[c >> 4];
+      out += __hex[c & 0x0f];
+   }
+}
+
+bool uaformat::parse(const std::string& name, kind& k) {
+   if (name == "text") k = TEXT;
+   else if (name == "jsonl") k = JSONL;
+   else if (name == "csv") k = CSV;
+   else if (name == "bin") k = BIN;
+   else return false;
+   return true;
+}
+
+const char* uaformat::alg_name(filei_hash_alg alg) {
+   switch(alg) {
+      case filei_hash_alg::MD5: return "md5";
+      case filei_hash_alg::SHA1: return "sha1";
+      case filei_hash_alg::SHA256: return "sha256";
+      case filei_hash_alg::BLAKE3: return "b3";
+      case filei_hash_alg::XXHASH64: return "xxh64";
+   }
+   return "";
+}
+
+uaformat::uaformat(kind k, filei_hash_alg alg, bool sized,
+   const std::string& sep, bool ph, bool quote)
+:_kind(k),_alg(alg),_sized(sized),_sep(sep),_ph(ph),_quote(quote),_id(0) {
+}
+
+void uaformat::header(std::string& out) const {
+   if (_kind == CSV) out += "id,size,alg,digest,path\r\n";
+   else if (_kind == BIN) out.append(BIN_MAGIC, sizeof(BIN_MAGIC));
+}
+
+void uaformat::record(const uascan::group& g, std::string& out,
+   const char* event) {
+   ++_id;
+   switch(_kind) {
+      case TEXT: text(g, out); break;
+      case JSONL: jsonl(g, out, event); break;
+      case CSV: csv(g, out); break;
+      case BIN: bin(g, out); break;
+   }
+}
+
+void uaformat::text(const uascan::group& g, std::string& out) const {
+   if (_ph) { // print hash
+      __hexs(out, g.digest);
+      out += _sep;
+   }
+   for(size_t i = 0; i < g.files.size(); ++i) {
+      if (i) out += _sep;
+      if (_quote) out += '\'';
+      out += g.files[i];
+      if (_quote) out += '\'';
+   }
+   out += '\n';
+}
+
+void uaformat::jsonl(const uascan::group& g, std::string& out,
+   const char* event) const {
+   out += '{';
+   if (event) {
+      out += "\"event\": \"";
+      out += event;
+      out += "\", ";
+   }
+   out += "\"id\": ";
+   __num(out, _id);
+   out += ", \"size\": ";
+   if (_sized) __num(out, g.size);
+   else out += "null";
+   out += ", \"alg\": \"";
+   out += alg_name(_alg);
+   out += "\", \"digest\": ";
+   if (g.digest.size()) {
+      out += '"';
+      __hexs(out, g.digest);
+      out += '"';
+   } else out += "null";
+   out += ", \"paths\": [";
+   for(size_t i = 0; i < g.files.size(); ++i) {
+      if (i) out += ", ";
+      __jstr(out, g.files[i]);
+   }
+   out += "]}\n";
+}
+
+void uaformat::csv(const uascan::group& g, std::string& out) const {
+   for(size_t i = 0; i < g.files.size(); ++i) {
+      __num(out, _id);
+      out += ',';
+      if (_sized) __num(out, g.size);
+      out += ',';
+      out += alg_name(_alg);
+      out += ',';
+      __hexs(out, g.digest);
+      out += ',';
+      __cfield(out, g.files[i]);
+      out += "\r\n";
+   }
+}
+
+void uaformat::bin(const uascan::group& g, std::string& out) const {
+   size_t start = out.size();
+   bin_record r;
+   ::memset(&r, 0, sizeof(r));
+   r.paths = g.files.size();
+   r.id = _id;
+   r.size = _sized ? (uint64_t)g.size : UINT64_MAX;
+   r.alg = (uint8_t)_alg;
+   r.digest_len = g.digest.size();
+   out.append(reinterpret_cast<const char*>(&r), sizeof(r));
+   out += g.digest;
+   for(size_t i = 0; i < g.files.size(); ++i) {
+      uint32_t n = g.files[i].size();
+      out.append(reinterpret_cast<const char*>(&n), sizeof(n));
+      out += g.files[i];
+   }
+   out.append((8 - (out.size() - start) % 8) % 8, '\0');
+   uint32_t length = out.size() - start;
+   ::memcpy(&out[start], &length, sizeof(length));
+}
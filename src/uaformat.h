@@ -0,0 +1,152 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code was developed for an EU.EDGE internal project and
+ * is made available according to the terms of this license.
+ *
+ * The Initial Developer of the Original Code is Istvan T. Hernadvolgyi,
+ * EU.EDGE LLC.
+ *
+ * Portions created by EU.EDGE LLC are Copyright (C) EU.EDGE LLC.
+ * All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+// RESULT FORMATS - HEADER
+//
+
+#if !defined(_UAFORMAT_H_)
+#define _UAFORMAT_H_
+
+#include <uascan.h>
+
+#include <string>
+
+extern "C" {
+#include <stdint.h>
+}
+
+/** Formatter of identical sets.
+ *
+ * Turns each set reported by uascan into a record of one of the output
+ * formats. Records are appended to a caller supplied string, which can
+ * be reused: once it has grown to the largest record, formatting does
+ * not allocate. Sets are numbered from 1 in the order they are
+ * formatted. The formats are
+ * <pre>
+ *    text   the paths separated by sep, optionally quoted and preceded
+ *           by the hex digest (ua's classic output, see -s, -q, -p)
+ *    jsonl  one JSON object per line:
+ *           {"id": 1, "size": 42, "alg": "md5", "digest": "..",
+ *            "paths": ["a", "b"]}
+ *           size is null with -n or -w, digest is null when the set was
+ *           confirmed by comparing the bytes rather than by hashing.
+ *           Paths are escaped, bytes above 0x7f are passed on as they
+ *           are (file names that are not UTF-8 stay so)
+ *    csv    RFC 4180 with a header line, one row per path:
+ *           id,size,alg,digest,path
+ *    bin    length prefixed records for readers that mmap the output,
+ *           see bin_record
+ * </pre>
+ * Escaping looks for the characters that need it 16 bytes at a time
+ * (SSE2 where available) and handles them through a table.
+ */
+class uaformat {
+
+   public:
+
+      /** Output formats. */
+      enum kind { TEXT, JSONL, CSV, BIN };
+
+      /** Magic at the start of a bin stream ("UASETS" 0 version). */
+      static const char BIN_MAGIC[8];
+
+      /** Header of a bin record.
+       *
+       * A bin stream is BIN_MAGIC followed by records. Every record
+       * starts at an offset that is a multiple of 8 with this header
+       * (host byte order, little endian on x86), followed by digest_len
+       * digest bytes and, for each path, a uint32_t length and the
+       * bytes of the path, and zero padding up to length.
+       */
+      struct bin_record {
+         uint32_t length;     // bytes of the record, header and padding included
+         uint32_t paths;      // number of paths
+         uint64_t id;         // set number
+         uint64_t size;       // byte count, UINT64_MAX if unknown
+         uint8_t alg;         // filei_hash_alg
+         uint8_t digest_len;  // 0 if no digest
+         uint16_t reserved;
+         uint32_t reserved2;
+      };
+
+      /** Parse the name of a format.
+       * @param name text, jsonl, csv or bin
+       * @param k the format (returned)
+       * @return false if unknown
+       */
+      static bool parse(const std::string& name, kind& k);
+
+      /** Name of a hash algorithm as given to -a. */
+      static const char* alg_name(filei_hash_alg alg);
+
+      /** Constructor.
+       * @param k format
+       * @param alg hash algorithm of the scan
+       * @param sized whether sets carry their byte count
+       * @param sep separator (text)
+       * @param ph print the digest (text)
+       * @param quote quote paths with single quotes (text)
+       */
+      uaformat(kind k, filei_hash_alg alg, bool sized,
+         const std::string& sep = " ", bool ph = false, bool quote = false);
+
+      /** Append what goes before the first record (may be nothing).
+       * @param out output
+       */
+      void header(std::string& out) const;
+
+      /** Append the record of a set.
+       * @param g the set
+       * @param out output
+       * @param event what happened to the set (jsonl only: an "event"
+       *        field leads the record), 0 for none
+       */
+      void record(const uascan::group& g, std::string& out,
+         const char* event = 0);
+
+   private:
+
+      kind _kind;
+      filei_hash_alg _alg;
+      bool _sized;
+      std::string _sep;
+      bool _ph;
+      bool _quote;
+      uint64_t _id;
+
+      void text(const uascan::group& g, std::string& out) const;
+      void jsonl(const uascan::group& g, std::string& out,
+         const char* event) const;
+      void csv(const uascan::group& g, std::string& out) const;
+      void bin(const uascan::group& g, std::string& out) const;
+};
+
+#endif
@@ -0,0 +1,220 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code was developed for an EU.EDGE internal project and
+ * is made available according to the terms of this license.
+ *
+ * The Initial Developer of the Original Code is Istvan T. Hernadvolgyi,
+ * EU.EDGE LLC.
+ *
+ * Portions created by EU.EDGE LLC are Copyright (C) EU.EDGE LLC.
+ * All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+// SCAN MANIFESTS - IMPLEMENTATION
+//
+
+#include <uamanifest.h>
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <set>
+
+static const char __magic[8] = { 'U', 'A', 'M', 'A', 'N', 'I', 'F', 1 };
+
+// on disk header
+struct __mhead {
+   char magic[8];
+   uint8_t alg;
+   uint8_t flags;
+   uint16_t zero;
+   uint32_t shard;
+   uint32_t shards;
+   uint32_t zero2;
+   uint64_t max;
+};
+
+bool uamanifest::header::compatible(const header& o) const {
+   return alg == o.alg && ic == o.ic && iw == o.iw && count == o.count &&
+      max == o.max;
+}
+
+bool uamanifest::record::operator<(const record& o) const {
+   if (size != o.size) return size < o.size;
+   int c = digest.compare(o.digest);
+   if (c) return c < 0;
+   return path < o.path;
+}
+
+uamanifest::header uamanifest::of(const uascan::options& o) {
+   header h;
+   h.alg = o.alg;
+   h.ic = o.ic;
+   h.iw = o.iw;
+   h.count = o.count;
+   h.shard = o.shard;
+   h.shards = o.shards;
+   h.max = o.max;
+   return h;
+}
+
+uamanifest::writer::writer(const std::string& file, const header& h)
+:_file(file),_h(h),_fp(0) {
+   // fail now rather than after the scan
+   if (!(_fp = ::fopen(file.c_str(), "wb"))) throw "Could not create manifest";
+}
+
+uamanifest::writer::~writer() {
+   if (_fp) ::fclose(_fp);
+}
+
+void uamanifest::writer::add(const uascan::group& g) {
+   if (g.digest.empty()) throw "Set without digest";
+   for(const auto& f : g.files) {
+      record r;
+      r.size = g.size;
+      r.digest = g.digest;
+      r.path = f;
+      _recs.push_back(r);
+   }
+}
+
+void uamanifest::writer::close() {
+   std::sort(_recs.begin(), _recs.end());
+
+   __mhead mh;
+   ::memset(&mh, 0, sizeof(mh));
+   ::memcpy(mh.magic, __magic, sizeof(__magic));
+   mh.alg = (uint8_t)_h.alg;
+   mh.flags = (_h.ic ? 1 : 0) | (_h.iw ? 2 : 0) | (_h.count ? 4 : 0);
+   mh.shard = _h.shard;
+   mh.shards = _h.shards;
+   mh.max = _h.max;
+   bool ok = ::fwrite(&mh, sizeof(mh), 1, _fp) == 1;
+
+   for(size_t i = 0; ok && i < _recs.size(); ++i) {
+      const record& r = _recs[i];
+      uint8_t dl = r.digest.size();
+      uint32_t pl = r.path.size();
+      ok = ::fwrite(&r.size, sizeof(r.size), 1, _fp) == 1 &&
+         ::fwrite(&dl, sizeof(dl), 1, _fp) == 1 &&
+         (!dl || ::fwrite(r.digest.data(), dl, 1, _fp) == 1) &&
+         ::fwrite(&pl, sizeof(pl), 1, _fp) == 1 &&
+         (!pl || ::fwrite(r.path.data(), pl, 1, _fp) == 1);
+   }
+   std::vector<record>().swap(_recs);
+
+   ok = ::fclose(_fp) == 0 && ok;
+   _fp = 0;
+   if (!ok) throw "Could not write manifest";
+}
+
+uamanifest::reader::reader(const std::string& file)
+:_file(file),_fp(0) {
+   if (!(_fp = ::fopen(file.c_str(), "rb"))) throw "Could not open manifest";
+   __mhead mh;
+   if (::fread(&mh, sizeof(mh), 1, _fp) != 1 ||
+       ::memcmp(mh.magic, __magic, sizeof(__magic))) {
+      ::fclose(_fp);
+      throw "Not a manifest";
+   }
+   _h.alg = (filei_hash_alg)mh.alg;
+   _h.ic = mh.flags & 1;
+   _h.iw = mh.flags & 2;
+   _h.count = mh.flags & 4;
+   _h.shard = mh.shard;
+   _h.shards = mh.shards;
+   _h.max = mh.max;
+}
+
+uamanifest::reader::~reader() {
+   ::fclose(_fp);
+}
+
+bool uamanifest::reader::next(record& r) {
+   uint8_t dl;
+   uint32_t pl;
+   if (::fread(&r.size, sizeof(r.size), 1, _fp) != 1) {
+      if (::ferror(_fp)) throw "Could not read manifest";
+      return false;
+   }
+   bool ok = ::fread(&dl, sizeof(dl), 1, _fp) == 1;
+   if (ok) {
+      r.digest.resize(dl);
+      ok = !dl || ::fread(&r.digest[0], dl, 1, _fp) == 1;
+   }
+   ok = ok && ::fread(&pl, sizeof(pl), 1, _fp) == 1;
+   if (ok) {
+      r.path.resize(pl);
+      ok = !pl || ::fread(&r.path[0], pl, 1, _fp) == 1;
+   }
+   if (!ok) throw "Truncated manifest";
+   return true;
+}
+
+void uamanifest::merge(const std::vector<std::string>& files,
+   const uascan::group_fn& f) {
+   std::vector<std::unique_ptr<reader> > rs;
+   std::map<uint32_t,std::set<uint32_t> > shards; // shards present by count
+   for(const auto& file : files) {
+      rs.push_back(std::unique_ptr<reader>(new reader(file)));
+      const header& h = rs.back()->head();
+      if (!h.compatible(rs[0]->head()))
+         throw "Manifests of scans with different options";
+      shards[h.shards].insert(h.shard);
+   }
+   // a sharded scan is complete when every shard is there, unless
+   // some manifest is of a whole scan
+   if (!shards.count(1))
+      for(const auto& s : shards)
+         if (s.second.size() < s.first)
+            throw "Manifests do not cover every shard";
+
+   // the next record of every manifest, min-heap by record
+   std::vector<record> heads(rs.size());
+   std::vector<size_t> heap;
+   auto later = [&heads](size_t a, size_t b) { return heads[b] < heads[a]; };
+   for(size_t i = 0; i < rs.size(); ++i)
+      if (rs[i]->next(heads[i])) heap.push_back(i);
+   std::make_heap(heap.begin(), heap.end(), later);
+
+   uascan::group g;
+   while(heap.size()) {
+      const record& top = heads[heap.front()];
+      g.size = top.size;
+      g.digest = top.digest;
+      g.files.clear();
+      while(heap.size()) {
+         size_t i = heap.front();
+         record& r = heads[i];
+         if (r.size != (uint64_t)g.size || r.digest != g.digest) break;
+         // the same path from several manifests comes in a row
+         if (g.files.empty() || g.files.back() != r.path)
+            g.files.push_back(r.path);
+         std::pop_heap(heap.begin(), heap.end(), later);
+         if (rs[i]->next(r)) std::push_heap(heap.begin(), heap.end(), later);
+         else heap.pop_back();
+      }
+      if (g.files.size() > 1) f(g);
+   }
+}
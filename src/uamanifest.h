@@ -0,0 +1,157 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code was developed for an EU.EDGE internal project and
+ * is made available according to the terms of this license.
+ *
+ * The Initial Developer of the Original Code is Istvan T. Hernadvolgyi,
+ * EU.EDGE LLC.
+ *
+ * Portions created by EU.EDGE LLC are Copyright (C) EU.EDGE LLC.
+ * All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+// SCAN MANIFESTS - HEADER
+//
+
+#if !defined(_UAMANIFEST_H_)
+#define _UAMANIFEST_H_
+
+#include <uascan.h>
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <stdint.h>
+}
+
+/** Manifests of scans, for scans split across processes or hosts.
+ *
+ * A manifest lists the files of the sets of identical files a scan
+ * found, one record (size, digest, path) per file, sorted by size,
+ * digest and path, after a header with the options that determine
+ * what identical means. Sharded scans (uascan::options::shard) of the
+ * same tree each write theirs; merging the manifests (a k-way merge,
+ * one sequential pass over each, holding one set at a time) gives the
+ * sets of the whole tree without reading any file. Records with the
+ * same size and digest in different manifests end up in the same set,
+ * so manifests of overlapping scans merge as well; a path listed by
+ * several manifests is reported once.
+ *
+ * All numbers are in host byte order:
+ * <pre>
+ *    header  "UAMANIF" 1, uint8 alg, uint8 flags (1 ic, 2 iw, 4 count),
+ *            uint16 0, uint32 shard, uint32 shards, uint64 max
+ *    record  uint64 size, uint8 digest length, digest,
+ *            uint32 path length, path
+ * </pre>
+ * Errors are thrown as const char*.
+ */
+class uamanifest {
+
+   public:
+
+      /** Header of a manifest. */
+      struct header {
+         filei_hash_alg alg;
+         bool ic;
+         bool iw;
+         bool count;
+         uint32_t shard;
+         uint32_t shards;
+         uint64_t max;
+
+         /** Whether manifests with these headers can be merged. */
+         bool compatible(const header& o) const;
+      };
+
+      /** A file of a manifest. */
+      struct record {
+         uint64_t size;
+         std::string digest;
+         std::string path;
+
+         bool operator<(const record& o) const;
+      };
+
+      /** Header describing scans with the given options. */
+      static header of(const uascan::options& o);
+
+      /** Writer of a manifest.
+       * Collects the records, which are sorted and written by close.
+       */
+      class writer {
+         public:
+            /** Constructor.
+             * @param file file name
+             * @param h the header
+             */
+            writer(const std::string& file, const header& h);
+            ~writer();
+
+            /** Add the files of a set; the digest must be known. */
+            void add(const uascan::group& g);
+
+            /** Sort and write the records and close the file. */
+            void close();
+
+         private:
+            std::string _file;
+            header _h;
+            std::vector<record> _recs;
+            FILE* _fp;
+      };
+
+      /** Reader of a manifest. */
+      class reader {
+         public:
+            /** Constructor. Reads the header.
+             * @param file file name
+             */
+            reader(const std::string& file);
+            ~reader();
+
+            /** The header. */
+            const header& head() const { return _h; }
+
+            /** Read the next record.
+             * @param r the record (returned)
+             * @return false at the end
+             */
+            bool next(record& r);
+
+         private:
+            std::string _file;
+            header _h;
+            FILE* _fp;
+      };
+
+      /** Merge manifests into sets of identical files.
+       * @param files the manifests
+       * @param f called with every set, sets come by size
+       */
+      static void merge(const std::vector<std::string>& files,
+         const uascan::group_fn& f);
+};
+
+#endif
@@ -0,0 +1,1250 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code was developed for an EU.EDGE internal project and
+ * is made available according to the terms of this license.
+ *
+ * The Initial Developer of the Original Code is Istvan T. Hernadvolgyi,
+ * EU.EDGE LLC.
+ *
+ * Portions created by EU.EDGE LLC are Copyright (C) EU.EDGE LLC.
+ * All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+// SCANNER FOR SETS OF IDENTICAL FILES - IMPLEMENTATION
+//
+
+#include <uascan.h>
+#include <iosched.h>
+#include <uamanifest.h>
+#include <uaspill.h>
+#include <uastatx.h>
+#include <uatrace.h>
+#include <uawatch.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <map>
+#include <new>
+#include <sstream>
+#include <thread>
+#include <tuple>
+
+extern "C" {
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#define XXH_STATIC_LINKING_ONLY
+#include "xxhash.h"
+}
+
+// files up to this size are read once and compared in memory
+static const size_t __small_file = 64 << 10;
+
+// memory for the contents of one slice of small files
+static const size_t __small_arena = 32 << 20;
+
+// stats in flight in the stat phase
+static const unsigned __stat_depth = 256;
+
+// paths stat'ed at a time in the stat phase
+static const size_t __stat_batch = 65536;
+
+// what filei::fsize would throw for a stat result, 0 if it is fine
+static const char* __stat_error(const uastatx::result& r) {
+   if (r.err) return "Could not stat file.";
+   if (!S_ISREG(r.mode) && !S_ISLNK(r.mode)) return "Not a file.";
+   return 0;
+}
+
+struct uascan::known {
+   uawatch::index_t files;
+};
+
+// concatenate anything printable
+static void __cat(std::ostringstream&) { }
+
+template<typename T, typename... R>
+static void __cat(std::ostringstream& os, const T& a, const R&... r) {
+   os << a;
+   __cat(os, r...);
+}
+
+template<typename... T>
+static std::string __str(const T&... a) {
+   std::ostringstream os;
+   __cat(os, a...);
+   return os.str();
+}
+
+// Runtime statistics that drive the milestone schedule.
+//
+// Milestone chunks come in levels of 1KB * 4^i. For each level we count
+// how many candidates were tested and how many were eliminated, and
+// from the per-file job times we estimate the fixed cost of touching a
+// file (open, first read) and the device throughput. Together these
+// give the per-file overhead in bytes, so the cost of a stage and the
+// expected saving of an elimination can be compared in one unit.
+class milestone_stats {
+   public:
+      static const int levels = 10; // 1KB ... 256MB
+
+      static size_t chunk(int i) { return (size_t)1024 << (2 * i); }
+
+      milestone_stats(): _a(1e-4), _r(200e6) {
+         for(int i = 0; i < levels; ++i) _tested[i] = _elim[i] = 0;
+      }
+
+      // record the outcome of one stage
+      void record(int i, size_t tested, size_t left, double secs) {
+         std::lock_guard<std::mutex> lock(_mtx);
+         _tested[i] += tested;
+         _elim[i] += tested - left;
+         if (!tested) return;
+         double t = secs / tested; // seconds per file
+         if (chunk(i) <= 4096) _a = 0.8 * _a + 0.2 * t;
+         else if (chunk(i) >= 1048576 && t > 1.5 * _a)
+            _r = 0.8 * _r + 0.2 * (chunk(i) / (t - _a));
+      }
+
+      // choose the next level after last (-1: none yet),
+      // return -1 if full hashing is cheaper than any further milestone
+      int next(size_t fsize, int last, bool stalled) const {
+         std::lock_guard<std::mutex> lock(_mtx);
+         double over = _a * _r; // per file overhead in bytes
+         int best = -1;
+         double ratio = 1.0;
+         // a stage that eliminated nothing is merged into a larger one
+         for(int i = last + (stalled ? 2 : 1); i < levels; ++i) {
+            size_t c = chunk(i);
+            // beyond half the file, reading all of it is just as good
+            if (2 * c > fsize) break;
+            // expected bytes saved per candidate over bytes spent on it
+            double p = (_elim[i] + 1.0) / (_tested[i] + 2.0);
+            double r = p * (fsize - c) / (c + over);
+            if (r > ratio) { best = i; ratio = r; }
+         }
+         return best;
+      }
+
+   private:
+      mutable std::mutex _mtx;
+      double _tested[levels];
+      double _elim[levels];
+      double _a; // seconds to touch a file
+      double _r; // bytes per second
+};
+
+uascan::options::options()
+:alg(filei_hash_alg::MD5),ic(false),iw(false),count(true),max(0),
+ stage(false),milestones(true),digests(false),bsize(1024),
+ threads(std::max(1u, std::thread::hardware_concurrency())),
+ physical(false),sample("4096:tail,0.25,0.5,0.75"),spill_run(1 << 20),
+ shard(0),shards(1),cross(false),verbose(false) {
+}
+
+uascan::uascan()
+:_msg(""),_npaths(0),_stated(0),_ngroups(0),_done(0),_sets(0),_setfiles(0),
+ _mstats(new milestone_stats()) {
+   parse_sample_plan(_opt.sample, _plan);
+   // the worker pool (run, each) hashes concurrently, so each
+   // calculation needs its own work buffer instead of the shared one
+   filei::_gbuff = &::malloc;
+   filei::_relbuff = &::free;
+   filei::_buffc = 0;
+}
+
+uascan::~uascan() {
+}
+
+ua_error uascan::fail(ua_error e, const char* msg) {
+   _msg = msg;
+   return e;
+}
+
+// parse [<bs>:]<pos>[,<pos>]... where pos is tail, a fraction (0.5),
+// a percentage (50%), an offset (65536) or an offset from the end (-65536)
+bool uascan::parse_sample_plan(const std::string& spec, sample_plan& plan) {
+   plan.bs = 4096;
+   plan.pos.clear();
+   if (spec == "none") return true;
+
+   std::string list = spec;
+   size_t colon = spec.find(':');
+   if (colon != std::string::npos) {
+      plan.bs = ::atol(spec.substr(0, colon).c_str());
+      if (!plan.bs) return false;
+      list = spec.substr(colon + 1);
+   }
+
+   for(size_t b = 0;;) {
+      size_t e = list.find(',', b);
+      std::string tok = list.substr(b, e == std::string::npos ? e : e - b);
+      char* end = 0;
+      if (tok == "tail") plan.pos.push_back(std::make_pair(1.0, -(long long)plan.bs));
+      else if (tok.find('.') != std::string::npos) {
+         double f = ::strtod(tok.c_str(), &end);
+         if (*end || f < 0 || f > 1) return false;
+         plan.pos.push_back(std::make_pair(f, 0LL));
+      } else {
+         long long n = ::strtoll(tok.c_str(), &end, 10);
+         if (end == tok.c_str()) return false;
+         if (*end == '%' && !end[1] && n >= 0 && n <= 100)
+            plan.pos.push_back(std::make_pair(n / 100.0, 0LL));
+         else if (*end) return false;
+         else plan.pos.push_back(std::make_pair(n < 0 ? 1.0 : 0.0, n));
+      }
+      if (e == std::string::npos) break;
+      b = e + 1;
+   }
+   return true;
+}
+
+ua_error uascan::configure(const options& o) {
+   options n = o;
+   sample_plan plan;
+
+   if (!n.bsize) return fail(ua_error::INVALID_OPTION, "Invalid buffer size");
+   if (n.threads <= 0) return fail(ua_error::INVALID_OPTION, "Invalid thread count");
+   if (n.stage && !n.max)
+      return fail(ua_error::INVALID_OPTION, "The two stage algorithm requires -m set!");
+   if (!parse_sample_plan(n.sample, plan))
+      return fail(ua_error::INVALID_OPTION, "Invalid sample plan");
+   if (!n.spill_run) return fail(ua_error::INVALID_OPTION, "Invalid spill run size");
+   if (!n.shards || n.shard >= n.shards)
+      return fail(ua_error::INVALID_OPTION, "Invalid shard");
+
+   // the byte count is irrelevant when white space is ignored, and
+   // without -2 only the first max bytes count
+   if (n.count && n.iw) n.count = false;
+   if (n.count && n.max && !n.stage) n.count = false;
+   if (n.shards > 1 && !n.count)
+      return fail(ua_error::INVALID_OPTION, "Sharding needs the byte counts (not -n, -w, or -m without -2)");
+   if (n.index.size() && !n.count)
+      return fail(ua_error::INVALID_OPTION, "The index needs the byte counts (not -n, -w, or -m without -2)");
+
+   std::unique_ptr<known> k;
+   if (n.index.size() && (n.index != _opt.index || n.alg != _opt.alg ||
+       n.ic != _opt.ic || !_known)) {
+      k.reset(new known());
+      if (!uawatch::read(n.index, n, k->files))
+         return fail(ua_error::IO, "Could not read the index (or it was made with another -a or -i)");
+   }
+
+   if (n.threads != _opt.threads || n.physical != _opt.physical ||
+       n.depths != _opt.depths || n.verbose != _opt.verbose)
+      _sched.reset();
+   if (n.spill != _opt.spill) _spill.reset();
+   if (k || n.index.empty()) _known.swap(k);
+
+   _opt = n;
+   _plan = plan;
+
+   // check the depths now rather than at the first run
+   try {
+      sched();
+   } catch(const char* e) {
+      return fail(ua_error::INVALID_OPTION, e);
+   } catch(const std::bad_alloc&) {
+      return fail(ua_error::NO_MEMORY, "Could not allocate memory");
+   }
+   return ua_error::OK;
+}
+
+iosched& uascan::sched() {
+   if (!_sched) {
+      std::unique_ptr<iosched> s(new iosched(_opt.threads, _opt.physical, _opt.verbose));
+      if (_opt.depths.size() && !s->depths(_opt.depths))
+         throw "Invalid device queue depths";
+      _sched = std::move(s);
+   }
+   return *_sched;
+}
+
+size_t uascan::size() const {
+   return _spill ? _spill->size() : _paths.size();
+}
+
+ua_error uascan::each(const fvec_t& paths,
+   const std::function<void(const std::string&)>& job) {
+   try {
+      sched().run(paths, job);
+   } catch(...) {
+      return fail(ua_error::NO_MEMORY, "Could not allocate memory");
+   }
+   return ua_error::OK;
+}
+
+ua_error uascan::add(const std::string& path) {
+   return add(path, false);
+}
+
+ua_error uascan::add(const std::string& path, bool right) {
+   try {
+      if (_opt.spill.size()) {
+         if (!_spill) _spill.reset(new uaspill(_opt.spill));
+         _spill->add(path, right);
+      } else {
+         _paths.push_back(path);
+         if (_opt.cross) _sides.push_back(right);
+      }
+   } catch(const char* e) {
+      return fail(ua_error::IO, e);
+   } catch(...) {
+      return fail(ua_error::NO_MEMORY, "Could not allocate memory");
+   }
+   return ua_error::OK;
+}
+
+std::vector<uastats::device> uascan::devices() {
+   return _sched ? _sched->devices() : std::vector<uastats::device>();
+}
+
+uascan::progress uascan::status() {
+   progress p;
+   p.paths = _npaths;
+   p.stated = _stated;
+   p.groups = _ngroups;
+   p.done = _done;
+   p.sets = _sets;
+   p.files = _setfiles;
+   p.bytes = 0;
+   for(const auto& d : devices()) p.bytes += d.bytes;
+   return p;
+}
+
+void uascan::clear() {
+   fvec_t().swap(_paths);
+   std::vector<char>().swap(_sides);
+   _spill.reset();
+   std::vector<group>().swap(_groups);
+}
+
+void uascan::say(const std::string& msg) {
+   if (!_opt.verbose || !_log) return;
+   std::lock_guard<std::mutex> lock(_out_mtx);
+   _log(msg);
+}
+
+void uascan::skip(const std::string& path, const char* msg) {
+   if (!_err) return;
+   std::lock_guard<std::mutex> lock(_out_mtx);
+   _err(path, msg);
+}
+
+void uascan::emit(group& g, aliases_t* aliases) {
+   if (aliases) {
+      for(size_t i = 0, n = g.files.size(); i < n; ++i) {
+         aliases_t::iterator a = aliases->find(g.files[i]);
+         if (a == aliases->end()) continue;
+         g.files.insert(g.files.end(), a->second.begin(), a->second.end());
+         aliases->erase(a);
+      }
+   }
+   std::unique_lock<std::mutex> lock(_out_mtx, std::defer_lock);
+   {
+      uatrace::span sw("output wait", "output", g.size);
+      lock.lock();
+   }
+   uastats::scope sc(uastats::OUTPUT);
+   uatrace::span so("output", "output", g.size, "files", g.files.size());
+   ++_sets;
+   _setfiles += g.files.size();
+   if (_out) _out(g);
+   else {
+      _groups.push_back(group());
+      _groups.back().size = g.size;
+      _groups.back().digest.swap(g.digest);
+      _groups.back().files.swap(g.files);
+   }
+}
+
+// Stat a batch of files and sort them by size
+void uascan::stat_batch(const fvec_t& files, size_t b, size_t e, uastatx& sx,
+   fsetc_t& by_size, sidesc_t& sides, metac_t& metas) {
+   uastats::scope sc(uastats::STAT);
+   uatrace::span sp("stat", "stat", -1, "files", e - b);
+   iosched& s = sched();
+   std::vector<uastatx::result> st;
+   if (_opt.count) sx.run(files, b, e, st);
+   for (size_t i = b; i < e; ++i, ++_stated) {
+      const std::string& file = files[i];
+      size_t n = 0;
+      if (_opt.count) {
+         const uastatx::result& r = st[i - b];
+         if (const char* err = __stat_error(r)) {
+            skip(file, err);
+            continue;
+         }
+         n = r.size;
+         if (_opt.shards > 1 && shard_of(n, _opt.shards) != _opt.shard) continue;
+         s.note(file, r.dev, r.ino);
+         meta m = { r.dev, r.ino, r.mtime, r.ctime };
+         metas[n].push_back(m);
+      }
+
+      by_size[n].push_back(file);
+      if (_opt.cross) sides[n].push_back(_sides[i]);
+      if (_opt.verbose) say(__str(_opt.count ? "Counting " : "Spooling ", file));
+   }
+}
+
+// Adaptive milestone chunk comparison
+//
+// Runs prefix stages while the statistics say they pay off. Stops as
+// soon as fewer than two candidates remain, or exactly two remain and
+// the caller can compare them in lockstep.
+bool uascan::both(const fvec_t& files, const sides_t* sides) {
+   if (!sides) return true;
+   char seen = 0;
+   for(const auto& f : files) {
+      seen |= sides->at(f);
+      if (seen == 3) return true;
+   }
+   return false;
+}
+
+fvec_t uascan::milestones(const fvec_t& candidates, size_t file_size,
+   bool lockstep, const sides_t* sides) {
+   if (candidates.size() < 2) return candidates;
+
+   fvec_t remaining = candidates;
+   milestone_stats& stats = *_mstats;
+   const bool ic = _opt.ic, iw = _opt.iw;
+
+   bool stalled = false;
+   for (int level = stats.next(file_size, -1, false); level >= 0;
+        level = stats.next(file_size, level, stalled)) {
+      if (remaining.size() < 2 || (lockstep && remaining.size() == 2)) break;
+
+      size_t chunk_size = milestone_stats::chunk(level);
+
+      say(__str("Comparing ", remaining.size(), " candidates with ",
+         chunk_size, " byte chunks"));
+
+      // Group files by their chunk hash
+      std::mutex chunk_mtx;
+      std::map<std::string, fvec_t> chunk_groups;
+      double secs = 0;
+
+      uatrace::span round("milestone round", "round", file_size, "chunk", chunk_size);
+      double t0 = uastats::now();
+      sched().run(remaining, [&](const std::string& file) {
+         uastats::scope sc(uastats::MILESTONE, level);
+         uatrace::span sp("milestone", "filei", file_size, "chunk", chunk_size);
+         std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+         try {
+            // a fast xxHash of the chunk only
+            filei fi(file, ic, iw, chunk_size, 1024, filei_hash_alg::XXHASH64);
+            std::string chunk_hash(reinterpret_cast<const char*>(fi.hash()), fi.hash_len());
+
+            std::lock_guard<std::mutex> lock(chunk_mtx);
+            chunk_groups[chunk_hash].push_back(file);
+            secs += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+         } catch(const char* e) {
+            skip(file, e);
+         }
+      });
+
+      // Update remaining candidates to only those with matching chunk hashes
+      size_t tested = remaining.size();
+      remaining.clear();
+      for (const auto& pair : chunk_groups) {
+         if (pair.second.size() >= 2 && both(pair.second, sides)) {
+            remaining.insert(remaining.end(), pair.second.begin(), pair.second.end());
+         }
+      }
+      stats.record(level, tested, remaining.size(), secs);
+      uastats::wall(uastats::MILESTONE, uastats::now() - t0, level);
+      uastats::files(uastats::MILESTONE, tested, remaining.size(), level);
+      stalled = remaining.size() == tested;
+
+      if (remaining.size() < tested)
+         say(__str("Eliminated ", tested - remaining.size(), " candidates with ",
+            chunk_size, " byte comparison"));
+   }
+
+   return remaining;
+}
+
+// Sampling pre-filter
+//
+// Hashes a few small blocks of every candidate (see sample_plan) and keeps
+// the files whose samples match at least one other. Runs before the
+// prefix milestones, so files that differ only near the end or in the
+// middle are eliminated at a few KB of I/O.
+fvec_t uascan::sample(const fvec_t& candidates, size_t file_size,
+   const sides_t* sides) {
+   std::vector<off_t> offs;
+   for (const auto& p : _plan.pos) {
+      long long o = (long long)(p.first * file_size) + p.second;
+      o = std::max(0LL, std::min(o, (long long)file_size - (long long)_plan.bs));
+      offs.push_back(o);
+   }
+   std::sort(offs.begin(), offs.end());
+   offs.erase(std::unique(offs.begin(), offs.end()), offs.end());
+
+   std::mutex sample_mtx;
+   std::map<unsigned long long, fvec_t> sample_groups;
+   double t0 = uastats::now();
+   sched().run(candidates, [&](const std::string& file) {
+      uastats::scope sc(uastats::SAMPLE);
+      uatrace::span sp("sample", "filei", file_size);
+      try {
+         unsigned long long h = filei::sample(file, offs, _plan.bs, _opt.ic);
+         std::lock_guard<std::mutex> lock(sample_mtx);
+         sample_groups[h].push_back(file);
+      } catch(const char* e) {
+         skip(file, e);
+      }
+   });
+
+   fvec_t remaining;
+   for (const auto& pair : sample_groups) {
+      if (pair.second.size() >= 2 && both(pair.second, sides)) {
+         remaining.insert(remaining.end(), pair.second.begin(), pair.second.end());
+      }
+   }
+   uastats::wall(uastats::SAMPLE, uastats::now() - t0);
+   uastats::files(uastats::SAMPLE, candidates.size(), remaining.size());
+
+   if (remaining.size() < candidates.size())
+      say(__str("Eliminated ", candidates.size() - remaining.size(),
+         " candidates with ", offs.size(), " samples of ", _plan.bs, " bytes"));
+
+   return remaining;
+}
+
+// compare two files in lockstep and report them if identical
+void uascan::pair(const std::string& f1, const std::string& f2, size_t size,
+   aliases_t* aliases) {
+   bool same = false;
+   fvec_t first(1, f1);
+   double t0 = uastats::now();
+   sched().run(first, [&](const std::string&) {
+      uastats::scope sc(uastats::COMPARE);
+      uatrace::span sp("compare", "filei", size);
+      try {
+         same = filei::eq(f1, f2, _opt.ic, _opt.iw, 0, _opt.bsize, _opt.alg);
+      } catch(const char* e) {
+         skip(f1, e);
+      }
+   });
+   uastats::wall(uastats::COMPARE, uastats::now() - t0);
+   uastats::files(uastats::COMPARE, 2, same ? 2 : 0);
+   if (!same) return;
+
+   group g;
+   g.size = size;
+   g.files.push_back(f1);
+   g.files.push_back(f2);
+   emit(g, aliases);
+}
+
+// Small files
+//
+// Every file is read once, with preads of its size, into an arena
+// that lives as long as the group. Files are grouped
+// on the XXH3-128 of their bytes, confirmed by memcmp, so the sampling
+// pre-filter and the milestones are skipped and only the first file of
+// a set is hashed with -a, when the digest is printed. A size group too
+// large for the arena is done in slices, whose sets are joined on their
+// digests.
+void uascan::small_of(size_t size, const fvec_t& all, const sides_t* sides,
+   aliases_t* aliases) {
+   uatrace::span sp("small", "group", size, "files", all.size());
+   const bool ic = _opt.ic, ph = _opt.digests;
+   const filei_hash_alg alg = _opt.alg;
+   // one more byte tells that the file grew since it was stat'ed
+   const size_t slot = size + 1;
+   const size_t per = std::max((size_t)1, __small_arena / slot);
+   const bool join = all.size() > per;
+   const int len = hasher::len(alg);
+
+   std::vector<unsigned char> arena(std::min(all.size(), per) * slot);
+   std::vector<ssize_t> got;
+   std::vector<XXH128_hash_t> keys;
+   std::map<std::string, fvec_t> joined; // digest -> files, when sliced
+   size_t matched = 0;
+   double t0 = uastats::now();
+   for(size_t b = 0; b < all.size(); b += per) {
+      fvec_t batch(all.begin() + b, all.begin() + std::min(all.size(), b + per));
+      unsigned char* base = arena.data();
+      got.assign(batch.size(), -1);
+      keys.resize(batch.size());
+
+      sched().run(batch, [&](const std::string& file) {
+         uastats::scope sc(uastats::HASH);
+         uatrace::span sp("read", "filei", size);
+         size_t i = &file - &batch[0];
+         int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+         ++filei::tio().opens;
+         if (fd < 0) {
+            skip(file, "Could not open file");
+            return;
+         }
+         unsigned char* p = base + i * slot;
+         size_t n = 0;
+         for(;;) {
+            ssize_t r = ::pread(fd, p + n, slot - n, n);
+            if (r < 0 && errno == EINTR) continue;
+            if (r < 0) {
+               skip(file, "Could not read file");
+               ::close(fd);
+               return;
+            }
+            ++filei::tio().reads;
+            filei::tio().bytes += r;
+            n += r;
+            if (!r || n == slot) break;
+         }
+         ::close(fd);
+         if (n != size) {
+            skip(file, "File changed while reading");
+            return;
+         }
+         if (ic) filei_kernels::lower_case(reinterpret_cast<char*>(p), size);
+         keys[i] = XXH3_128bits(p, size);
+         got[i] = n;
+      });
+
+      // sets of the slice, head first; equal keys are confirmed by memcmp
+      std::map<std::pair<XXH64_hash_t,XXH64_hash_t>, std::vector<size_t> > heads;
+      std::vector<fvec_t> sets;
+      std::vector<const unsigned char*> data;
+      for(size_t i = 0; i < batch.size(); ++i) {
+         if (got[i] < 0) continue;
+         const unsigned char* p = base + i * slot;
+         std::vector<size_t>& hs = heads[std::make_pair(keys[i].low64, keys[i].high64)];
+         size_t k = 0;
+         while(k < hs.size() && ::memcmp(data[hs[k]], p, size)) ++k;
+         if (k < hs.size()) sets[hs[k]].push_back(batch[i]);
+         else {
+            hs.push_back(sets.size());
+            sets.push_back(fvec_t(1, batch[i]));
+            data.push_back(p);
+         }
+      }
+
+      // digests of the heads that need one
+      std::vector<size_t> need;
+      for(size_t k = 0; k < sets.size(); ++k)
+         if (join || (ph && sets[k].size() > 1)) need.push_back(k);
+      std::vector<const unsigned char*> in;
+      for(size_t k : need) in.push_back(data[k]);
+      std::vector<size_t> lens(need.size(), size);
+      std::vector<unsigned char> digests(need.size() * len);
+      parallel(need.size(), [&](size_t s, size_t e) {
+         uastats::scope sc(uastats::HASH);
+         uatrace::span sp("hash many", "filei", size, "files", e - s);
+         hasher::many(alg, &in[s], &lens[s], e - s, &digests[s * len]);
+      });
+
+      size_t d = 0;
+      for(size_t k = 0; k < sets.size(); ++k) {
+         std::string digest;
+         if (d < need.size() && need[d] == k)
+            digest.assign(reinterpret_cast<const char*>(&digests[d++ * len]), len);
+         if (join) {
+            fvec_t& j = joined[digest];
+            j.insert(j.end(), sets[k].begin(), sets[k].end());
+            continue;
+         }
+         if (sets[k].size() < 2 || !both(sets[k], sides)) continue;
+         matched += sets[k].size();
+         group g;
+         g.size = size;
+         g.digest.swap(digest);
+         g.files.swap(sets[k]);
+         emit(g, aliases);
+      }
+   }
+
+   for(auto& j : joined) {
+      if (j.second.size() < 2 || !both(j.second, sides)) continue;
+      matched += j.second.size();
+      group g;
+      g.size = size;
+      if (ph) g.digest = j.first;
+      g.files.swap(j.second);
+      emit(g, aliases);
+   }
+
+   uastats::wall(uastats::HASH, uastats::now() - t0);
+   uastats::files(uastats::HASH, all.size(), matched);
+}
+
+// Metadata pass of a size group
+//
+// Empty files are identical and not opened. Of the names of one file
+// (device and inode) only one is read, the others join its set. Files
+// the index has a digest for, that did not change since (size, mtime,
+// ctime, device and inode), are grouped on it, and the other files are hashed
+// in full to join them. The rest goes through group_of.
+void uascan::resolve(size_t size, const fvec_t& all, const sides_t* sides,
+   const std::vector<meta>* metas) {
+   if (!metas) {
+      group_of(size, all, sides);
+      return;
+   }
+   const bool ph = _opt.digests;
+   const int len = hasher::len(_opt.alg);
+   unsigned char d[FILEI_SHA256_LEN];
+
+   if (!size) {
+      if (!both(all, sides)) return;
+      group g;
+      g.size = 0;
+      g.files = all;
+      if (ph) {
+         hasher h(_opt.alg);
+         h.final(d);
+         g.digest.assign(reinterpret_cast<const char*>(d), len);
+      }
+      emit(g);
+      return;
+   }
+
+   // one name of each file; names stay apart on different sides
+   aliases_t aliases;
+   fvec_t names;
+   std::vector<const meta*> nmetas;
+   std::map<std::tuple<uint64_t,uint64_t,char>, size_t> seen;
+   for(size_t i = 0; i < all.size(); ++i) {
+      const meta& m = (*metas)[i];
+      char side = sides ? sides->find(all[i])->second : 0;
+      auto r = seen.insert(std::make_pair(std::make_tuple(m.dev, m.ino, side),
+         names.size()));
+      if (r.second) {
+         names.push_back(all[i]);
+         nmetas.push_back(&m);
+      } else aliases[names[r.first->second]].push_back(all[i]);
+   }
+
+   // digests of the index
+   std::map<std::string,fvec_t> known;
+   fvec_t rest;
+   for(size_t i = 0; i < names.size(); ++i) {
+      if (_known) {
+         const meta& m = *nmetas[i];
+         uawatch::index_t::const_iterator k = _known->files.find(names[i]);
+         if (k != _known->files.end() && k->second.digest.size() &&
+             k->second.size == size && k->second.mtime == m.mtime &&
+             k->second.ctime == m.ctime &&
+             k->second.dev == m.dev && k->second.ino == m.ino) {
+            known[k->second.digest].push_back(names[i]);
+            continue;
+         }
+      }
+      rest.push_back(names[i]);
+   }
+
+   if (names.size() < all.size() || known.size())
+      say(__str("Resolved ", all.size() - rest.size(), " of ", all.size(),
+         " files of ", size, " bytes from metadata"));
+
+   if (known.empty()) {
+      if (rest.size() > 1) group_of(size, rest, sides, &aliases);
+   } else {
+      std::mutex mtx;
+      double t0 = uastats::now();
+      sched().run(rest, [&](const std::string& file) {
+         uastats::scope sc(uastats::HASH);
+         uatrace::span sp("hash", "filei", size);
+         try {
+            filei fi(file, _opt.ic, false, 0, _opt.bsize, _opt.alg);
+            std::string digest(reinterpret_cast<const char*>(fi.hash()), fi.hash_len());
+            std::lock_guard<std::mutex> lock(mtx);
+            known[digest].push_back(file);
+         } catch(const char* e) {
+            skip(file, e);
+         }
+      });
+      uastats::wall(uastats::HASH, uastats::now() - t0);
+      for(auto& k : known) {
+         fvec_t& files = k.second;
+         if (files.size() < 2 && !aliases.count(files[0])) continue;
+         if (!both(files, sides)) continue;
+         group g;
+         g.size = size;
+         g.digest = k.first;
+         g.files.swap(files);
+         emit(g, &aliases);
+      }
+   }
+
+   // names of a file that matched no other file
+   for(auto& a : aliases) {
+      group g;
+      g.size = size;
+      g.files.push_back(a.first);
+      g.files.insert(g.files.end(), a.second.begin(), a.second.end());
+      if (!both(g.files, sides)) continue;
+      if (ph) {
+         try {
+            filei fi(a.first, _opt.ic, false, _opt.stage ? 0 : _opt.max,
+               _opt.bsize, _opt.alg);
+            g.digest.assign(reinterpret_cast<const char*>(fi.hash()), fi.hash_len());
+         } catch(const char* e) {
+            skip(a.first, e);
+            continue;
+         }
+      }
+      emit(g);
+   }
+}
+
+// process one size group
+void uascan::group_of(size_t size, const fvec_t& all, const sides_t* sides,
+   aliases_t* aliases) {
+   uatrace::span sp("group", "group", size, "files", all.size());
+   const bool ic = _opt.ic, iw = _opt.iw, stage = _opt.stage;
+   const bool ph = _opt.digests, count = _opt.count;
+   const size_t max = _opt.max, BN = _opt.bsize;
+   const filei_hash_alg alg = _opt.alg;
+   const fvec_t* cp = &all;
+
+   if (count && !iw && size <= __small_file) {
+      small_of(size, all, sides, aliases);
+      return;
+   }
+
+   // samples only make sense for files of the same size, and the
+   // result must not depend on bytes beyond -m
+   fvec_t sampled;
+   if (count && !iw && (!max || stage) && _plan.pos.size() &&
+       size >= 64 * _plan.bs * _plan.pos.size()) {
+      sampled = sample(all, size, sides);
+      if (sampled.size() < 2) return;
+      cp = &sampled;
+   }
+   const fvec_t& candidates = *cp;
+
+   // exactly two in set, and don't care about the hash
+   if (candidates.size() == 2 && !ph) {
+      pair(candidates[0], candidates[1], size, aliases);
+      return;
+   }
+
+   // Adaptive milestone comparison first
+   fvec_t remaining_candidates;
+   if (_opt.milestones) {
+      // the chunk sizes follow the file size; without size groups the
+      // sizes differ, the first file stands for them
+      size_t msize = size;
+      if (!count) {
+         try {
+            msize = filei::fsize(candidates[0]);
+         } catch(const char*) {
+            msize = 0;
+         }
+      }
+      remaining_candidates = milestones(candidates, msize, !ph && !max,
+         sides);
+
+      if (remaining_candidates.size() < 2) return;
+
+      say(__str("After milestone comparison: ", remaining_candidates.size(),
+         " candidates remain from ", candidates.size(), " files"));
+
+      // two left: a lockstep compare stops at the first difference
+      if (remaining_candidates.size() == 2 && !ph && !max) {
+         pair(remaining_candidates[0], remaining_candidates[1], size, aliases);
+         return;
+      }
+   } else {
+      remaining_candidates = candidates;
+   }
+
+   // Parallel hashing for remaining candidates; with -2 this is the
+   // prefix stage and each file keeps its hash state for stage two
+   std::mutex hash_mtx;
+   std::map<std::string, std::vector<filei>> hash_to_files;
+   double t0 = uastats::now();
+   sched().run(remaining_candidates, [&](const std::string& file) {
+      uastats::scope sc(uastats::HASH);
+      uatrace::span sp("hash", "filei", size);
+      try {
+         filei fi(file, ic, iw, max, BN, alg, stage);
+         std::string hash_str(reinterpret_cast<const char*>(fi.hash()), fi.hash_len());
+         {
+            std::lock_guard<std::mutex> lock(hash_mtx);
+            hash_to_files[hash_str].push_back(fi);
+         }
+         if (!count) say(__str("Processed ", file));
+      } catch(const char* e) {
+         skip(file, e);
+      }
+   });
+
+   // Now, for each group of files with the same hash, add them to cands
+   fset_t cands(ic,iw,stage ? 0 : max,BN,alg);
+   fvec_t matched;
+#if defined(__UA_USEHASH)
+   std::unordered_map<std::string, const filei*> prefix;
+#else
+   std::map<std::string, const filei*> prefix;
+#endif
+   for (const auto& pair : hash_to_files) {
+      if (pair.second.size() < 2) continue; // skip unique hashes
+      if (sides) { // and one sided ones
+         fvec_t paths;
+         for (const auto& fi : pair.second) paths.push_back(fi.path());
+         if (!both(paths, sides)) continue;
+      }
+      for (const auto& fi : pair.second) {
+         if (!stage) cands.add(fi);
+         else {
+            matched.push_back(fi.path());
+            prefix[fi.path()] = &fi;
+         }
+      }
+   }
+
+   uastats::wall(uastats::HASH, uastats::now() - t0);
+   uastats::files(uastats::HASH, remaining_candidates.size(),
+      stage ? matched.size() : cands.common().size());
+
+   if (stage) { // if -2, continue each file from where its prefix stopped
+      t0 = uastats::now();
+      sched().run(matched, [&](const std::string& file) {
+         uastats::scope sc(uastats::STAGE2);
+         uatrace::span sp("stage2", "filei", size);
+         try {
+            const filei& pre = *prefix.at(file);
+            filei fi = pre.resumable() ? filei::resume(pre, ic, BN) :
+               filei(file, ic, iw, 0, BN, alg);
+            std::lock_guard<std::mutex> lock(hash_mtx);
+            cands.add(fi);
+         } catch(const char* e) {
+            skip(file, e);
+         }
+      });
+      uastats::wall(uastats::STAGE2, uastats::now() - t0);
+   }
+
+   const res_t& res = cands.common();
+
+   if (stage) {
+      size_t left = 0;
+      for (const auto& c : res) left += c.second.size() + 1;
+      uastats::files(uastats::STAGE2, matched.size(), left);
+   }
+
+   for (const auto& c : res) {
+      group g;
+      g.size = size;
+      g.digest.assign(reinterpret_cast<const char*>(c.first.hash()), c.first.hash_len());
+      g.files.reserve(c.second.size() + 1);
+      g.files.push_back(c.first.path());
+      g.files.insert(g.files.end(), c.second.begin(), c.second.end());
+      if (both(g.files, sides)) emit(g, aliases);
+   }
+}
+
+void uascan::parallel(size_t n, const std::function<void(size_t,size_t)>& f) {
+   const size_t threads = _opt.threads;
+   if (threads < 2 || n <= threads) {
+      f(0, n);
+      return;
+   }
+
+   std::vector<std::future<void>> futures;
+   size_t batch_size = n / threads;
+   size_t remainder = n % threads;
+   size_t start = 0;
+   for (size_t i = 0; i < threads; ++i) {
+      size_t end = start + batch_size + (i < remainder ? 1 : 0);
+      futures.push_back(std::async(std::launch::async, f, start, end));
+      start = end;
+   }
+   for (auto& future : futures) future.get();
+}
+
+// Group the paths by size in memory, then drive the size groups
+ua_error uascan::grouped() {
+   fsetc_t files;
+   sidesc_t sides;
+   metac_t metas;
+
+   // Stat the files in batches, each keeps many stats in flight
+   double t0 = uastats::now();
+   uastatx sx(_opt.threads, __stat_depth);
+   for(size_t b = 0; b < _paths.size(); b += __stat_batch)
+      stat_batch(_paths, b, std::min(_paths.size(), b + __stat_batch), sx,
+         files, sides, metas);
+   uastats::wall(uastats::STAT, uastats::now() - t0);
+
+   // size groups are driven concurrently, their reads share the
+   // scheduler, so a group waiting on a slow device does not keep
+   // the workers away from the others
+   std::vector<fsetc_t::const_iterator> groups;
+   size_t left = 0;
+   for(fsetc_t::const_iterator fct= files.begin(); fct != files.end(); ++fct) {
+      // less than two in set
+      if (fct->second.size() < 2) continue;
+      // files of one side only
+      if (_opt.cross) {
+         const std::vector<char>& s = sides[fct->first];
+         size_t right = std::count(s.begin(), s.end(), 1);
+         if (!right || right == s.size()) continue;
+      }
+      groups.push_back(fct);
+      left += fct->second.size();
+   }
+   uastats::files(uastats::STAT, _paths.size(), left);
+   _ngroups = groups.size();
+
+   std::atomic<size_t> next_group(0);
+   std::atomic<bool> failed(false);
+   auto drive = [&]() {
+      uatrace::name("driver");
+      try {
+         for(size_t i; !failed && (i = next_group++) < groups.size(); ++_done) {
+            const std::vector<meta>* m = _opt.count ? &metas.at(groups[i]->first) : 0;
+            if (!_opt.cross) {
+               resolve(groups[i]->first, groups[i]->second, 0, m);
+               continue;
+            }
+            sides_t gs;
+            const fvec_t& g = groups[i]->second;
+            const std::vector<char>& s = sides.at(groups[i]->first);
+            for(size_t k = 0; k < g.size(); ++k) gs[g[k]] |= s[k] ? 2 : 1;
+            resolve(groups[i]->first, g, &gs, m);
+         }
+      } catch(...) {
+         failed = true;
+      }
+   };
+   std::vector<std::thread> drivers;
+   size_t dn = std::min(groups.size(), (size_t)_opt.threads);
+   for(size_t i = 1; i < dn; ++i) drivers.push_back(std::thread(drive));
+   drive();
+   for(auto& d : drivers) d.join();
+
+   if (failed) return fail(ua_error::NO_MEMORY, "Could not allocate memory");
+   return ua_error::OK;
+}
+
+// Group the paths by size on disk: stat a chunk at a time into sorted
+// runs, then merge the runs and drive each size group as it comes
+ua_error uascan::spilled() {
+   uaspill& sp = *_spill;
+
+   double t0 = uastats::now();
+   fvec_t chunk;
+   std::vector<uint64_t> offs;
+   std::vector<char> sides;
+   std::vector<uaspill::record> recs;
+   std::vector<uastatx::result> st;
+   uastatx sx(_opt.threads, __stat_depth);
+   try {
+      while(sp.chunk(chunk, offs, sides, _opt.spill_run)) {
+         uastats::scope sc(uastats::STAT);
+         uatrace::span ss("stat", "stat", -1, "files", chunk.size());
+         recs.clear();
+         if (_opt.count) sx.run(chunk, 0, chunk.size(), st);
+         for(size_t i = 0; i < chunk.size(); ++i, ++_stated) {
+            uaspill::record r = uaspill::record();
+            if (_opt.count) {
+               if (const char* err = __stat_error(st[i])) {
+                  skip(chunk[i], err);
+                  continue;
+               }
+               r.size = st[i].size;
+               if (_opt.shards > 1 && shard_of(r.size, _opt.shards) != _opt.shard)
+                  continue;
+               r.dev = st[i].dev;
+               r.ino = st[i].ino;
+               r.mtime = st[i].mtime;
+               r.ctime = st[i].ctime;
+            }
+            r.off = offs[i];
+            r.len = chunk[i].size();
+            r.side = sides[i];
+            recs.push_back(r);
+            if (_opt.verbose)
+               say(__str(_opt.count ? "Counting " : "Spooling ", chunk[i]));
+         }
+         sp.run(recs);
+      }
+   } catch(const char* e) {
+      return fail(ua_error::IO, e);
+   }
+   fvec_t().swap(chunk);
+   std::vector<uint64_t>().swap(offs);
+   std::vector<uaspill::record>().swap(recs);
+   uastats::wall(uastats::STAT, uastats::now() - t0);
+   say(__str("Spilled ", sp.size(), " paths in ", sp.runs(), " runs"));
+
+   // the drivers take turns at the merge, each holds one group at a time
+   std::mutex merge_mtx;
+   size_t left = 0;
+   const char* err = 0;
+   std::atomic<bool> failed(false);
+   auto drive = [&]() {
+      uatrace::name("driver");
+      uint64_t size;
+      std::vector<uaspill::record> recs;
+      fvec_t paths;
+      std::vector<meta> metas;
+      try {
+         while(!failed) {
+            {
+               std::lock_guard<std::mutex> lock(merge_mtx);
+               if (!sp.group(size, recs, paths)) break;
+               ++_ngroups;
+               left += paths.size();
+            }
+            sides_t gs;
+            if (_opt.cross) {
+               for(size_t i = 0; i < paths.size(); ++i)
+                  gs[paths[i]] |= recs[i].side ? 2 : 1;
+               if (!both(paths, &gs)) {
+                  ++_done;
+                  continue;
+               }
+            }
+            metas.clear();
+            if (_opt.count)
+               for(size_t i = 0; i < paths.size(); ++i) {
+                  sched().note(paths[i], recs[i].dev, recs[i].ino);
+                  meta m = { recs[i].dev, recs[i].ino, recs[i].mtime,
+                     recs[i].ctime };
+                  metas.push_back(m);
+               }
+            resolve(size, paths, _opt.cross ? &gs : 0, _opt.count ? &metas : 0);
+            sched().forget(paths);
+            ++_done;
+         }
+      } catch(const char* e) {
+         std::lock_guard<std::mutex> lock(merge_mtx);
+         err = e;
+         failed = true;
+      } catch(...) {
+         failed = true;
+      }
+   };
+   std::vector<std::thread> drivers;
+   for(int i = 1; i < _opt.threads; ++i) drivers.push_back(std::thread(drive));
+   drive();
+   for(auto& d : drivers) d.join();
+   uastats::files(uastats::STAT, sp.size(), left);
+
+   if (err) return fail(ua_error::IO, err);
+   if (failed) return fail(ua_error::NO_MEMORY, "Could not allocate memory");
+   return ua_error::OK;
+}
+
+ua_error uascan::run(const group_fn& f) {
+   ua_error res = ua_error::OK;
+   _out = f;
+   _groups.clear();
+   _npaths = size();
+   _stated = _ngroups = _done = _sets = _setfiles = 0;
+
+   try {
+      sched();
+      say(__str("Using ", _opt.threads, " threads"));
+      res = _spill ? spilled() : grouped();
+   } catch(const char* e) {
+      res = fail(ua_error::INVALID_OPTION, e);
+   } catch(const std::bad_alloc&) {
+      res = fail(ua_error::NO_MEMORY, "Could not allocate memory");
+   } catch(...) {
+      res = fail(ua_error::INTERNAL, "Internal error");
+   }
+
+   fvec_t().swap(_paths);
+   std::vector<char>().swap(_sides);
+   _spill.reset();
+   _out = group_fn();
+   return res;
+}
+
+ua_error uascan::merge(const std::vector<std::string>& manifests,
+   const group_fn& f) {
+   ua_error res = ua_error::OK;
+   _sets = _setfiles = 0;
+   try {
+      uamanifest::merge(manifests, [this, &f](const group& g) {
+         ++_sets;
+         _setfiles += g.files.size();
+         f(g);
+      });
+   } catch(const char* e) {
+      res = fail(ua_error::IO, e);
+   } catch(const std::bad_alloc&) {
+      res = fail(ua_error::NO_MEMORY, "Could not allocate memory");
+   } catch(...) {
+      res = fail(ua_error::INTERNAL, "Internal error");
+   }
+   return res;
+}
+
+unsigned uascan::shard_of(uint64_t size, unsigned shards) {
+   // splitmix64 finalizer
+   uint64_t z = size + 0x9e3779b97f4a7c15ULL;
+   z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+   z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+   z ^= z >> 31;
+   return z % shards;
+}
+
+ua_error uascan::match(const std::string& ref, const match_fn& f) {
+   ua_error res = ua_error::OK;
+   off_t n = 0;
+
+   try {
+      if (_opt.count) {
+         try {
+            n = filei::fsize(ref);
+         } catch(const char* e) {
+            skip(ref, e);
+         }
+      }
+
+      for (const auto& file : _paths) {
+         say(__str("Considering ", file));
+         try {
+            if (_opt.count && filei::fsize(file) != n) continue;
+            if (filei::eq(ref, file, _opt.ic, _opt.iw, 0, _opt.bsize, _opt.alg)) {
+               std::lock_guard<std::mutex> lock(_out_mtx);
+               f(file);
+            }
+         } catch(const char* e) {
+            skip(file, e);
+         }
+      }
+   } catch(const std::bad_alloc&) {
+      res = fail(ua_error::NO_MEMORY, "Could not allocate memory");
+   } catch(...) {
+      res = fail(ua_error::INTERNAL, "Internal error");
+   }
+
+   fvec_t().swap(_paths);
+   return res;
+}
@@ -0,0 +1,371 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code was developed for an EU.EDGE internal project and
+ * is made available according to the terms of this license.
+ *
+ * The Initial Developer of the Original Code is Istvan T. Hernadvolgyi,
+ * EU.EDGE LLC.
+ *
+ * Portions created by EU.EDGE LLC are Copyright (C) EU.EDGE LLC.
+ * All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+// SCANNER FOR SETS OF IDENTICAL FILES - HEADER
+//
+
+#if !defined(_UASCAN_H_)
+#define _UASCAN_H_
+
+#include <filei.h>
+#include <uastats.h>
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class iosched;
+class uastatx;
+class milestone_stats;
+class uaspill;
+
+/** Error codes of the scanner. */
+enum class ua_error {
+   OK = 0,
+   INVALID_OPTION, // the options are inconsistent or cannot be parsed
+   NO_MEMORY,      // an allocation failed
+   IO,             // a file the scan cannot do without could not be read
+   INTERNAL        // anything else
+};
+
+/** Scanner for sets of identical files.
+ *
+ * This is the engine behind ua and kua, for programs that want to scan
+ * without running them. A scanner is configured (configure), fed with
+ * path names (add) and run; run reports every set of identical files
+ * through a callback as soon as the set is final, or collects them for
+ * groups() if no callback is given. Nothing throws: calls return an
+ * error code, and files that cannot be read are reported through the
+ * error callback and left out of the result, as ua does.
+ *
+ * A scanner can run any number of scans. The worker pool, the placement
+ * cache of the scheduler and the milestone statistics are kept between
+ * them, so a long lived process pays for them once. The callbacks are
+ * called one at a time (never concurrently), from whichever thread
+ * finished the work, while the scanner holds its output lock: they
+ * should return quickly.
+ *
+ * The scanner changes the work buffer functions of filei (filei::_gbuff
+ * and friends) to malloc and free when it is constructed, since it and
+ * the users of its worker pool hash concurrently.
+ *
+ * <pre>
+ *    uascan sc;
+ *    uascan::options o;
+ *    o.alg = filei_hash_alg::BLAKE3;
+ *    if (sc.configure(o) != ua_error::OK) ... sc.message() ...
+ *    for(...) sc.add(path);
+ *    sc.run([](const uascan::group& g) { ... g.files ... });
+ * </pre>
+ */
+class uascan {
+
+   public:
+
+      /** Options of a scan; the defaults are those of ua. */
+      struct options {
+         filei_hash_alg alg; // hash algorithm (-a)
+         bool ic;            // ignore case (-i)
+         bool iw;            // ignore white space (-w), implies !count
+         bool count;         // group by file size first (not -n)
+         size_t max;         // consider the first max bytes, 0 for all (-m)
+         bool stage;         // two stage hashing, requires max (-2)
+         bool milestones;    // adaptive prefix milestones (not -M)
+         bool digests;       // every group needs its digest (-p)
+         size_t bsize;       // buffer size (-b)
+         int threads;        // worker threads (-t)
+         bool physical;      // read in physical order (-P)
+         std::string depths; // device queue depths (-d)
+         std::string sample; // sample plan (-S)
+         std::string spill;  // directory to group by size in (--spill),
+                             // empty to group in memory
+         size_t spill_run;   // paths per sorted run when spilling
+         unsigned shard;     // this scan takes the sizes of shard
+         unsigned shards;    // out of shards (--shard), 1 for all
+         bool cross;         // only sets with files of both sides (--left,
+                             // --right), see add
+         std::string index;  // index of a watch (--index) whose digests
+                             // are taken for files that did not change,
+                             // empty for none
+         bool verbose;       // report progress through the log callback
+
+         options();
+      };
+
+      /** A set of identical files. */
+      struct group {
+         off_t size;         // byte count, 0 when not grouped by size
+         std::string digest; // raw digest, empty if not calculated
+         fvec_t files;       // path names, at least two
+      };
+
+      /** Progress of a scan. */
+      struct progress {
+         size_t paths;   // paths in the scan
+         size_t stated;  // paths sorted by size so far
+         size_t groups;  // size groups with at least two files
+         size_t done;    // size groups finished
+         size_t sets;    // identical sets reported
+         size_t files;   // files in those sets
+         unsigned long long bytes; // bytes read by the workers (all scans)
+      };
+
+      /** Called with every set of identical files. */
+      typedef std::function<void(const group&)> group_fn;
+
+      /** Called with a file that could not be processed and the reason. */
+      typedef std::function<void(const std::string&, const char*)> error_fn;
+
+      /** Called with progress messages (only if options::verbose). */
+      typedef std::function<void(const std::string&)> log_fn;
+
+      /** Called with every file identical to the reference of match. */
+      typedef std::function<void(const std::string&)> match_fn;
+
+      uascan();
+      ~uascan();
+
+      /** Set the options of the following scans.
+       * Changing the spill directory drops the paths added.
+       * @param o options
+       * @return INVALID_OPTION if they are inconsistent (see message)
+       */
+      ua_error configure(const options& o);
+
+      /** Get the options in effect (normalized by configure). */
+      const options& config() const { return _opt; }
+
+      /** Set the error callback (none by default). */
+      void on_error(const error_fn& f) { _err = f; }
+
+      /** Set the log callback (none by default). */
+      void on_log(const log_fn& f) { _log = f; }
+
+      /** Add a path name to the next scan.
+       * When spilling, the path goes to the spill directory.
+       * @param path file name
+       * @return NO_MEMORY if it could not be stored, IO if it could not
+       *         be spilled
+       */
+      ua_error add(const std::string& path);
+
+      /** Add a path name of one side to the next scan.
+       * In cross mode (options::cross) only sets with files of both
+       * sides are reported. Size groups, and the subgroups the
+       * milestones and hashes split them into, are dropped as soon as
+       * they hold files of one side only.
+       * @param path file name
+       * @param right the path is on the right side (else the left)
+       * @return as add
+       */
+      ua_error add(const std::string& path, bool right);
+
+      /** Number of paths added since the last scan. */
+      size_t size() const;
+
+      /** Find the sets of identical files among the added paths.
+       * The paths are forgotten afterwards.
+       * @param f called with each set as soon as it is final; when
+       *        empty the sets are kept for groups()
+       * @return OK, or the error that stopped the scan
+       */
+      ua_error run(const group_fn& f = group_fn());
+
+      /** Find the added paths identical to a reference file (kua).
+       * Paths are compared in the order they were added and the
+       * callback is called in that order. The paths are forgotten
+       * afterwards.
+       * @param ref the reference file
+       * @param f called with every path identical to ref
+       * @return OK, or the error that stopped the scan
+       */
+      ua_error match(const std::string& ref, const match_fn& f);
+
+      /** Call a job for every path on the worker pool of the scanner.
+       * Meant for actions on the sets found (see uaaction): the jobs
+       * share the workers and device queue depths with the scan and may
+       * be submitted while it is running, from any thread but the
+       * callbacks'. Returns when all jobs have finished; jobs handle
+       * their own errors.
+       * @param paths file names
+       * @param job called with each path
+       * @return OK, or NO_MEMORY
+       */
+      ua_error each(const fvec_t& paths,
+         const std::function<void(const std::string&)>& job);
+
+      /** Merge the manifests of scans (see uamanifest).
+       * Reads no file but the manifests.
+       * @param manifests the manifest files
+       * @param f called with each set
+       * @return OK, or IO if a manifest could not be read or the
+       *         manifests do not fit together (see message)
+       */
+      ua_error merge(const std::vector<std::string>& manifests,
+         const group_fn& f);
+
+      /** Shard of a file size.
+       * Sizes are spread over the shards by a hash, so every shard gets
+       * its share of small and large files.
+       * @param size byte count
+       * @param shards number of shards
+       * @return the shard, 0 .. shards-1
+       */
+      static unsigned shard_of(uint64_t size, unsigned shards);
+
+      /** Progress of the running (or last) scan.
+       * May be called from any thread while run is going on.
+       */
+      progress status();
+
+      /** Sets found by the last run without a callback. */
+      const std::vector<group>& groups() const { return _groups; }
+
+      /** Message describing the last error returned. */
+      const char* message() const { return _msg; }
+
+      /** Per-device totals of all scans so far. */
+      std::vector<uastats::device> devices();
+
+      /** Drop the paths added and the sets kept. */
+      void clear();
+
+   private:
+
+      // sampling pre-filter: block size and positions, each position is
+      // frac * size + off (clamped so the block fits in the file)
+      struct sample_plan {
+         size_t bs;
+         std::vector<std::pair<double,long long> > pos;
+      };
+
+      options _opt;
+      sample_plan _plan;
+      const char* _msg;
+
+      error_fn _err;
+      log_fn _log;
+      group_fn _out;
+      std::mutex _out_mtx; // serializes the callbacks
+
+      fvec_t _paths;
+      std::vector<char> _sides; // of _paths in cross mode
+      std::vector<group> _groups;
+
+      // progress
+      std::atomic<size_t> _npaths;
+      std::atomic<size_t> _stated;
+      std::atomic<size_t> _ngroups;
+      std::atomic<size_t> _done;
+      std::atomic<size_t> _sets;
+      std::atomic<size_t> _setfiles;
+
+      std::unique_ptr<iosched> _sched;
+      std::unique_ptr<milestone_stats> _mstats;
+      std::unique_ptr<uaspill> _spill;
+
+      // digests of the index (options::index)
+      struct known;
+      std::unique_ptr<known> _known;
+
+      uascan(const uascan&);
+      uascan& operator=(const uascan&);
+
+      // the scheduler for the current options
+      iosched& sched();
+
+      ua_error fail(ua_error e, const char* msg);
+
+      void say(const std::string& msg);
+      void skip(const std::string& path, const char* msg);
+      // names of the same file (device and inode) by the name taken
+      typedef std::map<std::string,fvec_t> aliases_t;
+
+      // report a set, with the other names of its files (which are
+      // removed from aliases)
+      void emit(group& g, aliases_t* aliases = 0);
+
+      // call f on ranges of [0,n) on the worker count of threads
+      void parallel(size_t n, const std::function<void(size_t,size_t)>& f);
+
+      // group in memory or on disk and drive the size groups
+      ua_error grouped();
+      ua_error spilled();
+
+      // sides of each file of a size group in cross mode: 1 left,
+      // 2 right, 3 for a path listed on both
+      typedef std::map<std::string,char> sides_t;
+      typedef std::map<size_t,std::vector<char> > sidesc_t;
+
+      // what the stat phase learned about a file (count only)
+      struct meta {
+         uint64_t dev;
+         uint64_t ino;
+         int64_t mtime; // ns
+         int64_t ctime; // ns
+      };
+      typedef std::map<size_t,std::vector<meta> > metac_t;
+
+      // whether files has files of both sides (or not in cross mode)
+      static bool both(const fvec_t& files, const sides_t* sides);
+
+      // the phases
+      void stat_batch(const fvec_t& files, size_t b, size_t e, uastatx& sx,
+         fsetc_t& by_size, sidesc_t& sides, metac_t& metas);
+      fvec_t milestones(const fvec_t& candidates, size_t file_size,
+         bool lockstep, const sides_t* sides);
+      fvec_t sample(const fvec_t& candidates, size_t size,
+         const sides_t* sides);
+      void pair(const std::string& f1, const std::string& f2, size_t size,
+         aliases_t* aliases);
+
+      // group small files in memory, each read once
+      void small_of(size_t size, const fvec_t& all, const sides_t* sides,
+         aliases_t* aliases);
+
+      // settle what the metadata of a size group tells (empty files,
+      // names of the same file, digests of the index), then group_of
+      // the rest
+      void resolve(size_t size, const fvec_t& all, const sides_t* sides,
+         const std::vector<meta>* metas);
+
+      // group the files of a size group by content
+      void group_of(size_t size, const fvec_t& all,
+         const sides_t* sides = 0, aliases_t* aliases = 0);
+
+      static bool parse_sample_plan(const std::string& spec, sample_plan& plan);
+};
+
+#endif
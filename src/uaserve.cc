@@ -0,0 +1,369 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code was developed for an EU.EDGE internal project and
+ * is made available according to the terms of this license.
+ *
+ * The Initial Developer of the Original Code is Istvan T. Hernadvolgyi,
+ * EU.EDGE LLC.
+ *
+ * Portions created by EU.EDGE LLC are Copyright (C) EU.EDGE LLC.
+ * All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+// RESIDENT QUERY SERVER - IMPLEMENTATION
+//
+
+#include <uaserve.h>
+#include <uatrace.h>
+
+#include <algorithm>
+#include <cstring>
+
+extern "C" {
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+}
+
+static const char __magic[8] = { 'U', 'A', 'S', 'E', 'R', 'V', 'E', 1 };
+
+// wire layout of the hello and of a query
+struct __hello {
+   char magic[8];
+   uint8_t alg;
+   uint8_t flags;
+   uint8_t reserved[6];
+};
+
+struct __query {
+   uint64_t size;
+   uint32_t path_len;
+   uint8_t kind;
+   uint8_t digest_len;
+   uint16_t reserved;
+};
+
+// bounds on what a peer may send
+static const uint32_t __max_count = 1 << 20;
+static const uint32_t __max_path = 1 << 16;
+
+// milliseconds between checks of the stop flag
+static const int __poll_ms = 500;
+
+static bool __send(int fd, const void* p, size_t n) {
+   const char* c = static_cast<const char*>(p);
+   while(n) {
+      ssize_t w = ::send(fd, c, n, MSG_NOSIGNAL);
+      if (w < 0 && errno == EINTR) continue;
+      if (w <= 0) return false;
+      c += w;
+      n -= w;
+   }
+   return true;
+}
+
+static bool __recv(int fd, void* p, size_t n) {
+   char* c = static_cast<char*>(p);
+   while(n) {
+      ssize_t r = ::recv(fd, c, n, 0);
+      if (r < 0 && errno == EINTR) continue;
+      if (r <= 0) return false;
+      c += r;
+      n -= r;
+   }
+   return true;
+}
+
+static void __put32(std::string& out, uint32_t n) {
+   out.append(reinterpret_cast<const char*>(&n), sizeof(n));
+}
+
+static bool __address(const std::string& path, struct sockaddr_un& a) {
+   ::memset(&a, 0, sizeof(a));
+   a.sun_family = AF_UNIX;
+   if (path.size() >= sizeof(a.sun_path)) return false;
+   ::memcpy(a.sun_path, path.c_str(), path.size());
+   return true;
+}
+
+uaserve::uaserve(uascan& scanner):_scanner(scanner),_msg("") {
+}
+
+uaserve::~uaserve() {
+   for(auto& c : _conns) c->t.join();
+}
+
+void uaserve::say(const std::string& msg) {
+   if (_log) _log(msg);
+}
+
+ua_error uaserve::load() {
+   uatrace::span sp("load", "serve", -1, "files", _paths.size());
+   ua_error res = _scanner.each(_paths, [this](const std::string& path) {
+      struct stat si;
+      if (::stat(path.c_str(), &si) || !S_ISREG(si.st_mode)) return;
+      std::lock_guard<std::mutex> lock(_mtx);
+      _sizes[si.st_size].push_back(path);
+   });
+   if (res != ua_error::OK) {
+      _msg = _scanner.message();
+      return res;
+   }
+   size_t n = 0;
+   for(auto& b : _sizes) {
+      std::sort(b.second.begin(), b.second.end());
+      n += b.second.size();
+   }
+   fvec_t().swap(_paths);
+   say("Serving " + std::to_string(n) + " files of " +
+      std::to_string(_sizes.size()) + " sizes");
+   return ua_error::OK;
+}
+
+// hash the files of a size the first time it is asked for; lock holds
+// _mtx, which is released while hashing so that the other queries go on,
+// those of the same size wait for the digests
+void uaserve::resolve(uint64_t size, std::unique_lock<std::mutex>& lock) {
+   if (_hashed.count(size)) return;
+   if (_hashing.count(size)) {
+      _cv.wait(lock, [this, size]() { return _hashed.count(size) != 0; });
+      return;
+   }
+   std::map<uint64_t,fvec_t>::const_iterator b = _sizes.find(size);
+   if (b == _sizes.end()) {
+      _hashed.insert(size);
+      return;
+   }
+   _hashing.insert(size);
+   lock.unlock();
+
+   // _sizes does not change after load
+   const uascan::options& o = _scanner.config();
+   std::map<std::string,fvec_t> sets;
+   std::mutex mtx;
+   _scanner.each(b->second, [&](const std::string& path) {
+      uastats::scope sc(uastats::HASH);
+      try {
+         filei fi(path, o.ic, false, 0, o.bsize, o.alg);
+         std::string d(reinterpret_cast<const char*>(fi.hash()), fi.hash_len());
+         std::lock_guard<std::mutex> lock(mtx);
+         sets[d].push_back(path);
+      } catch(const char*) {
+      }
+   });
+   for(auto& s : sets) std::sort(s.second.begin(), s.second.end());
+   say("Hashed " + std::to_string(b->second.size()) + " files of size " +
+      std::to_string(size));
+
+   lock.lock();
+   for(auto& s : sets) _sets[key_t(size, s.first)].swap(s.second);
+   _hashing.erase(size);
+   _hashed.insert(size);
+   _cv.notify_all();
+}
+
+void uaserve::answer(uint64_t size, const std::string& digest,
+   std::string& out) {
+   std::unique_lock<std::mutex> lock(_mtx);
+   resolve(size, lock);
+   std::map<key_t,fvec_t>::const_iterator s = _sets.find(key_t(size, digest));
+   if (s == _sets.end()) {
+      __put32(out, 0);
+      return;
+   }
+   __put32(out, s->second.size());
+   for(const auto& f : s->second) {
+      __put32(out, f.size());
+      out.append(f);
+   }
+}
+
+// serve one connection
+void uaserve::talk(int fd, conn* c, const volatile sig_atomic_t& stop) {
+   uatrace::name("client");
+   const uascan::options& o = _scanner.config();
+   __hello h;
+   ::memset(&h, 0, sizeof(h));
+   ::memcpy(h.magic, __magic, sizeof(__magic));
+   h.alg = (uint8_t)o.alg;
+   h.flags = o.ic ? 1 : 0;
+
+   std::string out;
+   bool ok = __send(fd, &h, sizeof(h));
+   while(ok && !stop) {
+      struct pollfd pfd = { fd, POLLIN, 0 };
+      int r = ::poll(&pfd, 1, __poll_ms);
+      if (r < 0 && errno != EINTR) break;
+      if (r <= 0) continue;
+
+      uint32_t count;
+      if (!__recv(fd, &count, sizeof(count)) || count > __max_count) break;
+      uatrace::span sp("batch", "serve", -1, "queries", count);
+      out.clear();
+      for(uint32_t i = 0; ok && i < count; ++i) {
+         __query q;
+         std::string digest, path;
+         ok = __recv(fd, &q, sizeof(q)) && q.path_len <= __max_path;
+         if (ok) {
+            digest.resize(q.digest_len);
+            path.resize(q.path_len);
+            ok = (!q.digest_len || __recv(fd, &digest[0], q.digest_len)) &&
+               (!q.path_len || __recv(fd, &path[0], q.path_len));
+         }
+         if (!ok) break;
+
+         if (q.kind == DIGEST) {
+            answer(q.size, digest, out);
+            continue;
+         }
+         // by path: nothing to read unless the size is in the haystack
+         struct stat si;
+         bool known = !::stat(path.c_str(), &si) && S_ISREG(si.st_mode);
+         if (known) {
+            std::lock_guard<std::mutex> lock(_mtx);
+            known = _sizes.count(si.st_size);
+         }
+         if (known) try {
+            filei fi(path, o.ic, false, 0, o.bsize, o.alg);
+            digest.assign(reinterpret_cast<const char*>(fi.hash()),
+               fi.hash_len());
+         } catch(const char*) {
+            known = false;
+         }
+         if (known) answer(si.st_size, digest, out);
+         else __put32(out, 0);
+      }
+      ok = ok && __send(fd, out.data(), out.size());
+   }
+   ::close(fd);
+   c->done = true;
+}
+
+ua_error uaserve::serve(const std::string& path,
+   const volatile sig_atomic_t& stop) {
+   struct sockaddr_un a;
+   if (!__address(path, a)) {
+      _msg = "Socket path too long";
+      return ua_error::INVALID_OPTION;
+   }
+   struct stat si;
+   if (!::lstat(path.c_str(), &si) && S_ISSOCK(si.st_mode))
+      ::unlink(path.c_str());
+
+   int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   if (fd < 0 || ::bind(fd, (struct sockaddr*)&a, sizeof(a)) ||
+       ::listen(fd, SOMAXCONN)) {
+      if (fd >= 0) ::close(fd);
+      _msg = "Could not listen on the socket";
+      return ua_error::IO;
+   }
+   say("Listening on " + path);
+
+   while(!stop) {
+      struct pollfd pfd = { fd, POLLIN, 0 };
+      int r = ::poll(&pfd, 1, __poll_ms);
+      if (r < 0 && errno != EINTR) break;
+
+      // reap the connections that ended
+      for(size_t i = 0; i < _conns.size();) {
+         if (_conns[i]->done) {
+            _conns[i]->t.join();
+            _conns[i] = std::move(_conns.back());
+            _conns.pop_back();
+         } else ++i;
+      }
+      if (r <= 0) continue;
+
+      int cfd = ::accept4(fd, 0, 0, SOCK_CLOEXEC);
+      if (cfd < 0) continue;
+      std::unique_ptr<conn> c(new conn);
+      c->done = false;
+      c->t = std::thread(&uaserve::talk, this, cfd, c.get(), std::ref(stop));
+      _conns.push_back(std::move(c));
+   }
+   ::close(fd);
+   ::unlink(path.c_str());
+   for(auto& c : _conns) c->t.join();
+   _conns.clear();
+   return ua_error::OK;
+}
+
+uaserve::client::client(const std::string& path):_fd(-1),_count(0) {
+   struct sockaddr_un a;
+   if (!__address(path, a)) throw "Socket path too long";
+   _fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   if (_fd < 0) throw "Could not create socket";
+   __hello h;
+   if (::connect(_fd, (struct sockaddr*)&a, sizeof(a))) {
+      ::close(_fd);
+      throw "Could not connect to the server";
+   }
+   if (!__recv(_fd, &h, sizeof(h)) ||
+       ::memcmp(h.magic, __magic, sizeof(__magic))) {
+      ::close(_fd);
+      throw "Not a ua server";
+   }
+   _alg = (filei_hash_alg)h.alg;
+   _ic = h.flags & 1;
+}
+
+uaserve::client::~client() {
+   ::close(_fd);
+}
+
+void uaserve::client::ask(uint64_t size, const std::string& digest) {
+   __query q = { size, 0, DIGEST, (uint8_t)digest.size(), 0 };
+   _batch.append(reinterpret_cast<const char*>(&q), sizeof(q));
+   _batch.append(digest);
+   ++_count;
+}
+
+void uaserve::client::ask(const std::string& path) {
+   __query q = { 0, (uint32_t)path.size(), PATH, 0, 0 };
+   _batch.append(reinterpret_cast<const char*>(&q), sizeof(q));
+   _batch.append(path);
+   ++_count;
+}
+
+void uaserve::client::answers(std::vector<fvec_t>& res) {
+   res.assign(_count, fvec_t());
+   bool ok = __send(_fd, &_count, sizeof(_count)) &&
+      __send(_fd, _batch.data(), _batch.size());
+   _batch.clear();
+   _count = 0;
+   for(size_t i = 0; ok && i < res.size(); ++i) {
+      uint32_t n;
+      ok = __recv(_fd, &n, sizeof(n));
+      for(uint32_t j = 0; ok && j < n; ++j) {
+         uint32_t len;
+         ok = __recv(_fd, &len, sizeof(len)) && len <= __max_path;
+         if (!ok) break;
+         std::string p(len, '\0');
+         ok = !len || __recv(_fd, &p[0], len);
+         res[i].push_back(p);
+      }
+   }
+   if (!ok) throw "Lost the connection to the server";
+}
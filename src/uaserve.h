@@ -0,0 +1,194 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code was developed for an EU.EDGE internal project and
+ * is made available according to the terms of this license.
+ *
+ * The Initial Developer of the Original Code is Istvan T. Hernadvolgyi,
+ * EU.EDGE LLC.
+ *
+ * Portions created by EU.EDGE LLC are Copyright (C) EU.EDGE LLC.
+ * All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+// RESIDENT QUERY SERVER - HEADER
+//
+
+#if !defined(_UASERVE_H_)
+#define _UASERVE_H_
+
+#include <uascan.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <csignal>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <stdint.h>
+}
+
+/** Resident server answering "which files have this content" queries.
+ *
+ * The server stats the haystack files once and keeps them by size in
+ * memory; a size group is hashed on the worker pool of the scanner the
+ * first time a query needs it and its digests are kept, so every later
+ * query of that size is answered from memory. While a group is hashed,
+ * only the queries of its size wait for it. The index is a snapshot:
+ * files changed after they were hashed are not noticed.
+ *
+ * Clients connect to a Unix domain socket and send batches of queries,
+ * each either a (size, digest) or the path of a file the server reads
+ * (the client then needs no hashing of its own). The answer to a query
+ * is the list of haystack paths with that content, like kua.
+ *
+ * The protocol, all numbers in host byte order (the peers share a host):
+ * <pre>
+ *    hello   (server, on connect) "UASERVE" 1, uint8 alg, uint8 flags
+ *            (1 ic), 6 zero bytes
+ *    batch   (client) uint32 count, then count queries:
+ *            uint64 size, uint32 path length, uint8 kind (0 digest,
+ *            1 path), uint8 digest length, uint16 0, digest, path
+ *    answer  (server) per query: uint32 path count, then per path
+ *            uint32 length, path
+ * </pre>
+ * A client may send any number of batches on a connection.
+ */
+class uaserve {
+
+   public:
+
+      /** Query kinds. */
+      enum kind { DIGEST = 0, PATH = 1 };
+
+      /** Constructor.
+       * @param scanner options (algorithm, case) and worker pool
+       */
+      uaserve(uascan& scanner);
+      ~uaserve();
+
+      /** Set the log callback (verbose messages). */
+      void on_log(const uascan::log_fn& f) { _log = f; }
+
+      /** Add a haystack file.
+       * @param path file name
+       */
+      void add(const std::string& path) { _paths.push_back(path); }
+
+      /** Stat the files added and group them by size.
+       * @return OK, or NO_MEMORY
+       */
+      ua_error load();
+
+      /** Serve queries until stop is set.
+       * A stale socket file at path is replaced.
+       * @param path the socket
+       * @param stop set (e.g. by a signal handler) to return
+       * @return OK, or IO (see message)
+       */
+      ua_error serve(const std::string& path,
+         const volatile sig_atomic_t& stop);
+
+      /** Message describing the last error returned. */
+      const char* message() const { return _msg; }
+
+      /** Client of a server. Errors are thrown as const char*. */
+      class client {
+         public:
+            /** Constructor. Connects and reads the hello.
+             * @param path the socket
+             */
+            client(const std::string& path);
+            ~client();
+
+            /** Hash algorithm of the server. */
+            filei_hash_alg alg() const { return _alg; }
+
+            /** Whether the server ignores case. */
+            bool ic() const { return _ic; }
+
+            /** Add a query by content to the batch.
+             * @param size file size
+             * @param digest raw digest
+             */
+            void ask(uint64_t size, const std::string& digest);
+
+            /** Add a query by file to the batch.
+             * @param path file name (absolute, the server reads it)
+             */
+            void ask(const std::string& path);
+
+            /** Send the batch and receive the answers.
+             * @param res the paths for each query, in order (returned)
+             */
+            void answers(std::vector<fvec_t>& res);
+
+         private:
+            int _fd;
+            filei_hash_alg _alg;
+            bool _ic;
+            uint32_t _count;
+            std::string _batch;
+
+            client(const client&);
+            client& operator=(const client&);
+      };
+
+   private:
+
+      typedef std::pair<uint64_t,std::string> key_t; // size, digest
+
+      uascan& _scanner;
+      const char* _msg;
+      uascan::log_fn _log;
+      fvec_t _paths;
+
+      std::mutex _mtx; // guards everything below
+      std::condition_variable _cv; // a size was hashed
+      std::map<uint64_t,fvec_t> _sizes;
+      std::map<key_t,fvec_t> _sets;
+      std::set<uint64_t> _hashed;    // sizes hashed already
+      std::set<uint64_t> _hashing;   // sizes being hashed
+
+      // connections being served
+      struct conn {
+         std::thread t;
+         std::atomic<bool> done;
+      };
+      std::vector<std::unique_ptr<conn> > _conns;
+
+      uaserve(const uaserve&);
+      uaserve& operator=(const uaserve&);
+
+      void say(const std::string& msg);
+      void talk(int fd, conn* c, const volatile sig_atomic_t& stop);
+      void answer(uint64_t size, const std::string& digest,
+         std::string& out);
+      void resolve(uint64_t size, std::unique_lock<std::mutex>& lock);
+};
+
+#endif
@@ -0,0 +1,218 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code was developed for an EU.EDGE internal project and
+ * is made available according to the terms of this license.
+ *
+ * The Initial Developer of the Original Code is Istvan T. Hernadvolgyi,
+ * EU.EDGE LLC.
+ *
+ * Portions created by EU.EDGE LLC are Copyright (C) EU.EDGE LLC.
+ * All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+// EXTERNAL GROUPING OF PATHS BY SIZE - IMPLEMENTATION
+//
+
+#include <uaspill.h>
+
+#include <algorithm>
+#include <cstring>
+
+extern "C" {
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+}
+
+// bytes of paths buffered before writing, read back at a time
+static const size_t __pblock = 1 << 20;
+
+// records read ahead per run while merging
+static const size_t __rblock = 4096;
+
+// the path file has the length of each path, the top bit is the side
+static const uint32_t __right = 0x80000000u;
+
+uaspill::uaspill(const std::string& dir)
+:_dir(dir),_pfd(-1),_pend(0),_npaths(0),_rpos(0),_merging(false) {
+   _pfd = temp();
+}
+
+uaspill::~uaspill() {
+   if (_pfd >= 0) ::close(_pfd);
+   for(auto& r : _runs) ::close(r.fd);
+}
+
+int uaspill::temp() {
+   std::string t = _dir + "/ua-spill-XXXXXX";
+   std::vector<char> name(t.begin(), t.end());
+   name.push_back(0);
+   int fd = ::mkstemp(name.data());
+   if (fd < 0) throw "Could not create spill file";
+   ::unlink(name.data());
+   return fd;
+}
+
+void uaspill::add(const std::string& path, bool right) {
+   if (path.size() >= __right) throw "Path too long to spill";
+   uint32_t n = path.size() | (right ? __right : 0);
+   _pbuf.append(reinterpret_cast<const char*>(&n), sizeof(n));
+   _pbuf += path;
+   ++_npaths;
+   if (_pbuf.size() >= __pblock) flush();
+}
+
+void uaspill::flush() {
+   for(size_t off = 0; off < _pbuf.size();) {
+      ssize_t w = ::write(_pfd, _pbuf.data() + off, _pbuf.size() - off);
+      if (w < 0 && errno == EINTR) continue;
+      if (w <= 0) throw "Could not write spill file";
+      off += w;
+   }
+   _pend += _pbuf.size();
+   _pbuf.clear();
+}
+
+void uaspill::pread(int fd, char* b, size_t n, uint64_t off) {
+   while(n) {
+      ssize_t r = ::pread(fd, b, n, off);
+      if (r < 0 && errno == EINTR) continue;
+      if (r <= 0) throw "Could not read spill file";
+      b += r;
+      n -= r;
+      off += r;
+   }
+}
+
+bool uaspill::chunk(fvec_t& paths, std::vector<uint64_t>& offs,
+   std::vector<char>& sides, size_t n) {
+   paths.clear();
+   offs.clear();
+   sides.clear();
+   if (_pbuf.size()) flush();
+
+   // _rbuf holds the bytes from _rpos - _rbuf.size() on
+   size_t p = 0;
+   while(paths.size() < n) {
+      uint32_t len;
+      if (_rbuf.size() - p >= sizeof(len)) {
+         ::memcpy(&len, _rbuf.data() + p, sizeof(len));
+         bool right = len & __right;
+         len &= ~__right;
+         if (_rbuf.size() - p - sizeof(len) >= len) {
+            paths.push_back(_rbuf.substr(p + sizeof(len), len));
+            sides.push_back(right);
+            offs.push_back(_rpos - _rbuf.size() + p + sizeof(len));
+            p += sizeof(len) + len;
+            continue;
+         }
+      }
+      if (_rpos == _pend) break;
+      _rbuf.erase(0, p);
+      p = 0;
+      size_t k = std::min((uint64_t)__pblock, _pend - _rpos);
+      size_t old = _rbuf.size();
+      _rbuf.resize(old + k);
+      pread(_pfd, &_rbuf[old], k, _rpos);
+      _rpos += k;
+   }
+   _rbuf.erase(0, p);
+   return !paths.empty();
+}
+
+void uaspill::run(std::vector<record>& recs) {
+   if (recs.empty()) return;
+   std::sort(recs.begin(), recs.end());
+   reader r;
+   r.fd = temp();
+   r.pos = 0;
+   r.end = recs.size() * sizeof(record);
+   r.next = 0;
+   const char* b = reinterpret_cast<const char*>(recs.data());
+   for(size_t off = 0; off < r.end;) {
+      ssize_t w = ::write(r.fd, b + off, r.end - off);
+      if (w < 0 && errno == EINTR) continue;
+      if (w <= 0) {
+         ::close(r.fd);
+         throw "Could not write spill file";
+      }
+      off += w;
+   }
+   _runs.push_back(r);
+}
+
+bool uaspill::fill(reader& r) {
+   size_t n = std::min((uint64_t)__rblock, (r.end - r.pos) / sizeof(record));
+   r.buf.resize(n);
+   r.next = 0;
+   if (!n) {
+      std::vector<record>().swap(r.buf);
+      return false;
+   }
+   pread(r.fd, reinterpret_cast<char*>(r.buf.data()), n * sizeof(record), r.pos);
+   r.pos += n * sizeof(record);
+   return true;
+}
+
+bool uaspill::after(size_t a, size_t b) const {
+   return _runs[b].buf[_runs[b].next] < _runs[a].buf[_runs[a].next];
+}
+
+void uaspill::start() {
+   _merging = true;
+   for(size_t i = 0; i < _runs.size(); ++i)
+      if (fill(_runs[i])) _heap.push_back(i);
+   std::make_heap(_heap.begin(), _heap.end(),
+      [this](size_t a, size_t b) { return after(a, b); });
+}
+
+bool uaspill::group(uint64_t& size, std::vector<record>& recs, fvec_t& paths) {
+   if (!_merging) start();
+
+   // _heap is a min-heap of runs by their next record
+   auto later = [this](size_t a, size_t b) { return after(a, b); };
+
+   while(_heap.size()) {
+      recs.clear();
+      size = _runs[_heap.front()].buf[_runs[_heap.front()].next].size;
+      while(_heap.size()) {
+         reader& r = _runs[_heap.front()];
+         if (r.buf[r.next].size != size) break;
+         recs.push_back(r.buf[r.next]);
+         std::pop_heap(_heap.begin(), _heap.end(), later);
+         if (++r.next < r.buf.size() || fill(r))
+            std::push_heap(_heap.begin(), _heap.end(), later);
+         else _heap.pop_back();
+      }
+      if (recs.size() < 2) continue;
+
+      paths.clear();
+      for(const auto& rec : recs) {
+         paths.push_back(std::string(rec.len, '\0'));
+         if (rec.len) pread(_pfd, &paths.back()[0], rec.len, rec.off);
+      }
+      return true;
+   }
+   recs.clear();
+   paths.clear();
+   return false;
+}
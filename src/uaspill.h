@@ -0,0 +1,160 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code was developed for an EU.EDGE internal project and
+ * is made available according to the terms of this license.
+ *
+ * The Initial Developer of the Original Code is Istvan T. Hernadvolgyi,
+ * EU.EDGE LLC.
+ *
+ * Portions created by EU.EDGE LLC are Copyright (C) EU.EDGE LLC.
+ * All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+// EXTERNAL GROUPING OF PATHS BY SIZE - HEADER
+//
+
+#if !defined(_UASPILL_H_)
+#define _UASPILL_H_
+
+#include <filei.h>
+
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <stdint.h>
+}
+
+/** Grouping of paths by file size on disk.
+ *
+ * For scans of more paths than fit in memory. Paths are appended to a
+ * path file as they are added. The scan reads them back in chunks,
+ * stats a chunk and writes its stat records, sorted by size, to a run
+ * file; the runs are then merged (k-way, by size) and every size group
+ * is read back as the merge reaches it. Memory use is bounded by a
+ * chunk while sorting and by the largest group while merging, instead
+ * of growing with the number of paths.
+ *
+ * The files are created in a given directory and unlinked right away,
+ * so they disappear with the process. Errors are thrown as const char*.
+ */
+class uaspill {
+
+   public:
+
+      /** Stat record of a path. */
+      struct record {
+         uint64_t size;  // byte count
+         uint64_t dev;   // device
+         uint64_t ino;   // inode
+         int64_t mtime;  // modification time (ns)
+         int64_t ctime;  // status change time (ns)
+         uint64_t off;   // offset of the path in the path file
+         uint32_t len;   // length of the path
+         uint32_t side;  // 1 for the right side (uascan::add)
+
+         bool operator<(const record& o) const {
+            if (size != o.size) return size < o.size;
+            if (dev != o.dev) return dev < o.dev;
+            return ino < o.ino;
+         }
+      };
+
+      /** Constructor.
+       * @param dir directory for the temporary files
+       */
+      uaspill(const std::string& dir);
+
+      /** Destructor. Closes (and so removes) the files. */
+      ~uaspill();
+
+      /** Append a path.
+       * @param path file name
+       * @param right on the right side in cross mode
+       */
+      void add(const std::string& path, bool right = false);
+
+      /** Number of paths added. */
+      size_t size() const { return _npaths; }
+
+      /** Read back the next chunk of paths added, in order.
+       * @param paths the paths (returned)
+       * @param offs their offsets in the path file (returned)
+       * @param sides their sides (returned)
+       * @param n at most this many
+       * @return false when all have been read
+       */
+      bool chunk(fvec_t& paths, std::vector<uint64_t>& offs,
+         std::vector<char>& sides, size_t n);
+
+      /** Sort records and write them as a run.
+       * @param recs the records (sorted in place)
+       */
+      void run(std::vector<record>& recs);
+
+      /** Number of runs written. */
+      size_t runs() const { return _runs.size(); }
+
+      /** Get the next group of paths with the same size from the runs.
+       * Sizes with one path are passed over. The paths come sorted by
+       * device and inode.
+       * @param size the size (returned)
+       * @param recs their records (returned)
+       * @param paths the paths (returned)
+       * @return false when the runs are exhausted
+       */
+      bool group(uint64_t& size, std::vector<record>& recs, fvec_t& paths);
+
+   private:
+
+      // a run file being merged
+      struct reader {
+         int fd;
+         uint64_t pos;               // next byte of the file to read
+         uint64_t end;               // size of the file
+         std::vector<record> buf;    // records read ahead
+         size_t next;                // next record in buf
+      };
+
+      std::string _dir;
+      int _pfd;           // path file
+      uint64_t _pend;     // bytes written to the path file
+      std::string _pbuf;  // not yet written
+      size_t _npaths;
+      uint64_t _rpos;     // next byte of the path file for chunk
+      std::string _rbuf;  // read by chunk, not yet parsed
+      std::vector<reader> _runs;
+      bool _merging;
+      std::vector<size_t> _heap; // runs by their next record
+
+      uaspill(const uaspill&);
+      uaspill& operator=(const uaspill&);
+
+      int temp();
+      void flush();
+      void pread(int fd, char* b, size_t n, uint64_t off);
+      bool fill(reader& r);
+      bool after(size_t a, size_t b) const;
+      void start();
+};
+
+#endif
@@ -0,0 +1,253 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code was developed for an EU.EDGE internal project and
+ * is made available according to the terms of this license.
+ *
+ * The Initial Developer of the Original Code is Istvan T. Hernadvolgyi,
+ * EU.EDGE LLC.
+ *
+ * Portions created by EU.EDGE LLC are Copyright (C) EU.EDGE LLC.
+ * All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+
+// RUN STATISTICS - IMPLEMENTATION
+//
+
+#include <uastats.h>
+
+#include <fstream>
+#include <mutex>
+
+extern "C" {
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/sysmacros.h>
+}
+
+bool uastats::_on = false;
+
+namespace {
+
+// counters of one thread
+struct __counters {
+   uastats::row rows[uastats::PHASES + uastats::LEVELS];
+   unsigned long long hits;
+   unsigned long long misses;
+};
+
+std::mutex __mtx;                 // guards __all
+std::vector<__counters*> __all;   // counters of every thread that recorded
+thread_local __counters* __mine = 0;
+double __start = 0;
+
+__counters& __local() {
+   if (!__mine) {
+      // owned by __all, outlives the thread
+      __mine = new __counters();
+      std::lock_guard<std::mutex> lock(__mtx);
+      __all.push_back(__mine);
+   }
+   return *__mine;
+}
+
+const char* __names[uastats::PHASES] = {
+   "ingest", "stat", "sample", "milestone", "hash", "stage2", "compare",
+   "output"
+};
+
+}
+
+double uastats::now() {
+   struct timespec ts;
+   ::clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+double uastats::tcpu() {
+   struct timespec ts;
+   ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void uastats::enable() {
+   __start = now();
+   _on = true;
+}
+
+uastats::scope::scope(phase p, int level)
+:_slot(-1),_t0(0),_c0(0) {
+   if (!_on) return;
+   _slot = slot(p, level);
+   _t0 = now();
+   _c0 = tcpu();
+   _io0 = filei::tio();
+}
+
+uastats::scope::~scope() {
+   if (_slot < 0) return;
+   row& r = __local().rows[_slot];
+   const filei_io& io = filei::tio();
+   r.busy += now() - _t0;
+   r.cpu += tcpu() - _c0;
+   ++r.jobs;
+   r.io.bytes += io.bytes - _io0.bytes;
+   r.io.reads += io.reads - _io0.reads;
+   r.io.opens += io.opens - _io0.opens;
+   r.io.stats += io.stats - _io0.stats;
+   r.io.ioctls += io.ioctls - _io0.ioctls;
+}
+
+void uastats::wall(phase p, double secs, int level) {
+   if (!_on) return;
+   __local().rows[slot(p, level)].wall += secs;
+}
+
+void uastats::files(phase p, size_t tested, size_t left, int level) {
+   if (!_on) return;
+   row& r = __local().rows[slot(p, level)];
+   r.tested += tested;
+   r.eliminated += tested - left;
+}
+
+void uastats::cache(bool hit) {
+   if (!_on) return;
+   ++(hit ? __local().hits : __local().misses);
+}
+
+// write a JSON string
+static void __jstr(std::ostream& os, const char* s) {
+   os << '"';
+   for(; *s; ++s) {
+      unsigned char c = *s;
+      if (c == '"' || c == '\\') os << '\\' << c;
+      else if (c < 0x20) {
+         char u[8];
+         ::snprintf(u, sizeof(u), "\\u%04x", c);
+         os << u;
+      } else os << c;
+   }
+   os << '"';
+}
+
+static void __jio(std::ostream& os, const filei_io& io) {
+   os << "\"bytes\": " << io.bytes << ", \"reads\": " << io.reads
+      << ", \"opens\": " << io.opens << ", \"stats\": " << io.stats
+      << ", \"ioctls\": " << io.ioctls;
+}
+
+static void __jrow(std::ostream& os, const uastats::row& r) {
+   os << "\"wall\": " << r.wall << ", \"busy\": " << r.busy
+      << ", \"cpu\": " << r.cpu << ", \"jobs\": " << r.jobs
+      << ", \"tested\": " << r.tested << ", \"eliminated\": "
+      << r.eliminated << ", ";
+   __jio(os, r.io);
+}
+
+static void __add(uastats::row& a, const uastats::row& b) {
+   a.wall += b.wall;
+   a.busy += b.busy;
+   a.cpu += b.cpu;
+   a.jobs += b.jobs;
+   a.tested += b.tested;
+   a.eliminated += b.eliminated;
+   a.io.bytes += b.io.bytes;
+   a.io.reads += b.io.reads;
+   a.io.opens += b.io.opens;
+   a.io.stats += b.io.stats;
+   a.io.ioctls += b.io.ioctls;
+}
+
+bool uastats::write(const std::string& path,
+   const std::vector<device>& devs, char* const* argv) {
+
+   double wall = now() - __start;
+
+   // merge the threads
+   __counters tot = __counters();
+   {
+      std::lock_guard<std::mutex> lock(__mtx);
+      for(const __counters* c : __all) {
+         for(int i = 0; i < PHASES + LEVELS; ++i) __add(tot.rows[i], c->rows[i]);
+         tot.hits += c->hits;
+         tot.misses += c->misses;
+      }
+   }
+   row all = row();
+   for(int i = 0; i < PHASES + LEVELS; ++i) __add(all, tot.rows[i]);
+
+   struct rusage ru;
+   ::getrusage(RUSAGE_SELF, &ru);
+
+   std::ofstream os(path.c_str());
+   if (!os.good()) return false;
+
+   os << "{\n  \"command\": [";
+   for(int i = 0; argv[i]; ++i) {
+      if (i) os << ", ";
+      __jstr(os, argv[i]);
+   }
+   os << "],\n  \"wall\": " << wall
+      << ",\n  \"user\": " << ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6
+      << ",\n  \"system\": " << ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6
+      << ",\n  \"max_rss_kb\": " << ru.ru_maxrss
+      << ",\n  \"cache\": {\"hits\": " << tot.hits << ", \"misses\": "
+      << tot.misses << "},\n  \"io\": {";
+   __jio(os, all.io);
+   os << "},\n  \"phases\": {";
+   for(int p = 0; p < PHASES; ++p) {
+      os << (p ? ",\n" : "\n") << "    \"" << __names[p] << "\": ";
+      if (p != MILESTONE) {
+         os << "{";
+         __jrow(os, tot.rows[p]);
+         os << "}";
+         continue;
+      }
+      os << "[";
+      bool first = true;
+      for(int l = 0; l < LEVELS; ++l) {
+         const row& r = tot.rows[PHASES + l];
+         if (!r.jobs && !r.tested) continue;
+         os << (first ? "\n" : ",\n") << "      {\"level\": " << l
+            << ", \"chunk\": " << (1024ull << (2 * l)) << ", ";
+         __jrow(os, r);
+         os << "}";
+         first = false;
+      }
+      os << (first ? "]" : "\n    ]");
+   }
+   os << "\n  },\n  \"devices\": [";
+   for(size_t i = 0; i < devs.size(); ++i) {
+      const device& d = devs[i];
+      os << (i ? ",\n" : "\n") << "    {\"dev\": \"" << major(d.dev) << ":"
+         << minor(d.dev) << "\", \"rotational\": "
+         << (d.rot ? "true" : "false") << ", \"jobs\": " << d.jobs
+         << ", \"bytes\": " << d.bytes << ", \"busy\": " << d.busy
+         << ", \"mb_per_s\": " << (d.busy > 0 ? d.bytes / 1048576.0 / d.busy : 0)
+         << ", \"depth\": " << d.depth << "}";
+   }
+   os << (devs.empty() ? "]" : "\n  ]") << "\n}\n";
+
+   return os.good();
+}
@@ -0,0 +1,173 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code was developed for an EU.EDGE internal project and
+ * is made available according to the terms of this license.
+ *
+ * The Initial Developer of the Original Code is Istvan T. Hernadvolgyi,
+ * EU.EDGE LLC.
+ *
+ * Portions created by EU.EDGE LLC are Copyright (C) EU.EDGE LLC.
+ * All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+// RUN STATISTICS - HEADER
+//
+
+#if !defined(_UASTATS_H_)
+#define _UASTATS_H_
+
+#include <filei.h>
+
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <sys/types.h>
+}
+
+/** Run statistics.
+ *
+ * Work is attributed to phases (and milestone stages to chunk levels).
+ * Each thread accumulates its own counters, so recording costs a few
+ * thread local additions and two clock reads per job; the counters of
+ * all threads are merged when the report is written. Nothing is
+ * recorded until uastats::enable is called.
+ *
+ * For every phase the report has
+ * <pre>
+ *    wall   seconds the phase took as seen by its caller (phases of
+ *           different size groups overlap, so these may add up to
+ *           more than the run)
+ *    busy   seconds worker threads spent in jobs of the phase
+ *    cpu    CPU seconds of those jobs
+ *    jobs, bytes, reads, opens, stats, ioctls
+ *    tested, eliminated   files entering the phase and dropped by it
+ * </pre>
+ */
+class uastats {
+
+   public:
+
+      /** Phases of a run. */
+      enum phase {
+         INGEST,    // reading file names
+         STAT,      // asking the FS for sizes
+         SAMPLE,    // sampling pre-filter
+         MILESTONE, // prefix milestones (per level)
+         HASH,      // (prefix) hash
+         STAGE2,    // second stage of -2
+         COMPARE,   // lockstep compare of pairs
+         OUTPUT,    // printing results
+         PHASES
+      };
+
+      /** Number of milestone levels recorded. */
+      static const int LEVELS = 16;
+
+      /** Counters of one phase (or milestone level). */
+      struct row {
+         double wall;
+         double busy;
+         double cpu;
+         unsigned long long jobs;
+         unsigned long long tested;
+         unsigned long long eliminated;
+         filei_io io;
+      };
+
+      /** Per-device totals, as reported by the scheduler. */
+      struct device {
+         dev_t dev;
+         bool rot;
+         unsigned long long jobs;
+         unsigned long long bytes;
+         double busy;
+         size_t depth;
+      };
+
+      /** Time one job on the calling thread.
+       * Measures wall and CPU time and the I/O counted by filei
+       * between construction and destruction.
+       */
+      class scope {
+         public:
+            scope(phase p, int level = 0);
+            ~scope();
+         private:
+            int _slot;
+            double _t0;
+            double _c0;
+            filei_io _io0;
+      };
+
+      /** Turn on recording. */
+      static void enable();
+
+      /** Tell whether recording is on. */
+      static bool enabled() { return _on; }
+
+      /** Add wall time of a phase as seen by its caller.
+       * @param p phase
+       * @param secs seconds
+       * @param level milestone level
+       */
+      static void wall(phase p, double secs, int level = 0);
+
+      /** Record the files entering and leaving a phase.
+       * @param p phase
+       * @param tested files entering
+       * @param left files surviving
+       * @param level milestone level
+       */
+      static void files(phase p, size_t tested, size_t left, int level = 0);
+
+      /** Record a cache lookup.
+       * @param hit whether it was a hit
+       */
+      static void cache(bool hit);
+
+      /** Seconds on a monotonic clock. */
+      static double now();
+
+      /** CPU seconds of the calling thread. */
+      static double tcpu();
+
+      /** Write the report as JSON.
+       * @param path file name
+       * @param devs per-device totals
+       * @param argv the command line (0 terminated)
+       * @return false if the file could not be written
+       */
+      static bool write(const std::string& path,
+         const std::vector<device>& devs, char* const* argv);
+
+   private:
+
+      static bool _on;
+
+      // milestone levels follow the phases
+      static int slot(phase p, int level) {
+         return p == MILESTONE ? PHASES + level : p;
+      }
+};
+
+#endif
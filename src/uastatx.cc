@@ -0,0 +1,319 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code was developed for an EU.EDGE internal project and
+ * is made available according to the terms of this license.
+ *
+ * The Initial Developer of the Original Code is Istvan T. Hernadvolgyi,
+ * EU.EDGE LLC.
+ *
+ * Portions created by EU.EDGE LLC are Copyright (C) EU.EDGE LLC.
+ * All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+// BATCHED STAT OF PATH NAMES - IMPLEMENTATION
+//
+
+#include <uastatx.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+extern "C" {
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+// IORING_OP_STATX came with 5.6, as did this feature flag
+#if defined(IORING_FEAT_RW_CUR_POS) && defined(__NR_io_uring_setup)
+#define __UA_URING
+#endif
+#endif
+#endif
+}
+
+// threads of the pool for slow stats, at most
+static const unsigned __pool_max = 64;
+
+// paths a pool thread takes at a time
+static const size_t __pool_block = 64;
+
+// stats timed before choosing, and the mean above which they are slow
+static const size_t __probe = 32;
+static const double __slow = 50e-6;
+
+static int64_t __ns(int64_t sec, int64_t nsec) {
+   return sec * 1000000000 + nsec;
+}
+
+// fstatat into a result
+static void __stat(const std::string& path, uastatx::result& o) {
+   struct stat st;
+   if (::fstatat(AT_FDCWD, path.c_str(), &st, 0)) {
+      o.err = errno;
+      return;
+   }
+   o.err = 0;
+   o.mode = st.st_mode;
+   o.size = st.st_size;
+   o.dev = st.st_dev;
+   o.ino = st.st_ino;
+   o.mtime = __ns(st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+   o.ctime = __ns(st.st_ctim.tv_sec, st.st_ctim.tv_nsec);
+}
+
+#if defined(__UA_URING)
+
+// what statx is asked for
+static const unsigned __mask = STATX_TYPE | STATX_MODE | STATX_SIZE |
+   STATX_INO | STATX_MTIME | STATX_CTIME;
+
+// a ring set up with raw syscalls (no liburing)
+struct uastatx::ring {
+   int fd;
+   unsigned entries;
+   void* sqmap;
+   size_t sqlen;
+   void* cqmap;
+   size_t cqlen;
+   struct io_uring_sqe* sqes;
+   size_t sqeslen;
+   unsigned* sqhead;
+   unsigned* sqtail;
+   unsigned* sqmask;
+   unsigned* sqarray;
+   unsigned* cqhead;
+   unsigned* cqtail;
+   unsigned* cqmask;
+   struct io_uring_cqe* cqes;
+
+   ring():fd(-1),sqmap(MAP_FAILED),cqmap(MAP_FAILED),sqes(0) {}
+
+   ~ring() {
+      if (sqes) ::munmap(sqes, sqeslen);
+      if (cqmap != MAP_FAILED && cqmap != sqmap) ::munmap(cqmap, cqlen);
+      if (sqmap != MAP_FAILED) ::munmap(sqmap, sqlen);
+      if (fd >= 0) ::close(fd);
+   }
+
+   // set up a ring of n entries that can do statx
+   bool setup(unsigned n) {
+      struct io_uring_params p;
+      ::memset(&p, 0, sizeof(p));
+      fd = ::syscall(__NR_io_uring_setup, n, &p);
+      if (fd < 0) return false;
+      if (!supported()) return false;
+
+      entries = p.sq_entries;
+      sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+      cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+      bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+      if (single) sqlen = cqlen = std::max(sqlen, cqlen);
+      sqmap = ::mmap(0, sqlen, PROT_READ | PROT_WRITE,
+         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+      if (sqmap == MAP_FAILED) return false;
+      cqmap = single ? sqmap : ::mmap(0, cqlen, PROT_READ | PROT_WRITE,
+         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+      if (cqmap == MAP_FAILED) return false;
+      sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+      void* m = ::mmap(0, sqeslen, PROT_READ | PROT_WRITE,
+         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+      if (m == MAP_FAILED) return false;
+      sqes = static_cast<struct io_uring_sqe*>(m);
+
+      char* sq = static_cast<char*>(sqmap);
+      char* cq = static_cast<char*>(cqmap);
+      sqhead = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+      sqtail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+      sqmask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+      sqarray = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+      cqhead = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+      cqtail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+      cqmask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+      cqes = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+      return true;
+   }
+
+   // whether the kernel knows IORING_OP_STATX
+   bool supported() {
+      const size_t ops = 256;
+      std::vector<char> buf(sizeof(struct io_uring_probe) +
+         ops * sizeof(struct io_uring_probe_op), 0);
+      struct io_uring_probe* p = reinterpret_cast<struct io_uring_probe*>(&buf[0]);
+      if (::syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, p, ops) < 0)
+         return false;
+      return p->last_op >= IORING_OP_STATX &&
+         (p->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+   }
+
+   int enter(unsigned submit, unsigned wait) {
+      return ::syscall(__NR_io_uring_enter, fd, submit, wait,
+         wait ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+   }
+};
+
+#else
+
+struct uastatx::ring {
+};
+
+#endif
+
+uastatx::uastatx(unsigned threads, unsigned depth)
+:_threads(std::max(1u, threads)),_depth(std::max(1u, depth)) {
+#if defined(__UA_URING)
+   std::unique_ptr<ring> r(new ring());
+   if (r->setup(_depth)) _ring.swap(r);
+#endif
+}
+
+uastatx::~uastatx() {
+}
+
+void uastatx::run(const fvec_t& paths, size_t b, size_t e,
+   std::vector<result>& out) {
+   out.resize(e - b);
+   if (b >= e) return;
+   filei::tio().stats += e - b;
+
+   size_t p = std::min(e, b + __probe);
+   std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+   for(size_t i = b; i < p; ++i) __stat(paths[i], out[i - b]);
+   double secs = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - t0).count();
+   if (p == e) return;
+
+   std::vector<result> rest;
+   if (secs / (p - b) < __slow) pool(paths, p, e, rest, _threads);
+   else if (!_ring || !queue(paths, p, e, rest)) {
+      _ring.reset(); // if it failed, do without from now on
+      pool(paths, p, e, rest, std::min(_depth, __pool_max));
+   }
+   std::copy(rest.begin(), rest.end(), out.begin() + (p - b));
+}
+
+bool uastatx::queue(const fvec_t& paths, size_t b, size_t e,
+   std::vector<result>& out) {
+#if defined(__UA_URING)
+   ring& r = *_ring;
+   out.resize(e - b);
+   // the kernel writes into these until the answer is collected
+   std::unique_ptr<struct statx[]> bufs(new struct statx[r.entries]);
+   std::vector<size_t> of(r.entries);  // path of each slot
+   std::vector<unsigned> slots;        // free slots
+   for(unsigned s = r.entries; s > 0; --s) slots.push_back(s - 1);
+
+   size_t next = b;
+   unsigned inflight = 0;
+   unsigned tail = *r.sqtail;
+   while(next < e || inflight) {
+      // queue requests into the free slots
+      const unsigned mask = *r.sqmask;
+      while(next < e && slots.size()) {
+         unsigned s = slots.back();
+         slots.pop_back();
+         struct io_uring_sqe* sqe = &r.sqes[tail & mask];
+         ::memset(sqe, 0, sizeof(*sqe));
+         sqe->opcode = IORING_OP_STATX;
+         sqe->fd = AT_FDCWD;
+         sqe->addr = (uint64_t)(uintptr_t)paths[next].c_str();
+         sqe->len = __mask;
+         sqe->off = (uint64_t)(uintptr_t)&bufs[s];
+         sqe->user_data = s;
+         r.sqarray[tail & mask] = tail & mask;
+         ++tail;
+         of[s] = next++;
+         ++inflight;
+      }
+      __atomic_store_n(r.sqtail, tail, __ATOMIC_RELEASE);
+
+      // submit what the kernel has not taken yet, wait for one answer
+      unsigned pending = tail - __atomic_load_n(r.sqhead, __ATOMIC_ACQUIRE);
+      if (r.enter(pending, 1) < 0 && errno != EINTR && errno != EAGAIN &&
+          errno != EBUSY) {
+         // take back what the kernel has not taken, wait for the rest
+         unsigned taken = __atomic_load_n(r.sqhead, __ATOMIC_ACQUIRE);
+         __atomic_store_n(r.sqtail, taken, __ATOMIC_RELEASE);
+         inflight -= tail - taken;
+         while(inflight) {
+            unsigned head = *r.cqhead;
+            unsigned ctail = __atomic_load_n(r.cqtail, __ATOMIC_ACQUIRE);
+            inflight -= ctail - head;
+            __atomic_store_n(r.cqhead, ctail, __ATOMIC_RELEASE);
+            if (inflight && r.enter(0, 1) < 0 && errno != EINTR) {
+               // cannot tell when they are done: leave them the buffers
+               bufs.release();
+               break;
+            }
+         }
+         return false;
+      }
+
+      // collect the answers
+      unsigned head = *r.cqhead;
+      unsigned ctail = __atomic_load_n(r.cqtail, __ATOMIC_ACQUIRE);
+      for(; head != ctail; ++head) {
+         const struct io_uring_cqe* cqe = &r.cqes[head & *r.cqmask];
+         unsigned s = (unsigned)cqe->user_data;
+         result& o = out[of[s] - b];
+         const struct statx& x = bufs[s];
+         o.err = cqe->res < 0 ? -cqe->res : 0;
+         o.mode = x.stx_mode;
+         o.size = x.stx_size;
+         o.dev = makedev(x.stx_dev_major, x.stx_dev_minor);
+         o.ino = x.stx_ino;
+         o.mtime = __ns(x.stx_mtime.tv_sec, x.stx_mtime.tv_nsec);
+         o.ctime = __ns(x.stx_ctime.tv_sec, x.stx_ctime.tv_nsec);
+         slots.push_back(s);
+         --inflight;
+      }
+      __atomic_store_n(r.cqhead, head, __ATOMIC_RELEASE);
+   }
+   return true;
+#else
+   return false;
+#endif
+}
+
+void uastatx::pool(const fvec_t& paths, size_t b, size_t e,
+   std::vector<result>& out, unsigned threads) {
+   out.resize(e - b);
+   std::atomic<size_t> next(b);
+   auto work = [&]() {
+      for(size_t i; (i = next.fetch_add(__pool_block)) < e;)
+         for(size_t k = i; k < std::min(e, i + __pool_block); ++k)
+            __stat(paths[k], out[k - b]);
+   };
+   size_t n = std::min((size_t)threads, (e - b + __pool_block - 1) / __pool_block);
+   std::vector<std::thread> pool;
+   for(size_t t = 1; t < n; ++t) pool.push_back(std::thread(work));
+   work();
+   for(auto& t : pool) t.join();
+}
@@ -0,0 +1,124 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code was developed for an EU.EDGE internal project and
+ * is made available according to the terms of this license.
+ *
+ * The Initial Developer of the Original Code is Istvan T. Hernadvolgyi,
+ * EU.EDGE LLC.
+ *
+ * Portions created by EU.EDGE LLC are Copyright (C) EU.EDGE LLC.
+ * All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+// BATCHED STAT OF PATH NAMES - HEADER
+//
+
+#if !defined(_UASTATX_H_)
+#define _UASTATX_H_
+
+#include <filei.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <stdint.h>
+}
+
+/** Batched stat of many path names.
+ *
+ * run stats a range of path names. It first times a few stats on the
+ * calling thread. When they are quick (the metadata is cached or the
+ * disk is local), waiting is not what the time goes on, and the rest is
+ * done by a few threads calling fstatat, one per CPU the scan may use.
+ *
+ * When they are slow, as on network and FUSE file systems where every
+ * stat is a round trip, the rest goes through statx. The requests ask
+ * only for what a scan needs: type, size, inode, mtime and ctime (the
+ * device comes with every answer). On Linux with io_uring they go on
+ * a ring with up to depth of them in flight, so one thread keeps
+ * hundreds of stats going while the kernel runs them on its async
+ * workers. Where io_uring is missing or not allowed (old kernels,
+ * seccomp filters, other systems), a pool of up to depth threads calls
+ * fstatat instead.
+ *
+ * run may not be called from several threads at once.
+ */
+class uastatx {
+
+   public:
+
+      /** What a stat tells about a file. */
+      struct result {
+         int err;         // 0, or the errno of the failed stat
+         uint32_t mode;   // st_mode
+         uint64_t size;
+         uint64_t dev;
+         uint64_t ino;
+         int64_t mtime;   // ns
+         int64_t ctime;   // ns
+      };
+
+      /** Constructor.
+       * @param threads threads for quick stats
+       * @param depth stats in flight when they are slow: ring size, or
+       *        the threads of the pool (at most 64 of them)
+       */
+      uastatx(unsigned threads, unsigned depth = 256);
+
+      ~uastatx();
+
+      /** Stat paths [b,e).
+       * Counts the stats in filei::tio of the calling thread.
+       * @param paths path names
+       * @param b first
+       * @param e last + 1
+       * @param out one result per path (returned)
+       */
+      void run(const fvec_t& paths, size_t b, size_t e,
+         std::vector<result>& out);
+
+      /** Whether the stats go through io_uring. */
+      bool uring() const { return _ring != 0; }
+
+   private:
+
+      struct ring;
+
+      unsigned _threads;
+      unsigned _depth;
+      std::unique_ptr<ring> _ring;
+
+      uastatx(const uastatx&);
+      uastatx& operator=(const uastatx&);
+
+      // stat through the ring; false if the ring failed
+      bool queue(const fvec_t& paths, size_t b, size_t e,
+         std::vector<result>& out);
+
+      // stat on a pool of threads (the calling one among them)
+      static void pool(const fvec_t& paths, size_t b, size_t e,
+         std::vector<result>& out, unsigned threads);
+};
+
+#endif
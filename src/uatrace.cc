@@ -0,0 +1,180 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code was developed for an EU.EDGE internal project and
+ * is made available according to the terms of this license.
+ *
+ * The Initial Developer of the Original Code is Istvan T. Hernadvolgyi,
+ * EU.EDGE LLC.
+ *
+ * Portions created by EU.EDGE LLC are Copyright (C) EU.EDGE LLC.
+ * All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+// TRACE OF SCAN TIMELINES - IMPLEMENTATION
+//
+
+#include <uatrace.h>
+
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <vector>
+
+extern "C" {
+#include <time.h>
+#include <sys/sysmacros.h>
+}
+
+bool uatrace::_on = false;
+
+namespace {
+
+// one recorded span
+struct __event {
+   const char* name;
+   const char* cat;
+   const char* key;
+   long long size;
+   long long val;
+   dev_t dev;
+   uint64_t t0;  // ns since enable
+   uint64_t t1;
+};
+
+// ring of one thread: only the owner writes, write reads the published
+// head (release/acquire)
+struct __ring {
+   std::atomic<uint64_t> head;
+   int tid;
+   const char* name;
+   dev_t dev;
+   __event ev[uatrace::SPANS];
+};
+
+const dev_t __nodev = ~(dev_t)0;
+
+std::mutex __mtx;              // guards __all
+std::vector<__ring*> __all;    // rings of every thread that recorded
+thread_local __ring* __mine = 0;
+thread_local const char* __tname = 0;
+uint64_t __start = 0;
+
+uint64_t __ns() {
+   struct timespec ts;
+   ::clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+__ring& __local() {
+   if (!__mine) {
+      // owned by __all, outlives the thread
+      __mine = new __ring();
+      __mine->head.store(0, std::memory_order_relaxed);
+      __mine->name = __tname;
+      __mine->dev = __nodev;
+      std::lock_guard<std::mutex> lock(__mtx);
+      __mine->tid = (int)__all.size() + 1;
+      __all.push_back(__mine);
+   }
+   return *__mine;
+}
+
+}
+
+void uatrace::enable() {
+   __start = __ns();
+   _on = true;
+}
+
+void uatrace::device(dev_t dev) {
+   if (!_on) return;
+   __local().dev = dev;
+}
+
+void uatrace::name(const char* name) {
+   __tname = name;
+   if (__mine) __mine->name = name;
+}
+
+uatrace::span::span(const char* name, const char* cat, long long size,
+   const char* key, long long val)
+:_name(0),_cat(cat),_key(key),_size(size),_val(val),_t0(0) {
+   if (!_on) return;
+   _name = name;
+   _t0 = __ns();
+}
+
+uatrace::span::~span() {
+   if (!_name) return;
+   __ring& r = __local();
+   uint64_t h = r.head.load(std::memory_order_relaxed);
+   __event& e = r.ev[h % SPANS];
+   e.name = _name;
+   e.cat = _cat;
+   e.key = _key;
+   e.size = _size;
+   e.val = _val;
+   e.dev = r.dev;
+   e.t0 = _t0 - __start;
+   e.t1 = __ns() - __start;
+   r.head.store(h + 1, std::memory_order_release);
+}
+
+bool uatrace::write(const std::string& path) {
+   std::ofstream os(path.c_str());
+   if (!os.good()) return false;
+
+   std::lock_guard<std::mutex> lock(__mtx);
+   os << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+   os << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, "
+         "\"args\": {\"name\": \"ua\"}}";
+   os.precision(3);
+   os.setf(std::ios::fixed);
+   for(const __ring* r : __all) {
+      uint64_t h = r->head.load(std::memory_order_acquire);
+      uint64_t b = h > SPANS ? h - SPANS : 0;
+      os << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+            "\"tid\": " << r->tid << ", \"args\": {\"name\": \""
+         << (r->name ? r->name : "thread") << " " << r->tid;
+      if (b) os << " (" << b << " spans dropped)";
+      os << "\"}}";
+      for(uint64_t i = b; i < h; ++i) {
+         const __event& e = r->ev[i % SPANS];
+         os << ",\n{\"name\": \"" << e.name << "\", \"cat\": \"" << e.cat
+            << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << r->tid
+            << ", \"ts\": " << e.t0 / 1000.0 << ", \"dur\": "
+            << (e.t1 - e.t0) / 1000.0 << ", \"args\": {";
+         const char* sep = "";
+         if (e.size >= 0) { os << "\"size\": " << e.size; sep = ", "; }
+         if (e.dev != __nodev) {
+            os << sep << "\"dev\": \"" << major(e.dev) << ":" << minor(e.dev)
+               << "\"";
+            sep = ", ";
+         }
+         if (e.key) os << sep << "\"" << e.key << "\": " << e.val;
+         os << "}}";
+      }
+   }
+   os << "\n]}\n";
+
+   return os.good();
+}
@@ -0,0 +1,119 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code was developed for an EU.EDGE internal project and
+ * is made available according to the terms of this license.
+ *
+ * The Initial Developer of the Original Code is Istvan T. Hernadvolgyi,
+ * EU.EDGE LLC.
+ *
+ * Portions created by EU.EDGE LLC are Copyright (C) EU.EDGE LLC.
+ * All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+// TRACE OF SCAN TIMELINES - HEADER
+//
+
+#if !defined(_UATRACE_H_)
+#define _UATRACE_H_
+
+#include <string>
+
+extern "C" {
+#include <stdint.h>
+#include <sys/types.h>
+}
+
+/** Timeline recorder writing Chrome Trace Event JSON.
+ *
+ * A span is a named interval on the calling thread, tagged with a file
+ * (or group) size, the device the thread is reading from (see device)
+ * and one optional named count. Spans go into a ring buffer owned by the
+ * thread: recording takes two clock reads and a few stores, without
+ * locks or allocation. When a buffer is full the oldest spans are
+ * overwritten. Nothing is recorded until uatrace::enable is called, so
+ * the spans can stay compiled in.
+ *
+ * The file written by uatrace::write loads into chrome://tracing or
+ * https://ui.perfetto.dev; each thread is a track and idle scheduler
+ * workers show up as "idle" spans.
+ */
+class uatrace {
+
+   public:
+
+      /** Number of spans kept per thread. */
+      static const size_t SPANS = 1 << 16;
+
+      /** Record a span from construction to destruction.
+       * name, cat and key must be string literals (only the pointers
+       * are stored).
+       */
+      class span {
+         public:
+            /** Constructor.
+             * @param name name of the span
+             * @param cat category
+             * @param size file or group size, negative if none
+             * @param key name of the count, 0 if none
+             * @param val the count
+             */
+            span(const char* name, const char* cat, long long size = -1,
+               const char* key = 0, long long val = 0);
+            ~span();
+         private:
+            const char* _name;
+            const char* _cat;
+            const char* _key;
+            long long _size;
+            long long _val;
+            uint64_t _t0;
+      };
+
+      /** Turn on recording. */
+      static void enable();
+
+      /** Tell whether recording is on. */
+      static bool enabled() { return _on; }
+
+      /** Set the device spans of the calling thread are tagged with.
+       * @param dev device id, ~0 for none
+       */
+      static void device(dev_t dev);
+
+      /** Name the calling thread in the trace.
+       * @param name a string literal
+       */
+      static void name(const char* name);
+
+      /** Write the trace.
+       * Call when the recording threads are quiet.
+       * @param path file name
+       * @return false if the file could not be written
+       */
+      static bool write(const std::string& path);
+
+   private:
+
+      static bool _on;
+};
+
+#endif
@@ -0,0 +1,462 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code was developed for an EU.EDGE internal project and
+ * is made available according to the terms of this license.
+ *
+ * The Initial Developer of the Original Code is Istvan T. Hernadvolgyi,
+ * EU.EDGE LLC.
+ *
+ * Portions created by EU.EDGE LLC are Copyright (C) EU.EDGE LLC.
+ * All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+// CONTINUOUS SCAN OF A DIRECTORY TREE - IMPLEMENTATION
+//
+
+#include <uawatch.h>
+#include <uatrace.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+
+extern "C" {
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
+}
+
+static const char __magic[8] = { 'U', 'A', 'I', 'N', 'D', 'E', 'X', 2 };
+
+#if defined(__linux__)
+static const uint32_t __mask = IN_CLOSE_WRITE | IN_CREATE | IN_ATTRIB |
+   IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_DELETE_SELF;
+#endif
+
+// milliseconds without events before the changes are settled
+static const int __quiet_ms = 100;
+
+uawatch::uawatch(uascan& scanner, const std::string& root,
+   const std::string& index)
+:_scanner(scanner),_root(root),_ifile(index),_msg(""),_fd(-1) {
+   while(_root.size() > 1 && _root[_root.size() - 1] == '/')
+      _root.erase(_root.size() - 1);
+}
+
+uawatch::~uawatch() {
+   if (_fd >= 0) ::close(_fd);
+}
+
+void uawatch::say(const std::string& msg) {
+   if (_log) _log(msg);
+}
+
+// read the index saved by an earlier run, if it fits the options
+bool uawatch::read(const std::string& file, const uascan::options& o,
+   index_t& index) {
+   FILE* fp = ::fopen(file.c_str(), "rb");
+   if (!fp) return false;
+
+   char magic[8];
+   uint8_t alg, ic;
+   bool ok = ::fread(magic, sizeof(magic), 1, fp) == 1 &&
+      !::memcmp(magic, __magic, sizeof(magic)) &&
+      ::fread(&alg, 1, 1, fp) == 1 && ::fread(&ic, 1, 1, fp) == 1 &&
+      alg == (uint8_t)o.alg && ic == (uint8_t)o.ic;
+   while(ok) {
+      entry e;
+      uint8_t dl;
+      uint32_t pl;
+      if (::fread(&e.size, sizeof(e.size), 1, fp) != 1) break;
+      ok = ::fread(&e.mtime, sizeof(e.mtime), 1, fp) == 1 &&
+         ::fread(&e.ctime, sizeof(e.ctime), 1, fp) == 1 &&
+         ::fread(&e.dev, sizeof(e.dev), 1, fp) == 1 &&
+         ::fread(&e.ino, sizeof(e.ino), 1, fp) == 1 &&
+         ::fread(&dl, 1, 1, fp) == 1;
+      if (ok) {
+         e.digest.resize(dl);
+         ok = !dl || ::fread(&e.digest[0], dl, 1, fp) == 1;
+      }
+      ok = ok && ::fread(&pl, sizeof(pl), 1, fp) == 1;
+      std::string path(ok ? pl : 0, '\0');
+      ok = ok && (!pl || ::fread(&path[0], pl, 1, fp) == 1);
+      if (ok) index[path] = e;
+   }
+   ::fclose(fp);
+
+   if (!ok) index.clear();
+   return ok;
+}
+
+bool uawatch::load() {
+   if (_ifile.empty() || ::access(_ifile.c_str(), F_OK)) return false;
+
+   if (!read(_ifile, _scanner.config(), _index)) {
+      say("Ignoring index " + _ifile);
+      return false;
+   }
+   for(const auto& i : _index) _sizes[i.second.size].insert(i.first);
+   say("Loaded " + std::to_string(_index.size()) + " files from " + _ifile);
+   return true;
+}
+
+ua_error uawatch::save() {
+   if (_ifile.empty()) return ua_error::OK;
+   std::string tmp = _ifile + ".tmp";
+   FILE* fp = ::fopen(tmp.c_str(), "wb");
+   if (!fp) {
+      _msg = "Could not write index";
+      return ua_error::IO;
+   }
+
+   const uascan::options& o = _scanner.config();
+   uint8_t alg = (uint8_t)o.alg, ic = o.ic;
+   bool ok = ::fwrite(__magic, sizeof(__magic), 1, fp) == 1 &&
+      ::fwrite(&alg, 1, 1, fp) == 1 && ::fwrite(&ic, 1, 1, fp) == 1;
+   for(auto i = _index.begin(); ok && i != _index.end(); ++i) {
+      const entry& e = i->second;
+      uint8_t dl = e.digest.size();
+      uint32_t pl = i->first.size();
+      ok = ::fwrite(&e.size, sizeof(e.size), 1, fp) == 1 &&
+         ::fwrite(&e.mtime, sizeof(e.mtime), 1, fp) == 1 &&
+         ::fwrite(&e.ctime, sizeof(e.ctime), 1, fp) == 1 &&
+         ::fwrite(&e.dev, sizeof(e.dev), 1, fp) == 1 &&
+         ::fwrite(&e.ino, sizeof(e.ino), 1, fp) == 1 &&
+         ::fwrite(&dl, 1, 1, fp) == 1 &&
+         (!dl || ::fwrite(e.digest.data(), dl, 1, fp) == 1) &&
+         ::fwrite(&pl, sizeof(pl), 1, fp) == 1 &&
+         (!pl || ::fwrite(i->first.data(), pl, 1, fp) == 1);
+   }
+   ok = ::fclose(fp) == 0 && ok;
+   if (!ok || ::rename(tmp.c_str(), _ifile.c_str())) {
+      ::unlink(tmp.c_str());
+      _msg = "Could not write index";
+      return ua_error::IO;
+   }
+   return ua_error::OK;
+}
+
+// watch a directory and its subdirectories, collect the regular files
+void uawatch::watch(const std::string& dir, fvec_t& files) {
+#if defined(__linux__)
+   if (_fd >= 0) {
+      int wd = ::inotify_add_watch(_fd, dir.c_str(), __mask | IN_ONLYDIR);
+      if (wd < 0) say("Could not watch " + dir + ", " + ::strerror(errno));
+      else _wds[wd] = dir;
+   }
+#endif
+   DIR* d = ::opendir(dir.c_str());
+   if (!d) return;
+   while(struct dirent* de = ::readdir(d)) {
+      if (!::strcmp(de->d_name, ".") || !::strcmp(de->d_name, "..")) continue;
+      std::string path = dir + "/" + de->d_name;
+      struct stat si;
+      if (::lstat(path.c_str(), &si)) continue;
+      if (S_ISDIR(si.st_mode)) watch(path, files);
+      else if (S_ISREG(si.st_mode)) files.push_back(path);
+   }
+   ::closedir(d);
+}
+
+// take in the current state of a file
+void uawatch::update(const std::string& path, std::set<uint64_t>& sizes) {
+   struct stat si;
+   if (::lstat(path.c_str(), &si) || !S_ISREG(si.st_mode)) {
+      drop(path, sizes);
+      return;
+   }
+   entry e;
+   e.size = si.st_size;
+   e.mtime = (int64_t)si.st_mtim.tv_sec * 1000000000 + si.st_mtim.tv_nsec;
+   e.ctime = (int64_t)si.st_ctim.tv_sec * 1000000000 + si.st_ctim.tv_nsec;
+   e.dev = si.st_dev;
+   e.ino = si.st_ino;
+
+   std::map<std::string,entry>::iterator i = _index.find(path);
+   if (i != _index.end()) {
+      const entry& o = i->second;
+      // a rewrite that restores the mtime still moves the ctime
+      if (o.size == e.size && o.mtime == e.mtime && o.ctime == e.ctime &&
+          o.dev == e.dev && o.ino == e.ino) return;
+      bool same = o.dev == e.dev && o.ino == e.ino;
+      drop(path, sizes);
+      // changed in place: the old digest is not carried over below
+      if (same) _gone.erase(std::make_pair(e.dev, e.ino));
+   }
+   // renamed: the file dropped under its old name keeps its digest (a
+   // rename moves the ctime, so only the mtime tells)
+   std::map<std::pair<uint64_t,uint64_t>,entry>::iterator g =
+      _gone.find(std::make_pair(e.dev, e.ino));
+   if (g != _gone.end() && g->second.size == e.size &&
+       g->second.mtime == e.mtime) e.digest = g->second.digest;
+   _index[path] = e;
+   _sizes[e.size].insert(path);
+   sizes.insert(e.size);
+}
+
+void uawatch::drop(const std::string& path, std::set<uint64_t>& sizes) {
+   std::map<std::string,entry>::iterator i = _index.find(path);
+   if (i == _index.end()) return;
+   uint64_t size = i->second.size;
+   sizes.insert(size);
+   if (i->second.digest.size())
+      _gone[std::make_pair(i->second.dev, i->second.ino)] = i->second;
+   std::set<std::string>& b = _sizes[size];
+   b.erase(path);
+   if (b.empty()) _sizes.erase(size);
+   _index.erase(i);
+}
+
+// drop the files under a directory that went away
+void uawatch::forget(const std::string& dir, std::set<uint64_t>& sizes) {
+   std::string prefix = dir + "/";
+   std::map<std::string,entry>::iterator i = _index.lower_bound(prefix);
+   while(i != _index.end() && !i->first.compare(0, prefix.size(), prefix)) {
+      std::string path = (i++)->first;
+      drop(path, sizes);
+   }
+#if defined(__linux__)
+   for(std::map<int,std::string>::iterator w = _wds.begin(); w != _wds.end();) {
+      if (w->second == dir || !w->second.compare(0, prefix.size(), prefix)) {
+         ::inotify_rm_watch(_fd, w->first);
+         _wds.erase(w++);
+      } else ++w;
+   }
+#endif
+}
+
+// walk the whole tree again, e.g. after events were lost
+void uawatch::sync(std::set<uint64_t>& sizes) {
+   fvec_t files;
+   watch(_root, files);
+   std::set<std::string> seen(files.begin(), files.end());
+   for(const auto& f : files) update(f, sizes);
+   for(std::map<std::string,entry>::iterator i = _index.begin(); i != _index.end();) {
+      std::string path = (i++)->first;
+      if (!seen.count(path)) drop(path, sizes);
+   }
+}
+
+// hash what is needed for the sizes that changed and report the sets
+// that appeared, changed or fell apart
+void uawatch::settle(const std::set<uint64_t>& sizes) {
+   const uascan::options& o = _scanner.config();
+   uatrace::span sp("settle", "watch", -1, "sizes", sizes.size());
+
+   // files of unknown digest that now have a partner of their size
+   fvec_t todo;
+   for(uint64_t size : sizes) {
+      auto b = _sizes.find(size);
+      if (b == _sizes.end() || b->second.size() < 2) continue;
+      for(const auto& p : b->second)
+         if (_index[p].digest.empty()) todo.push_back(p);
+   }
+   if (todo.size()) {
+      std::mutex mtx;
+      std::map<std::string,std::string> digests;
+      _scanner.each(todo, [&](const std::string& path) {
+         uastats::scope sc(uastats::HASH);
+         try {
+            filei fi(path, o.ic, false, 0, o.bsize, o.alg);
+            std::lock_guard<std::mutex> lock(mtx);
+            digests[path].assign(reinterpret_cast<const char*>(fi.hash()),
+               fi.hash_len());
+         } catch(const char*) {
+         }
+      });
+      std::set<uint64_t> ignored;
+      for(const auto& p : todo) {
+         auto d = digests.find(p);
+         if (d != digests.end()) _index[p].digest = d->second;
+         else drop(p, ignored); // gone meanwhile, its event is queued
+      }
+      say("Hashed " + std::to_string(todo.size()) + " files");
+   }
+
+   for(uint64_t size : sizes) {
+      std::map<std::string,fvec_t> now;
+      auto b = _sizes.find(size);
+      if (b != _sizes.end())
+         for(const auto& p : b->second) {
+            const std::string& d = _index[p].digest;
+            if (d.size()) now[d].push_back(p);
+         }
+
+      uascan::group g;
+      g.size = size;
+      // the sets of this size known so far
+      auto s = _sets.lower_bound(key_t(size, std::string()));
+      while(s != _sets.end() && s->first.first == size) {
+         fvec_t& files = now[s->first.second];
+         g.digest = s->first.second;
+         g.files = files;
+         if (files.size() < 2) {
+            if (_event) _event("unset", g);
+            _sets.erase(s++);
+         } else {
+            if (files != s->second) {
+               s->second = files;
+               if (_event) _event("set", g);
+            }
+            ++s;
+         }
+         files.clear(); // done with
+      }
+      for(const auto& n : now) {
+         if (n.second.size() < 2) continue;
+         _sets[key_t(size, n.first)] = n.second;
+         g.digest = n.first;
+         g.files = n.second;
+         if (_event) _event("set", g);
+      }
+   }
+   _gone.clear();
+}
+
+ua_error uawatch::start() {
+#if defined(__linux__)
+   _fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+   if (_fd < 0) {
+      _msg = "Could not watch the tree";
+      return ua_error::IO;
+   }
+   struct stat si;
+   if (::stat(_root.c_str(), &si) || !S_ISDIR(si.st_mode)) {
+      _msg = "Not a directory";
+      return ua_error::INVALID_OPTION;
+   }
+
+   bool indexed = load();
+   std::set<uint64_t> sizes;
+   if (indexed) {
+      // only the files changed since the index was saved are hashed
+      sync(sizes);
+      std::set<uint64_t> all;
+      for(const auto& b : _sizes) if (b.second.size() > 1) all.insert(b.first);
+      settle(all);
+   } else {
+      // a full scan; digests of files without an identical partner
+      // stay unknown until they are needed
+      fvec_t files;
+      watch(_root, files);
+      for(const auto& f : files) {
+         update(f, sizes);
+         if (_scanner.add(f) != ua_error::OK) {
+            _msg = _scanner.message();
+            return ua_error::NO_MEMORY;
+         }
+      }
+      ua_error res = _scanner.run([this](const uascan::group& g) {
+         fvec_t files(g.files);
+         std::sort(files.begin(), files.end());
+         for(const auto& f : files) {
+            auto i = _index.find(f);
+            if (i != _index.end()) i->second.digest = g.digest;
+         }
+         _sets[key_t(g.size, g.digest)] = files;
+         uascan::group s;
+         s.size = g.size;
+         s.digest = g.digest;
+         s.files.swap(files);
+         if (_event) _event("set", s);
+      });
+      if (res != ua_error::OK) {
+         _msg = _scanner.message();
+         return res;
+      }
+   }
+   say("Watching " + std::to_string(_wds.size()) + " directories, " +
+      std::to_string(_index.size()) + " files");
+   return save();
+}
+
+ua_error uawatch::run(const volatile sig_atomic_t& stop) {
+#if defined(__linux__)
+   // inotify_event is followed by its name, keep the buffer aligned
+   union {
+      struct inotify_event ev;
+      char raw[1 << 16];
+   } u;
+   std::set<uint64_t> sizes;
+
+   while(!stop) {
+      struct pollfd pfd = { _fd, POLLIN, 0 };
+      int r = ::poll(&pfd, 1, sizes.empty() ? 1000 : __quiet_ms);
+      if (r < 0 && errno != EINTR) {
+         _msg = "Could not wait for events";
+         return ua_error::IO;
+      }
+      if (r <= 0) {
+         // quiet for a while: the changes are complete enough to hash
+         if (sizes.size()) {
+            settle(sizes);
+            sizes.clear();
+         }
+         continue;
+      }
+
+      ssize_t n = ::read(_fd, u.raw, sizeof(u.raw));
+      if (n <= 0) continue;
+      for(char* p = u.raw; p < u.raw + n;) {
+         struct inotify_event* ev = reinterpret_cast<struct inotify_event*>(p);
+         p += sizeof(struct inotify_event) + ev->len;
+
+         if (ev->mask & IN_Q_OVERFLOW) {
+            say("Events lost, walking the tree again");
+            sync(sizes);
+            continue;
+         }
+         std::map<int,std::string>::iterator w = _wds.find(ev->wd);
+         if (w == _wds.end()) continue;
+         if (ev->mask & IN_IGNORED) {
+            _wds.erase(w);
+            continue;
+         }
+         if (!ev->len) continue;
+         std::string path = w->second + "/" + ev->name;
+
+         if (ev->mask & IN_ISDIR) {
+            if (ev->mask & (IN_MOVED_FROM | IN_DELETE)) forget(path, sizes);
+            else if (ev->mask & (IN_MOVED_TO | IN_CREATE)) {
+               fvec_t files;
+               watch(path, files);
+               for(const auto& f : files) update(f, sizes);
+            }
+         } else if (ev->mask & (IN_MOVED_FROM | IN_DELETE)) drop(path, sizes);
+         else update(path, sizes);
+      }
+   }
+   if (sizes.size()) settle(sizes);
+   return ua_error::OK;
+#else
+   (void)stop;
+   _msg = "Watching is not supported on this platform";
+   return ua_error::INVALID_OPTION;
+#endif
+}
@@ -0,0 +1,167 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code was developed for an EU.EDGE internal project and
+ * is made available according to the terms of this license.
+ *
+ * The Initial Developer of the Original Code is Istvan T. Hernadvolgyi,
+ * EU.EDGE LLC.
+ *
+ * Portions created by EU.EDGE LLC are Copyright (C) EU.EDGE LLC.
+ * All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+// CONTINUOUS SCAN OF A DIRECTORY TREE - HEADER
+//
+
+#if !defined(_UAWATCH_H_)
+#define _UAWATCH_H_
+
+#include <uascan.h>
+
+#include <csignal>
+#include <map>
+#include <set>
+#include <string>
+
+extern "C" {
+#include <stdint.h>
+}
+
+/** Continuous scan of a directory tree.
+ *
+ * start walks the tree, finds the sets of identical files and reports
+ * each of them; run then follows the changes of the tree (inotify) and
+ * reports every set that appears, changes or falls apart. Only the
+ * files that changed are stat'ed and hashed again, and only when
+ * another file has the same size, so the cost follows the churn, not
+ * the tree.
+ *
+ * The index (path, size, mtime, ctime, inode, digest if known) is kept in
+ * memory and saved to a file, so a restart hashes only the files that
+ * changed in between. Without a saved index the first scan is a full
+ * uascan run. Digests of files that never had a partner of the same
+ * size are not known until they get one.
+ *
+ * The scanner supplies the options (hash algorithm, case, buffer size)
+ * and the worker pool that hashes. Sets are reported through the
+ * callback with "set" (the set is new or its files changed) or "unset"
+ * (fewer than two files are left, which the group lists).
+ */
+class uawatch {
+
+   public:
+
+      /** Called with an event ("set", "unset") and the set. */
+      typedef std::function<void(const char*, const uascan::group&)> event_fn;
+
+      /** Constructor.
+       * @param scanner options and worker pool
+       * @param root the directory tree
+       * @param index file to keep the index in, empty for none
+       */
+      uawatch(uascan& scanner, const std::string& root,
+         const std::string& index);
+
+      ~uawatch();
+
+      /** Set the event callback. */
+      void on_event(const event_fn& f) { _event = f; }
+
+      /** Set the log callback (verbose messages, watch problems). */
+      void on_log(const uascan::log_fn& f) { _log = f; }
+
+      /** Scan the tree and report its sets.
+       * @return OK, or the error (see message)
+       */
+      ua_error start();
+
+      /** Follow changes until stop is set.
+       * @param stop set (e.g. by a signal handler) to return
+       * @return OK, or the error (see message)
+       */
+      ua_error run(const volatile sig_atomic_t& stop);
+
+      /** Save the index.
+       * @return OK, or IO (see message)
+       */
+      ua_error save();
+
+      /** Message describing the last error returned. */
+      const char* message() const { return _msg; }
+
+      /** What the index knows about a file. */
+      struct entry {
+         uint64_t size;
+         int64_t mtime;       // ns
+         int64_t ctime;       // ns
+         uint64_t dev;
+         uint64_t ino;
+         std::string digest;  // empty if not known
+      };
+
+      /** The index: path name -> entry. */
+      typedef std::map<std::string,entry> index_t;
+
+      /** Read an index saved by a watch.
+       * @param file the index file
+       * @param o options of the scan the index is for; an index of another
+       *        hash algorithm or case handling is not read
+       * @param index the entries (returned)
+       * @return false if file is missing, damaged or not for o
+       */
+      static bool read(const std::string& file, const uascan::options& o,
+         index_t& index);
+
+   private:
+
+      typedef std::pair<uint64_t,std::string> key_t; // size, digest
+
+      uascan& _scanner;
+      std::string _root;
+      std::string _ifile;
+      const char* _msg;
+      event_fn _event;
+      uascan::log_fn _log;
+
+      index_t _index;
+      std::map<uint64_t,std::set<std::string> > _sizes;
+      std::map<key_t,fvec_t> _sets;
+      // files dropped since the last settle, by device and inode
+      std::map<std::pair<uint64_t,uint64_t>,entry> _gone;
+
+      int _fd;                               // inotify
+      std::map<int,std::string> _wds;        // watched directories
+
+      uawatch(const uawatch&);
+      uawatch& operator=(const uawatch&);
+
+      void say(const std::string& msg);
+      bool load();
+      void watch(const std::string& dir, fvec_t& files);
+      void update(const std::string& path, std::set<uint64_t>& sizes);
+      void drop(const std::string& path, std::set<uint64_t>& sizes);
+      void forget(const std::string& dir, std::set<uint64_t>& sizes);
+      void sync(std::set<uint64_t>& sizes);
+      void settle(const std::set<uint64_t>& sizes);
+};
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code was developed for an EU.EDGE internal project and
+ * is made available according to the terms of this license.
+ *
+ * The Initial Developer of the Original Code is Istvan T. Hernadvolgyi,
+ * EU.EDGE LLC.
+ *
+ * Portions created by EU.EDGE LLC are Copyright (C) EU.EDGE LLC.
+ * All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+// BUFFERED RESULT STREAM WITH BOUNDED LATENCY - IMPLEMENTATION
+//
+
+#include <uawriter.h>
+
+extern "C" {
+#include <errno.h>
+#include <unistd.h>
+}
+
+uawriter::uawriter(int fd, unsigned latency, size_t cap)
+:_fd(fd),_latency(latency),_cap(cap),_failed(false),_stop(false) {
+   _buf.reserve(_cap);
+   if (latency) _timer = std::thread(&uawriter::tick, this);
+}
+
+uawriter::~uawriter() {
+   {
+      std::lock_guard<std::mutex> lock(_mtx);
+      _stop = true;
+   }
+   _cv.notify_all();
+   if (_timer.joinable()) _timer.join();
+   flush();
+}
+
+void uawriter::drain() {
+   for(size_t off = 0; off < _buf.size() && !_failed;) {
+      ssize_t n = ::write(_fd, _buf.data() + off, _buf.size() - off);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) _failed = true;
+      else off += n;
+   }
+   _buf.clear();
+}
+
+void uawriter::commit(const char* p, size_t n) {
+   std::lock_guard<std::mutex> lock(_mtx);
+   if (_buf.size() + n > _cap) drain();
+   bool first = _buf.empty();
+   _buf.append(p, n);
+   if (!_latency.count() || _buf.size() >= _cap) drain();
+   else if (first) {
+      _oldest = clock_t::now();
+      _cv.notify_one();
+   }
+}
+
+bool uawriter::flush() {
+   std::lock_guard<std::mutex> lock(_mtx);
+   drain();
+   return !_failed;
+}
+
+void uawriter::tick() {
+   std::unique_lock<std::mutex> lock(_mtx);
+   while(!_stop) {
+      if (_buf.empty()) {
+         _cv.wait(lock);
+         continue;
+      }
+      clock_t::time_point due = _oldest + _latency;
+      if (clock_t::now() >= due) drain();
+      else _cv.wait_until(lock, due);
+   }
+}
@@ -0,0 +1,113 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code was developed for an EU.EDGE internal project and
+ * is made available according to the terms of this license.
+ *
+ * The Initial Developer of the Original Code is Istvan T. Hernadvolgyi,
+ * EU.EDGE LLC.
+ *
+ * Portions created by EU.EDGE LLC are Copyright (C) EU.EDGE LLC.
+ * All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+// BUFFERED RESULT STREAM WITH BOUNDED LATENCY - HEADER
+//
+
+#if !defined(_UAWRITER_H_)
+#define _UAWRITER_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/** Buffered writer of result records to a file descriptor.
+ *
+ * Records are appended to a buffer and written out when the buffer
+ * fills up or, at the latest, latency milliseconds after the oldest
+ * unwritten record was committed; a background thread takes care of the
+ * latter. So a consumer reading the stream sees every record within the
+ * latency bound, while a scan producing millions of records does not
+ * pay a write per record. A latency of 0 writes at every commit.
+ *
+ * Records are never split between writes unless one is larger than the
+ * buffer. All members are thread-safe.
+ */
+class uawriter {
+
+   public:
+
+      /** Constructor.
+       * @param fd where to write (not closed)
+       * @param latency flush bound in milliseconds
+       * @param cap buffer capacity in bytes
+       */
+      uawriter(int fd, unsigned latency, size_t cap = 1 << 16);
+
+      /** Destructor. Flushes and stops the background thread. */
+      ~uawriter();
+
+      /** Append a complete record.
+       * @param p data
+       * @param n length
+       */
+      void commit(const char* p, size_t n);
+
+      /** Append a complete record. */
+      void commit(const std::string& s) { commit(s.data(), s.size()); }
+
+      /** Write out everything buffered.
+       * @return false if a write failed (now or before)
+       */
+      bool flush();
+
+      /** Tell whether all writes succeeded so far. */
+      bool good() const { return !_failed; }
+
+   private:
+
+      typedef std::chrono::steady_clock clock_t;
+
+      int _fd;
+      std::chrono::milliseconds _latency;
+      size_t _cap;
+      bool _failed;
+
+      std::mutex _mtx;
+      std::condition_variable _cv;
+      std::string _buf;
+      clock_t::time_point _oldest; // commit time of the oldest record in _buf
+      bool _stop;
+      std::thread _timer;
+
+      uawriter(const uawriter&);
+      uawriter& operator=(const uawriter&);
+
+      // write the buffer (_mtx held)
+      void drain();
+
+      // background flusher
+      void tick();
+};
+
+#endif